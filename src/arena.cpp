@@ -0,0 +1,84 @@
+#include "arena.h"
+#include <sys/mman.h>
+
+ChunkArena::ChunkArena()
+    : base(nullptr), map_size(0), chunk_size(0), closed(true) {
+}
+
+ChunkArena::~ChunkArena() {
+    cleanup();
+}
+
+bool ChunkArena::init(size_t size, int count) {
+    map_size = size * count;
+    void* mem = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        map_size = 0;
+        return false;
+    }
+    base = static_cast<char*>(mem);
+    chunk_size = size;
+    
+    chunks.resize(count);
+    free_list.clear();
+    for (int i = 0; i < count; i++) {
+        chunks[i].data = base + i * size;
+        chunks[i].len = 0;
+        chunks[i].frame_end = false;
+        free_list.push_back(&chunks[i]);
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = false;
+    return true;
+}
+
+ArenaChunk* ChunkArena::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    available.wait(lock, [this] { return closed || !free_list.empty(); });
+    if (closed) return nullptr;
+    
+    ArenaChunk* chunk = free_list.back();
+    free_list.pop_back();
+    chunk->len = 0;
+    chunk->frame_end = false;
+    return chunk;
+}
+
+ArenaChunk* ChunkArena::tryAcquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed || free_list.empty()) return nullptr;
+    
+    ArenaChunk* chunk = free_list.back();
+    free_list.pop_back();
+    chunk->len = 0;
+    chunk->frame_end = false;
+    return chunk;
+}
+
+void ChunkArena::release(ArenaChunk* chunk) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_list.push_back(chunk);
+    }
+    available.notify_one();
+}
+
+void ChunkArena::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+    available.notify_all();
+}
+
+void ChunkArena::cleanup() {
+    close();
+    if (base) {
+        munmap(base, map_size);
+        base = nullptr;
+    }
+    chunks.clear();
+    free_list.clear();
+    map_size = 0;
+}
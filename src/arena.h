@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+struct ArenaChunk {
+    char* data;
+    size_t len;
+    bool frame_end;
+};
+
+// A fixed pool of equally sized chunks carved out of one mapping made up
+// front. Frames are encoded straight into chunks and handed to the writer as
+// each one fills, so memory per session is bounded by the pool no matter how
+// large the terminal, and acquire() blocking on an empty pool is what slows
+// the renderer down to the speed of the output.
+class ChunkArena {
+private:
+    char* base;
+    size_t map_size;
+    size_t chunk_size;
+    std::vector<ArenaChunk> chunks;
+    std::vector<ArenaChunk*> free_list;
+    
+    std::mutex mutex;
+    std::condition_variable available;
+    bool closed;
+    
+public:
+    ChunkArena();
+    ~ChunkArena();
+    
+    bool init(size_t size, int count);
+    
+    // Blocks until a chunk is free; nullptr once the arena is closed
+    ArenaChunk* acquire();
+    // nullptr right away when no chunk is free
+    ArenaChunk* tryAcquire();
+    void release(ArenaChunk* chunk);
+    void close();
+    
+    char* getBase() const { return base; }
+    size_t getMapSize() const { return map_size; }
+    size_t getChunkSize() const { return chunk_size; }
+    
+    void cleanup();
+};
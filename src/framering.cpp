@@ -0,0 +1,205 @@
+#include "framering.h"
+#include "unixsocket.h"
+#include <cstring>
+#include <new>
+#include <chrono>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring needs lock-free 64-bit atomics");
+
+FrameRing::FrameRing()
+    : listen_fd(-1), ring_fd(-1), map(nullptr), map_size(0),
+      slots(0), slot_size(0), max_width(0), max_height(0), seq(0) {
+}
+
+FrameRing::~FrameRing() {
+    cleanup();
+}
+
+bool FrameRing::init(const std::string& path, int slot_count) {
+    cleanup();
+    
+    if (path.size() >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        std::cerr << "Frame ring socket path too long\n";
+        return false;
+    }
+    
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return false;
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (!clearStaleSocket(path, addr)) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 8) != 0) {
+        std::cerr << "Failed to listen on " << path << "\n";
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    
+    socket_path = path;
+    slots = slot_count < 2 ? 2 : slot_count;
+    return true;
+}
+
+bool FrameRing::createRing(int width, int height) {
+    destroyRing();
+    
+    size_t pixels = (size_t)width * height * 4;
+    size_t slot_bytes = (sizeof(FrameRingSlot) + pixels + 63) & ~(size_t)63;
+    size_t header_bytes = (sizeof(FrameRingHeader) + 63) & ~(size_t)63;
+    size_t total = header_bytes + slot_bytes * slots;
+    
+    ring_fd = memfd_create("mirrors-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring_fd < 0) return false;
+    if (ftruncate(ring_fd, total) != 0) {
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+    fcntl(ring_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    
+    void* addr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (addr == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+    
+    map = (uint8_t*)addr;
+    map_size = total;
+    slot_size = slot_bytes;
+    max_width = width;
+    max_height = height;
+    seq = 0;
+    
+    FrameRingHeader* hdr = new (map) FrameRingHeader();
+    hdr->magic = FRAME_RING_MAGIC;
+    hdr->version = FRAME_RING_VERSION;
+    hdr->slots = slots;
+    hdr->max_width = width;
+    hdr->max_height = height;
+    hdr->slot_size = slot_size;
+    hdr->seq.store(0, std::memory_order_relaxed);
+    hdr->closed.store(0, std::memory_order_relaxed);
+    
+    for (uint32_t i = 0; i < slots; ++i) {
+        FrameRingSlot* slot = new (map + header_bytes + (size_t)i * slot_size) FrameRingSlot();
+        slot->seq.store(0, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+void FrameRing::destroyRing() {
+    if (map) {
+        // Readers still holding the old mapping see this and reconnect
+        ((FrameRingHeader*)map)->closed.store(1, std::memory_order_release);
+        munmap(map, map_size);
+        map = nullptr;
+        map_size = 0;
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+// Each new reader gets the ring fd and the current header size, then the
+// connection is done; all further traffic goes through the shared memory.
+void FrameRing::acceptClients() {
+    if (listen_fd < 0) return;
+    
+    while (true) {
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) break;
+        
+        if (ring_fd >= 0) {
+            uint64_t info = map_size;
+            struct iovec iov = { &info, sizeof(info) };
+            
+            char control[CMSG_SPACE(sizeof(int))];
+            memset(control, 0, sizeof(control));
+            
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &ring_fd, sizeof(int));
+            
+            sendmsg(client, &msg, MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+}
+
+void FrameRing::publish(const uint8_t* pixels, int width, int height, int bytes_per_line,
+                        int dx, int dy, int dw, int dh) {
+    if (listen_fd < 0 || !pixels || width <= 0 || height <= 0) return;
+    
+    if (!map || (uint32_t)width > max_width || (uint32_t)height > max_height) {
+        if (!createRing(width, height)) return;
+        dx = 0; dy = 0; dw = width; dh = height;
+    }
+    
+    size_t header_bytes = (sizeof(FrameRingHeader) + 63) & ~(size_t)63;
+    FrameRingHeader* hdr = (FrameRingHeader*)map;
+    
+    uint64_t n = seq + 1;
+    uint8_t* base = map + header_bytes + (size_t)((n - 1) % slots) * slot_size;
+    FrameRingSlot* slot = (FrameRingSlot*)base;
+    uint8_t* dst = base + sizeof(FrameRingSlot);
+    
+    slot->seq.store(2 * n - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    
+    size_t row = (size_t)width * 4;
+    for (int y = 0; y < height; ++y) {
+        memcpy(dst + y * row, pixels + (size_t)y * bytes_per_line, row);
+    }
+    
+    slot->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    slot->width = width;
+    slot->height = height;
+    slot->stride = row;
+    slot->ndamage = (dw > 0 && dh > 0) ? 1 : 0;
+    slot->damage[0].x = dx;
+    slot->damage[0].y = dy;
+    slot->damage[0].w = dw;
+    slot->damage[0].h = dh;
+    
+    slot->seq.store(2 * n, std::memory_order_release);
+    hdr->seq.store(n, std::memory_order_release);
+    seq = n;
+}
+
+void FrameRing::cleanup() {
+    destroyRing();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path.c_str());
+    }
+    socket_path.clear();
+}
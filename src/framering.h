@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Captured frames published to local readers through a memfd ring.
+//
+// A reader connects to the Unix socket and receives the ring fd through
+// SCM_RIGHTS, then mmaps it read-only. The ring starts with a RingHeader,
+// followed by `slots` blocks of `slot_size` bytes, each a SlotHeader with the
+// pixels (BGRX, `stride` bytes per row) right after it.
+//
+// Slots are seqlocked: the writer makes a slot's seq odd, fills it, then makes
+// it even and stores the frame number in RingHeader::seq. To read frame n, use
+// slot (n - 1) % slots, check its seq is 2 * n before and after touching the
+// pixels, and retry with the newest frame if either check fails. When the
+// geometry outgrows the ring a new one is made and the old header's `closed`
+// is set, so readers know to reconnect.
+struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t max_width;
+    uint32_t max_height;
+    uint32_t slot_size;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint32_t> closed;
+    uint32_t reserved;
+};
+
+struct FrameRingSlot {
+    std::atomic<uint64_t> seq;
+    uint64_t timestamp_ns;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t ndamage;
+    struct { int32_t x, y, w, h; } damage[8];
+};
+
+static const uint32_t FRAME_RING_MAGIC = 0x4d525247; // "MRRG"
+static const uint32_t FRAME_RING_VERSION = 1;
+
+class FrameRing {
+private:
+    std::string socket_path;
+    int listen_fd;
+    int ring_fd;
+    uint8_t* map;
+    size_t map_size;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t max_width, max_height;
+    uint64_t seq;
+    
+    bool createRing(int width, int height);
+    void destroyRing();
+    
+public:
+    FrameRing();
+    ~FrameRing();
+    
+    bool init(const std::string& path, int slot_count = 4);
+    
+    int getListenFd() const { return listen_fd; }
+    void acceptClients();
+    
+    void publish(const uint8_t* pixels, int width, int height, int bytes_per_line,
+                 int dx, int dy, int dw, int dh);
+    
+    void cleanup();
+};
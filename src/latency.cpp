@@ -0,0 +1,98 @@
+#include "latency.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+LatencyHistogram::LatencyHistogram() : total(0), max_us(0) {
+    memset(counts, 0, sizeof(counts));
+}
+
+int LatencyHistogram::bucketFor(uint64_t us) {
+    if (us < SUB_BUCKETS) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - 4;
+    int index = (shift + 1) * SUB_BUCKETS + (int)((us >> shift) & (SUB_BUCKETS - 1));
+    return std::min(index, BUCKETS - 1);
+}
+
+// Middle of the bucket
+uint64_t LatencyHistogram::bucketValue(int index) {
+    if (index < SUB_BUCKETS) return index;
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t us) {
+    counts[bucketFor(us)]++;
+    total++;
+    max_us = std::max(max_us, us);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(bucketValue(i), max_us);
+    }
+    return max_us;
+}
+
+LatencyTrace::LatencyTrace() : input_ns(0), damaged_ns(0), inputs_sent(0), dropped(0) {}
+
+int64_t LatencyTrace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyTrace::inputSent(int64_t stamp) {
+    const int64_t give_up_ns = 1000000000;
+    inputs_sent.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t held = input_ns.load(std::memory_order_relaxed);
+    do {
+        if (held != 0 && stamp - held < give_up_ns) return;
+    } while (!input_ns.compare_exchange_weak(held, stamp, std::memory_order_relaxed));
+}
+
+// Damage already answering an input waits for its frame; later input is
+// left for the damage after that
+void LatencyTrace::damageSeen() {
+    if (damaged_ns != 0) return;
+    int64_t stamp = input_ns.exchange(0, std::memory_order_relaxed);
+    if (stamp == 0) return;
+    damaged_ns = stamp;
+    to_damage.record((uint64_t)std::max<int64_t>(now() - stamp, 0) / 1000);
+}
+
+int64_t LatencyTrace::takeFrame() {
+    int64_t stamp = damaged_ns;
+    damaged_ns = 0;
+    return stamp;
+}
+
+void LatencyTrace::dropFrame() {
+    if (damaged_ns == 0) return;
+    damaged_ns = 0;
+    dropped++;
+}
+
+void LatencyTrace::frameWritten(int64_t stamp) {
+    to_photon.record((uint64_t)std::max<int64_t>(now() - stamp, 0) / 1000);
+}
+
+void LatencyTrace::printStats(std::ostream& out) const {
+    out << "input latency: " << inputs_sent.load() << " inputs, " << to_damage.getCount() << " traced, "
+        << dropped << " repainted nothing\n";
+
+    const LatencyHistogram* stages[] = {&to_damage, &to_photon};
+    const char* names[] = {"input to damage", "input to terminal"};
+    for (int i = 0; i < 2; i++) {
+        const LatencyHistogram& h = *stages[i];
+        if (h.getCount() == 0) continue;
+        out << names[i] << ": " << h.percentile(0.5) / 1000.0 << " ms p50, "
+            << h.percentile(0.99) / 1000.0 << " ms p99, " << h.getMax() / 1000.0 << " ms max\n";
+    }
+}
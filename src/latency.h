@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Microsecond latencies in log-linear buckets: 16 per power of two, so a
+// percentile comes back within about 6% with no samples kept
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = 28 * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max_us;
+
+    static int bucketFor(uint64_t us);
+    static uint64_t bucketValue(int index);
+
+public:
+    LatencyHistogram();
+
+    void record(uint64_t us);
+    uint64_t getCount() const { return total; }
+    uint64_t getMax() const { return max_us; }
+    // p between 0 and 1
+    uint64_t percentile(double p) const;
+};
+
+// Follows injected input from the moment it is read off stdin to the moment
+// the frame showing its effect has left the terminal's output queue. One
+// input is in flight at a time; the next Damage after it counts as its
+// response and the next frame rendered carries its stamp to the writer.
+// Input that draws nothing within a second is given up on.
+//
+// inputSent() runs on the input thread, damageSeen(), takeFrame() and
+// dropFrame() on the capture thread, frameWritten() on the writer thread.
+class LatencyTrace {
+private:
+    std::atomic<int64_t> input_ns;
+    int64_t damaged_ns;
+
+    LatencyHistogram to_damage;
+    LatencyHistogram to_photon;
+    std::atomic<uint64_t> inputs_sent;
+    uint64_t dropped;
+
+public:
+    LatencyTrace();
+
+    static int64_t now();
+
+    void inputSent(int64_t stamp);
+    void damageSeen();
+    // The stamp the frame being handed to the writer carries, 0 for none
+    int64_t takeFrame();
+    // The damage repainted identical pixels, so nothing will show
+    void dropFrame();
+    void frameWritten(int64_t stamp);
+
+    // Only meaningful once the threads above have stopped
+    void printStats(std::ostream& out) const;
+};
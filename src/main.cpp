@@ -7,9 +7,21 @@
 
 #include "x11/capture.h"
 #include "x11/input.h"
-using Capturer = X11Capturer;
+#include "x11/selection.h"
 
 #include "renderer.h"
+#include "framering.h"
+#include "writer.h"
+#include "server.h"
+#include "pane.h"
+#include "reactor.h"
+#include "latency.h"
+#include "vnc/capture.h"
+#ifdef HAVE_WAYLAND
+#include "wayland/capture.h"
+#include "wayland/input.h"
+#endif
+using Capturer = CaptureBackend;
 #include <sstream>
 #include <algorithm>
 #include <unistd.h>
@@ -22,20 +34,32 @@ using Capturer = X11Capturer;
 #include <cstdlib>
 #include <limits.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <filesystem>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/Xrandr.h>
 
 std::atomic<bool> running(true);
+std::atomic<bool> winch_pending(false);
 struct termios orig_termios;
 
 pid_t xvfb_pid = -1;
 pid_t wm_pid = -1;
 pid_t app_pid = -1;
+std::vector<pid_t> pane_pids;
+std::string fb_dir;
+std::string wl_dir;
+std::string vnc_dir;
 
 void cleanupChildren() {
     std::vector<pid_t> pids;
     if (app_pid > 0) pids.push_back(app_pid);
+    for (pid_t pid : pane_pids) if (pid > 0) pids.push_back(pid);
     if (wm_pid > 0) pids.push_back(wm_pid);
     if (xvfb_pid > 0) pids.push_back(xvfb_pid);
 
@@ -55,18 +79,36 @@ void cleanupChildren() {
     
     // Final reap of any other children
     while (waitpid(-1, NULL, WNOHANG) > 0);
+    
+    if (!fb_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(fb_dir, ec);
+        fb_dir.clear();
+    }
+    if (!wl_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(wl_dir, ec);
+        wl_dir.clear();
+    }
+    if (!vnc_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(vnc_dir, ec);
+        vnc_dir.clear();
+    }
 }
 
 void restoreTerminal() {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
-    const char* reset_seq = "\033[?1000l\033[?1002l\033[?1003l\033[?1006l\033[?25h\033[0m\033[?7h\n";
+    const char* reset_seq = "\033[?2004l\033[?1000l\033[?1002l\033[?1003l\033[?1006l\033[?25h\033[0m\033[?7h\n";
     write(STDOUT_FILENO, reset_seq, strlen(reset_seq));
     cleanupChildren();
 }
 
 void signalHandler(int sig) {
-    if (sig == SIGTERM || sig == SIGQUIT) {
+    if (sig == SIGTERM || sig == SIGQUIT || sig == SIGINT) {
         running = false;
+    } else if (sig == SIGWINCH) {
+        winch_pending = true;
     }
 }
 
@@ -93,6 +135,8 @@ void setupTerminal(bool track_mouse) {
     } else {
         write(STDOUT_FILENO, "\033[?25l\033[?1006h\033[?1002h\033[?1000h\033[?7l", 35);
     }
+    // Pastes arrive between markers, so they can be told apart from typing
+    write(STDOUT_FILENO, "\033[?2004h", 8);
 }
 
 std::string getSelfPath() {
@@ -121,7 +165,8 @@ int findFreeDisplay() {
     }
 }
 
-Window findAppWindow(Display* d, Window current_w) {
+// Windows in skip, and everything under them, already belong to another pane
+Window findAppWindow(Display* d, Window current_w, const std::vector<Window>& skip = {}) {
     Window root, parent, *children;
     unsigned int nchildren;
     
@@ -131,6 +176,7 @@ Window findAppWindow(Display* d, Window current_w) {
 
     Window found = 0;
     for (unsigned int i = 0; i < nchildren; i++) {
+        if (std::find(skip.begin(), skip.end(), children[i]) != skip.end()) continue;
         XWindowAttributes attrs;
         if (XGetWindowAttributes(d, children[i], &attrs)) {
             if (attrs.map_state == IsViewable && attrs.width > 50 && attrs.height > 50) {
@@ -139,7 +185,7 @@ Window findAppWindow(Display* d, Window current_w) {
             }
         }
         if (!found) {
-            found = findAppWindow(d, children[i]);
+            found = findAppWindow(d, children[i], skip);
             if (found) break;
         }
     }
@@ -148,58 +194,640 @@ Window findAppWindow(Display* d, Window current_w) {
     return found;
 }
 
-void captureThread(Capturer* capturer, ANSIRenderer* renderer,
-                   std::atomic<bool>& running, int fps, bool isCursor) {
-    auto frame_time = std::chrono::milliseconds(1000 / fps);
-    int frame_count = 0;
+// The app's own window inside a WM frame, the one .wm marks with WM_STATE;
+// w itself if there is none
+static Window clientWindow(Display* d, Window w) {
+    Atom wm_state = XInternAtom(d, "WM_STATE", True);
+    if (wm_state == None) return w;
+    
+    std::vector<Window> level{w};
+    while (!level.empty()) {
+        std::vector<Window> next;
+        for (Window candidate : level) {
+            Atom type;
+            int format;
+            unsigned long count, after;
+            unsigned char* data = nullptr;
+            if (XGetWindowProperty(d, candidate, wm_state, 0, 0, False, AnyPropertyType,
+                                   &type, &format, &count, &after, &data) == Success) {
+                if (data) XFree(data);
+                if (type != None) return candidate;
+            }
+            Window root, parent, *children;
+            unsigned int nchildren;
+            if (XQueryTree(d, candidate, &root, &parent, &children, &nchildren)) {
+                next.insert(next.end(), children, children + nchildren);
+                if (children) XFree(children);
+            }
+        }
+        level.swap(next);
+    }
+    return w;
+}
+
+// Xvfb only accepts sizes up to the one it was started with, and a CRTC that
+// no longer fits makes the request fail, so those are switched off first the
+// way xrandr --fb does. w and h come back clamped to what was applied.
+static void resizeScreen(Display* d, int& w, int& h) {
+    Window root = DefaultRootWindow(d);
+    int min_w, min_h, max_w, max_h;
+    if (!XRRGetScreenSizeRange(d, root, &min_w, &min_h, &max_w, &max_h)) return;
+    w = std::max(min_w, std::min(w, max_w));
+    h = std::max(min_h, std::min(h, max_h));
+    
+    XGrabServer(d);
+    XRRScreenResources* res = XRRGetScreenResourcesCurrent(d, root);
+    if (res) {
+        for (int i = 0; i < res->ncrtc; ++i) {
+            XRRCrtcInfo* crtc = XRRGetCrtcInfo(d, res, res->crtcs[i]);
+            if (!crtc) continue;
+            if (crtc->mode != None &&
+                (crtc->x + (int)crtc->width > w || crtc->y + (int)crtc->height > h)) {
+                XRRSetCrtcConfig(d, res, res->crtcs[i], CurrentTime, 0, 0, None, RR_Rotate_0, nullptr, 0);
+            }
+            XRRFreeCrtcInfo(crtc);
+        }
+        XRRFreeScreenResources(res);
+    }
+    // Report a 96 dpi screen
+    XRRSetScreenSize(d, root, w, h, w * 254 / 960, h * 254 / 960);
+    XUngrabServer(d);
+    XSync(d, False);
+}
+
+static void fitToTerminal(int scale, int& w, int& h) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0 || ws.ws_row == 0) return;
+    // Cells are about twice as tall as they are wide
+    w = ws.ws_col * scale;
+    h = ws.ws_row * scale * 2;
+}
+
+static void waitForEvents(struct pollfd* fds, int nfds, std::chrono::steady_clock::duration timeout) {
+    if (timeout < std::chrono::steady_clock::duration::zero()) {
+        poll(fds, nfds, -1);
+        return;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    ppoll(fds, nfds, &ts, nullptr);
+}
+
+// The local terminal as the capture loop sees it: one renderer streaming into
+// one writer. ViewServer offers the same calls for attached viewers.
+struct TerminalView {
+    ANSIRenderer* renderer;
+    FrameWriter* writer;
+    
+    int getWakeFd() const { return renderer->getWakeFd(); }
+    bool consumeInvalidation() { return renderer->consumeInvalidation(); }
+    int getReadyFd() const { return writer->getReadyFd(); }
+    void consumeReady() { writer->consumeReady(); }
+    bool canAccept() { return writer->canAccept(); }
+    void setCursor(const CaptureBackend::CursorData& cursor) { renderer->setCursor(cursor); }
+    void setImageOrigin(int x, int y) { renderer->setImageOrigin(x, y); }
+    void setDamage(int x, int y, int w, int h) { renderer->setDamage(x, y, w, h); }
+    void renderFrame(const uint8_t* rgb_data, int width, int height, int bytes_per_pixel, int bytes_per_line) {
+        renderer->renderFrame(rgb_data, width, height, bytes_per_pixel, bytes_per_line);
+    }
+};
+
+template <typename Source, typename View>
+void captureThread(Source* capturer, View* view,
+                   FrameRing* ring, LatencyTrace* trace, std::atomic<bool>& running,
+                   int fps, int coalesce_ms, bool isCursor) {
+    using clock = std::chrono::steady_clock;
+    auto min_interval = std::chrono::microseconds(1000000 / fps);
+    auto coalesce = std::chrono::milliseconds(coalesce_ms);
+    auto quiet = std::chrono::milliseconds(1);
+    
+    // Without Damage there is nothing to wait on, so fall back to a fixed tick
+    bool event_driven = capturer->hasDamage();
+    
+    struct pollfd fds[4];
+    fds[0].fd = capturer->getConnectionFd();
+    fds[0].events = POLLIN;
+    fds[1].fd = view->getWakeFd();
+    fds[1].events = POLLIN;
+    fds[2].fd = view->getReadyFd();
+    fds[2].events = POLLIN;
+    fds[3].fd = ring ? ring->getListenFd() : -1;
+    fds[3].events = POLLIN;
+    fds[3].revents = 0;
+    int nfds = fds[3].fd >= 0 ? 4 : 3;
+    
+    clock::time_point last_frame = clock::now() - min_interval;
+    clock::time_point pending_since = clock::now();
+    clock::time_point last_event = clock::now();
+    bool pending = true;
+    bool view_changed = true;
+    int last_cursor_x = -1, last_cursor_y = -1;
     
     while (running) {
-        auto start = std::chrono::steady_clock::now();
-        frame_count++;
+        if (nfds == 4 && (fds[3].revents & POLLIN)) {
+            ring->acceptClients();
+            fds[3].revents = 0;
+        }
+        
+        view->consumeReady();
+        int events = capturer->processEvents();
+        bool redraw = view->consumeInvalidation();
+        auto now = clock::now();
+        if (trace && events > 0) trace->damageSeen();
+        
+        if (events > 0) last_event = now;
+        if (redraw) {
+            view_changed = true;
+            if (isCursor) capturer->markPointerMoved();
+        }
+        if (!pending && (events > 0 || redraw || !event_driven || capturer->hasPendingFrame())) {
+            pending = true;
+            pending_since = now;
+        }
+        
+        if (!pending) {
+            waitForEvents(fds, nfds, clock::duration(-1));
+            continue;
+        }
+        
+        // An isolated change goes out at once; a burst is held until the app
+        // stops repainting, but never longer than the coalescing window.
+        auto due = std::max(last_frame + min_interval, pending_since);
+        if (event_driven && now - last_event < quiet) {
+            due = std::max(due, std::min(last_event + quiet, pending_since + coalesce));
+        }
+        if (now < due) {
+            waitForEvents(fds, nfds, due - now);
+            continue;
+        }
+        
+        // The terminal is still behind; capture once it catches up so the frame
+        // that goes out is the freshest one rather than one that waited in line
+        if (!view->canAccept()) {
+            waitForEvents(fds, nfds, clock::duration(-1));
+            continue;
+        }
+        
+        pending = false;
+        last_frame = now;
+        
+        capturer->beginFrame(isCursor);
         
+        bool cursor_changed = false;
         if (isCursor) {
             auto cursor = capturer->getCursor();
-            renderer->setCursor(cursor);
+            cursor_changed = cursor.changed || cursor.x != last_cursor_x || cursor.y != last_cursor_y;
+            last_cursor_x = cursor.x;
+            last_cursor_y = cursor.y;
+            view->setCursor(cursor);
         }
 
-        bool force = (frame_count < 10) || (frame_count % 60 == 0);
-        uint8_t* pixels = capturer->captureFrame(force);
+        uint8_t* pixels = capturer->captureFrame();
+        
+        int dx = 0, dy = 0, dw = 0, dh = 0;
+        if (pixels && capturer->frameChanged()) capturer->getChangedRect(dx, dy, dw, dh);
+        
+        if (ring && pixels && capturer->frameChanged()) {
+            ring->publish(pixels, capturer->getWidth(), capturer->getHeight(),
+                          capturer->getBytesPerLine(), dx, dy, dw, dh);
+        }
+        
+        // Damage that turned out to repaint identical pixels costs no render or write
+        if (pixels && !capturer->frameChanged() && !view_changed && !cursor_changed) {
+            if (trace) trace->dropFrame();
+            continue;
+        }
+        view_changed = false;
         
         if (pixels) {
+            view->setImageOrigin(capturer->getOriginX(), capturer->getOriginY());
+            view->setDamage(dx, dy, dw, dh);
             int bytes_per_line = capturer->getBytesPerLine();
-            renderer->renderFrame(pixels, capturer->getWidth(), capturer->getHeight(), 4, bytes_per_line);
-            
-            const char* data = renderer->getData();
-            size_t remaining = renderer->getSize();
-            ssize_t total_written = 0;
-            
-            while (remaining > 0 && running) {
-                ssize_t n = write(STDOUT_FILENO, data + total_written, remaining);
-                if (n == -1) {
+            view->renderFrame(pixels, capturer->getWidth(), capturer->getHeight(), 4, bytes_per_line);
+        }
+    }
+}
+
+#ifdef HAVE_WAYLAND
+// cage runs the app as its only client on a headless wlroots backend. A
+// private XDG_RUNTIME_DIR keeps the socket name predictable.
+static int runWayland(const std::string& bin_path, const std::vector<std::string>& bin_args,
+                      int fps, int coalesce_ms, int wsecs, char cell_char, RenderMode mode,
+                      bool isCursor, bool trackMouse, const std::string& publish_path,
+                      int outq_target, bool showStats) {
+    if (!commandExists("cage")) { std::cerr << "Error: cage not found\n"; return 1; }
+    
+    char tmpl[] = "/tmp/mirrors-wl-XXXXXX";
+    if (!mkdtemp(tmpl)) { std::cerr << "Error: could not create runtime dir\n"; return 1; }
+    wl_dir = tmpl;
+    std::string socket_path = wl_dir + "/wayland-0";
+    
+    std::cout << "Starting headless compositor...\n";
+    
+    app_pid = fork();
+    if (app_pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+        
+        setenv("XDG_RUNTIME_DIR", wl_dir.c_str(), 1);
+        setenv("WLR_BACKENDS", "headless", 1);
+        setenv("WLR_HEADLESS_OUTPUTS", "1", 1);
+        setenv("WLR_LIBINPUT_NO_DEVICES", "1", 1);
+        setenv("WLR_RENDERER", "pixman", 1);
+        unsetenv("WAYLAND_DISPLAY");
+        unsetenv("DISPLAY");
+        
+        std::vector<char*> args;
+        args.push_back(strdup("cage"));
+        args.push_back(strdup("--"));
+        args.push_back(strdup(bin_path.c_str()));
+        for (const auto& a : bin_args) args.push_back(strdup(a.c_str()));
+        args.push_back(NULL);
+        execvp(args[0], args.data());
+        exit(1);
+    }
+    
+    for (int i = 0; i < wsecs * 10 && running; ++i) {
+        if (access(socket_path.c_str(), F_OK) == 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    // The output is added once the backend starts, shortly after the socket
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    
+    struct winsize ts;
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ts);
+    int term_cols = ts.ws_col;
+    int term_lines = ts.ws_row;
+    
+    WaylandCapturer capturer;
+    WaylandInput sink;
+    ANSIRenderer renderer;
+    InputHandler input;
+    FrameRing ring;
+    FrameWriter writer;
+    LatencyTrace trace;
+    LatencyTrace* trace_ptr = showStats ? &trace : nullptr;
+    
+    capturer.setOverlayCursor(isCursor);
+    if (!capturer.init(socket_path.c_str())) {
+        std::cerr << "Failed to initialize capturer\n";
+        cleanupChildren();
+        return 1;
+    }
+    if (!sink.init(capturer)) {
+        capturer.cleanup();
+        cleanupChildren();
+        return 1;
+    }
+    
+    if (!publish_path.empty() && !ring.init(publish_path)) {
+        std::cerr << "Warning: Failed to open frame ring socket\n";
+    }
+    
+    input.setSink(&sink);
+    input.init(nullptr, 0, capturer.getWidth(), capturer.getHeight(), term_cols, term_lines);
+    
+    renderer.setDimensions(term_cols, term_lines);
+    renderer.setImageSize(capturer.getWidth(), capturer.getHeight());
+    if (cell_char != 0) renderer.setCellChar(cell_char);
+    renderer.setMode(mode);
+    
+    renderer.setOutput(&writer);
+    input.setRenderer(&renderer);
+    input.setShellPid(app_pid);
+    input.setTrackMouseMove(trackMouse);
+    input.setLatencyTrace(trace_ptr);
+    writer.setLatencyTrace(trace_ptr);
+    
+    setupTerminal(trackMouse);
+    
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    
+    // Blocked before any thread starts, so only the signalfd ever sees them
+    Reactor reactor;
+    bool reactor_ok = reactor.init() &&
+        reactor.watchSignals({SIGTERM, SIGQUIT, SIGWINCH}, [&](int sig) {
+            if (sig != SIGWINCH) {
+                running = false;
+                return;
+            }
+            struct winsize ws;
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+                input.updateTerminalSize(ws.ws_col, ws.ws_row);
+                renderer.requestDimensions(ws.ws_col, ws.ws_row);
+            }
+        });
+    if (!reactor_ok) {
+        std::cerr << "Error: could not set up the event loop\n";
+        sink.cleanup();
+        capturer.cleanup();
+        cleanupChildren();
+        return 1;
+    }
+    
+    write(STDOUT_FILENO, "\033[2J\033[H", 7);
+    writer.setQueueTarget(outq_target);
+    writer.start(STDOUT_FILENO);
+    
+    // The compositor draws the pointer into the frames, so the loop never fetches it
+    TerminalView view{&renderer, &writer};
+    auto capture_thread = std::thread(captureThread<WaylandCapturer, TerminalView>, &capturer, &view,
+                                      publish_path.empty() ? nullptr : &ring, trace_ptr, std::ref(running),
+                                      fps, coalesce_ms, false);
+    
+    reactor.add(STDIN_FILENO, EPOLLIN, [&](uint32_t events) {
+        if (events & EPOLLIN) input.processInput();
+        if (events & (EPOLLHUP | EPOLLERR)) running = false;
+    });
+    if (input.getEscapeFd() >= 0) {
+        reactor.add(input.getEscapeFd(), EPOLLIN, [&](uint32_t) { input.escapeTimeout(); });
+    }
+    reactor.watchChild(app_pid, [&](int) {
+        app_pid = -1;
+        running = false;
+    });
+    reactor.run(running);
+    
+    renderer.invalidate();
+    writer.stop();
+    capture_thread.join();
+    
+    reactor.cleanup();
+    input.cleanup();
+    sink.cleanup();
+    capturer.cleanup();
+    ring.cleanup();
+    cleanupChildren();
+    
+    if (showStats) {
+        std::cerr << "\n";
+        writer.printStats(std::cerr);
+        trace.printStats(std::cerr);
+    }
+    
+    return 0;
+}
+#endif
+
+static bool sendViewerMessage(int fd, uint8_t type, const void* payload, uint32_t length) {
+    ViewerMessageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.length = length;
+    
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<void*>(payload);
+    iov[1].iov_len = length;
+    
+    size_t remaining = sizeof(header) + length;
+    int first = 0;
+    while (remaining > 0) {
+        ssize_t n = writev(fd, iov + first, 2 - first);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        remaining -= n;
+        while (first < 2 && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < 2) {
+            iov[first].iov_base = (char*)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// A thin terminal for a --serve session: keystrokes and resizes go up the
+// socket, and whatever comes back is written to the tty as is. Ctrl+\ only
+// detaches; the session keeps running.
+static int runViewer(const std::string& socket_path, RenderMode mode, char cell_char, bool trackMouse) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "Error: could not connect to " << socket_path << "\n";
+        if (sock >= 0) close(sock);
+        return 1;
+    }
+    
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0 || ws.ws_row == 0) {
+        std::cerr << "Error: attaching needs a terminal\n";
+        close(sock);
+        return 1;
+    }
+    ViewerHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.cols = ws.ws_col;
+    hello.lines = ws.ws_row;
+    hello.mode = (uint8_t)mode;
+    hello.cell_char = cell_char;
+    if (!sendViewerMessage(sock, VIEWER_HELLO, &hello, sizeof(hello))) {
+        std::cerr << "Error: session refused the viewer\n";
+        close(sock);
+        return 1;
+    }
+    
+    setupTerminal(trackMouse);
+    signal(SIGTERM, signalHandler);
+    signal(SIGQUIT, signalHandler);
+    signal(SIGWINCH, signalHandler);
+    write(STDOUT_FILENO, "\033[2J\033[H", 7);
+    
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = sock;
+    fds[1].events = POLLIN;
+    
+    std::vector<char> buf(65536);
+    while (running) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+        
+        if (winch_pending.exchange(false) &&
+            ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+            ViewerResize resize;
+            resize.cols = ws.ws_col;
+            resize.lines = ws.ws_row;
+            if (!sendViewerMessage(sock, VIEWER_RESIZE, &resize, sizeof(resize))) break;
+        }
+        
+        if (fds[0].revents & POLLIN) {
+            ssize_t n = read(STDIN_FILENO, buf.data(), 4096);
+            if (n > 0) {
+                char* quit = (char*)memchr(buf.data(), 0x1C, n);
+                ssize_t len = quit ? quit - buf.data() : n;
+                if (len > 0 && !sendViewerMessage(sock, VIEWER_INPUT, buf.data(), len)) break;
+                if (quit) break;
+            }
+        }
+        
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(sock, buf.data(), buf.size());
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) break;
+            for (ssize_t off = 0; off < n;) {
+                ssize_t w = write(STDOUT_FILENO, buf.data() + off, n - off);
+                if (w < 0) {
                     if (errno == EINTR) continue;
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        std::this_thread::sleep_for(std::chrono::microseconds(100));
-                        continue;
-                    }
                     break;
                 }
-                total_written += n;
-                remaining -= n;
+                off += w;
             }
         }
+    }
+    
+    close(sock);
+    return 0;
+}
+
+// Sockets of detached sessions live in a private per-user directory. The
+// /tmp fallback is shared, so a path someone else created (or a symlink
+// planted there) is refused rather than used. Empty on failure.
+static std::string sessionDir() {
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    std::string dir = runtime && *runtime ? std::string(runtime) + "/mirrors"
+                                          : "/tmp/mirrors-" + std::to_string(getuid());
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "Error: could not create " << dir << ": " << strerror(errno) << "\n";
+        return "";
+    }
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 07777) != 0700) {
+        std::cerr << "Error: " << dir << " is not a private directory owned by you (mode 0700)\n";
+        return "";
+    }
+    return dir;
+}
+
+static std::string sessionSocket(const std::string& name) {
+    if (name.find('/') != std::string::npos) return name;
+    std::string dir = sessionDir();
+    if (dir.empty()) return "";
+    return dir + "/" + name + ".sock";
+}
+
+// A socket left behind by a session that died refuses connections
+static bool sessionAlive(const std::string& path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return false;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    bool alive = connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(sock);
+    return alive;
+}
+
+static std::vector<std::string> listSessions() {
+    std::vector<std::string> names;
+    std::string dir = sessionDir();
+    if (dir.empty()) return names;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".sock") continue;
+        if (sessionAlive(entry.path().string())) names.push_back(entry.path().stem().string());
+    }
+    return names;
+}
+
+// Forks the session into the background and returns in the child, which
+// goes on to run the stack as a --serve server. The parent waits for the
+// socket to come up and attaches to it; the session outlives the terminal.
+static int startSession(const std::string& socket_path, int wsecs) {
+    std::string log_path = socket_path;
+    if (log_path.size() > 5 && log_path.compare(log_path.size() - 5, 5, ".sock") == 0) {
+        log_path.resize(log_path.size() - 5);
+    }
+    log_path += ".log";
+    // Start a fresh log; O_EXCL and O_NOFOLLOW keep the open from following
+    // anything swapped in at the path afterwards
+    unlink(log_path.c_str());
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Error: could not start session\n";
+        return 1;
+    }
+    if (pid == 0) {
+        setsid();
+        int devnull = open("/dev/null", O_RDWR);
+        int log = open(log_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        dup2(devnull, STDIN_FILENO);
+        dup2(log >= 0 ? log : devnull, STDOUT_FILENO);
+        dup2(log >= 0 ? log : devnull, STDERR_FILENO);
+        close(devnull);
+        if (log >= 0) close(log);
+        return -1;
+    }
+    
+    std::cout << "Starting session (log: " << log_path << ")...\n";
+    // Xvfb, the WM and waiting for the app window all happen before the socket appears
+    for (int i = 0; i < (wsecs + 10) * 10; ++i) {
+        if (sessionAlive(socket_path)) return 0;
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::cerr << "Error: session failed to start, see " << log_path << "\n";
+    return 1;
+}
+
+static pid_t launchApp(const std::string& bin_path, const std::vector<std::string>& bin_args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
         
-        auto elapsed = std::chrono::steady_clock::now() - start;
-        if (elapsed < frame_time) {
-            std::this_thread::sleep_for(frame_time - elapsed);
+        std::vector<char*> args;
+        if (commandExists("dbus-run-session")) args.push_back(strdup("dbus-run-session"));
+        else if (commandExists("dbus-launch")) {
+            args.push_back(strdup("dbus-launch")); args.push_back(strdup("--exit-with-session"));
         }
+
+        args.push_back(strdup(bin_path.c_str()));
+        for (const auto& a : bin_args) args.push_back(strdup(a.c_str()));
+        args.push_back(NULL);
+        execvp(args[0], args.data());
+        exit(1);
     }
+    return pid;
 }
 
-void inputThread(InputHandler* input, std::atomic<bool>& running) {
-    while (running) {
-        input->processInput();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+static Window waitForAppWindow(Display* display, int wsecs, const std::vector<Window>& skip) {
+    for (int wait_counter = 0; wait_counter < wsecs && running; wait_counter++) {
+        Window w = findAppWindow(display, DefaultRootWindow(display), skip);
+        if (w != 0) return w;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
     }
+    return 0;
+}
+
+// Window i goes to screen slot i of the same grid the terminal is split in.
+// The windows are .wm frames, which it sizes as a whole, decorations and all.
+static void placePaneWindows(Display* display, const std::vector<Window>& windows, int w, int h) {
+    for (size_t i = 0; i < windows.size(); i++) {
+        int x, y, sw, sh;
+        PaneView::slotRect((int)i, (int)windows.size(), w, h, x, y, sw, sh);
+        XMoveResizeWindow(display, windows[i], x, y, sw, sh);
+        XMapWindow(display, windows[i]);
+    }
+    XFlush(display);
 }
 
 void show_help(const char* prog) {
@@ -207,6 +835,10 @@ void show_help(const char* prog) {
               << "To adjust zoom, use Ctrl + mouse scroll. To change current view area (panning), Ctrl + drag. Ctrl + \\ to exit.\n"
               << "Options:\n"
               << "  -r, --refresh-rate <fps>   Set target FPS (default: 30)\n"
+              << "  --coalesce <ms>            Max wait for a repaint burst to settle (default: 4)\n"
+              << "  --outq <bytes>             Hold new frames while the terminal has more than this queued\n"
+              << "                             (default: 4096, -1 to disable)\n"
+              << "  --stats                    Print frame, output and input-to-terminal latency stats on exit\n"
               << "  -w, --width <pixels>       Set virtual screen width\n"
               << "  -h, --height <pixels>      Set virtual screen height\n"
               << "  -s, --secs <int>        How long to wait for window\n"
@@ -214,11 +846,33 @@ void show_help(const char* prog) {
               << "  --ansi                     Enable standard ANSI colors\n"
               << "  --grey                     Enable Grayscale\n"
               << "  --cursor                   Show cursor\n"
-              << "  --nomouse                  Disable mouse move tracking\n";
+              << "  --mmap                     Read the Xvfb framebuffer in place instead of XShm\n"
+              << "  --window                   Capture only the app window at native size (Composite)\n"
+              << "  --hugepages                Back the capture buffer with huge pages\n"
+              << "  --fit <n>                  Size the screen to n pixels per column (2n per row), up to -w/-h,\n"
+              << "                             and follow terminal resizes\n"
+              << "  --wayland                  Run the app under a headless Wayland compositor (cage)\n"
+              << "  --vnc                      Use Xvnc and take its RFB updates instead of grabbing the screen\n"
+              << "  --publish <socket>         Share captured frames with local readers over a memfd ring\n"
+              << "  --pane \"<cmd> [args]\"      Run another app next to the first, each in its own pane\n"
+              << "                             (repeatable; a shell command line, so quotes work)\n"
+              << "  --serve <socket>           Run without a terminal and let viewers attach on <socket>\n"
+              << "  --shared-input             With --serve, every viewer drives the app, not just the first\n"
+              << "  --view <socket>            Attach this terminal to a mirrors --serve session\n"
+              << "  --session <name>           Run detached as a named session and attach to it; if it is\n"
+              << "                             already running, just attach. ^\\ detaches.\n"
+              << "  --nomouse                  Disable mouse move tracking\n"
+              << "  --paste-key <key>          How the app is told to paste: ctrl+v (default), shift+insert,\n"
+              << "                             ctrl+shift+v, or type to send pasted text key by key\n"
+              << "\n"
+              << "       " << prog << " attach [name]   Reattach to a session (the only one if no name)\n";
 }
 
 int main(int argc, char** argv) {
     int fps = 30;
+    int coalesce_ms = 4;
+    int outq_target = 4096;
+    bool showStats = false;
     int width = 1920;
     int height = 1080;
     int wsecs = 10;
@@ -226,13 +880,32 @@ int main(int argc, char** argv) {
     RenderMode mode = RenderMode::TRUECOLOR;
     bool isCursor = false;
     bool trackMouse = true;
+    bool useFramebuffer = false;
+    bool windowOnly = false;
+    bool hugePages = false;
+    bool useWayland = false;
+    bool useVnc = false;
+    int fit_scale = 0;
+    std::string publish_path;
+    std::string serve_path;
+    std::string view_path;
+    bool sharedInput = false;
+    InputHandler::PasteKey pasteKey = InputHandler::PASTE_CTRL_V;
+    std::string session_name;
     std::string bin_path;
     std::vector<std::string> bin_args;
+    std::vector<std::string> pane_commands;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "-r" || arg == "--refresh-rate") {
             if (i + 1 < argc) fps = std::stoi(argv[++i]);
+        } else if (arg == "--coalesce") {
+            if (i + 1 < argc) coalesce_ms = std::stoi(argv[++i]);
+        } else if (arg == "--outq") {
+            if (i + 1 < argc) outq_target = std::stoi(argv[++i]);
+        } else if (arg == "--stats") {
+            showStats = true;
         } else if (arg == "-w" || arg == "--width") {
             if (i + 1 < argc) width = std::stoi(argv[++i]);
         } else if (arg == "-h" || arg == "--height") {
@@ -249,6 +922,42 @@ int main(int argc, char** argv) {
             isCursor = true;
         } else if (arg == "--nomouse") {
             trackMouse = false;
+        } else if (arg == "--mmap") {
+            useFramebuffer = true;
+        } else if (arg == "--window") {
+            windowOnly = true;
+        } else if (arg == "--hugepages") {
+            hugePages = true;
+        } else if (arg == "--wayland") {
+            useWayland = true;
+        } else if (arg == "--vnc") {
+            useVnc = true;
+        } else if (arg == "--fit") {
+            if (i + 1 < argc) fit_scale = std::stoi(argv[++i]);
+        } else if (arg == "--publish") {
+            if (i + 1 < argc) publish_path = argv[++i];
+        } else if (arg == "--serve") {
+            if (i + 1 < argc) serve_path = argv[++i];
+        } else if (arg == "--pane") {
+            if (i + 1 < argc) pane_commands.push_back(argv[++i]);
+        } else if (arg == "--paste-key") {
+            if (i + 1 < argc) {
+                std::string key = argv[++i];
+                if (key == "ctrl+v") pasteKey = InputHandler::PASTE_CTRL_V;
+                else if (key == "shift+insert") pasteKey = InputHandler::PASTE_SHIFT_INSERT;
+                else if (key == "ctrl+shift+v") pasteKey = InputHandler::PASTE_CTRL_SHIFT_V;
+                else if (key == "type") pasteKey = InputHandler::PASTE_TYPE;
+                else {
+                    std::cerr << "Error: unknown --paste-key " << key << "\n";
+                    return 1;
+                }
+            }
+        } else if (arg == "--shared-input") {
+            sharedInput = true;
+        } else if (arg == "--view") {
+            if (i + 1 < argc) view_path = argv[++i];
+        } else if (arg == "--session") {
+            if (i + 1 < argc) session_name = argv[++i];
         } else if (arg == "--help" || arg == "help") {
             show_help(argv[0]);
             return 0;
@@ -258,6 +967,25 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (bin_path == "attach") {
+        if (!bin_args.empty()) {
+            view_path = sessionSocket(bin_args[0]);
+        } else {
+            std::vector<std::string> sessions = listSessions();
+            if (sessions.size() != 1) {
+                std::cerr << (sessions.empty() ? "No sessions running\n" : "Several sessions running, name one:\n");
+                for (const auto& name : sessions) std::cerr << "  " << name << "\n";
+                return 1;
+            }
+            view_path = sessionSocket(sessions[0]);
+        }
+        if (view_path.empty()) return 1;
+    }
+
+    if (!view_path.empty()) {
+        return runViewer(view_path, mode, cell_char, trackMouse);
+    }
+
     if (bin_path.empty()) {
         show_help(argv[0]);
         return 1;
@@ -268,7 +996,60 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (!commandExists("Xvfb")) { std::cerr << "Error: Xvfb not found\n"; return 1; }
+    for (const auto& command : pane_commands) {
+        std::string program;
+        std::istringstream(command) >> program;
+        if (program.empty() || !commandExists(program)) {
+            std::cerr << "Error: command '" << program << "' not found\n";
+            return 1;
+        }
+    }
+
+    if (!pane_commands.empty() && (useWayland || !serve_path.empty() || !session_name.empty() || windowOnly)) {
+        std::cerr << "Error: --pane does not combine with --wayland, --serve, --session or --window\n";
+        return 1;
+    }
+
+    if (!session_name.empty()) {
+        std::string socket_path = sessionSocket(session_name);
+        if (socket_path.empty()) return 1;
+        if (!sessionAlive(socket_path)) {
+            int started = startSession(socket_path, wsecs);
+            if (started > 0) return started;
+            if (started < 0) serve_path = socket_path;
+        }
+        if (serve_path.empty()) return runViewer(socket_path, mode, cell_char, trackMouse);
+    }
+
+    if (useWayland) {
+        if (!serve_path.empty()) {
+            std::cerr << "Error: --serve is not supported with --wayland\n";
+            return 1;
+        }
+#ifdef HAVE_WAYLAND
+        return runWayland(bin_path, bin_args, fps, coalesce_ms, wsecs, cell_char, mode,
+                          isCursor, trackMouse, publish_path, outq_target, showStats);
+#else
+        std::cerr << "Error: built without Wayland support\n";
+        return 1;
+#endif
+    }
+
+    if (!serve_path.empty() && fit_scale > 0) {
+        std::cerr << "Warning: --fit does not apply to --serve\n";
+        fit_scale = 0;
+    }
+
+    if (useVnc) {
+        if (!commandExists("Xvnc")) { std::cerr << "Error: Xvnc not found\n"; return 1; }
+        if (useFramebuffer || windowOnly) {
+            std::cerr << "Warning: --mmap and --window do not apply to --vnc\n";
+            useFramebuffer = windowOnly = false;
+        }
+        char tmpl[] = "/tmp/mirrors-vnc-XXXXXX";
+        if (!mkdtemp(tmpl)) { std::cerr << "Error: could not create VNC socket dir\n"; return 1; }
+        vnc_dir = tmpl;
+    } else if (!commandExists("Xvfb")) { std::cerr << "Error: Xvfb not found\n"; return 1; }
 
     std::string script_dir = getSelfPath();
     std::string wm_binary = script_dir + "/.wm";
@@ -277,6 +1058,12 @@ int main(int argc, char** argv) {
     std::string display_str = ":" + std::to_string(display_num);
     setenv("DISPLAY", display_str.c_str(), 1);
 
+    if (useFramebuffer) {
+        char tmpl[] = "/tmp/mirrors-fb-XXXXXX";
+        if (mkdtemp(tmpl)) fb_dir = tmpl;
+        else std::cerr << "Warning: could not create framebuffer dir, using XShm\n";
+    }
+
     std::cout << "Starting display " << display_str << " (" << width << "x" << height << ")...\n";
 
     xvfb_pid = fork();
@@ -284,6 +1071,18 @@ int main(int argc, char** argv) {
         int devnull = open("/dev/null", O_WRONLY);
         dup2(devnull, 2); dup2(devnull, 1); close(devnull);
         std::string res = std::to_string(width) + "x" + std::to_string(height) + "x24";
+        if (!vnc_dir.empty()) {
+            // Only reachable through the socket in our private directory
+            std::string geometry = std::to_string(width) + "x" + std::to_string(height);
+            std::string socket_path = vnc_dir + "/rfb.sock";
+            execlp("Xvnc", "Xvnc", display_str.c_str(), "-geometry", geometry.c_str(), "-depth", "24",
+                   "-rfbunixpath", socket_path.c_str(), "-rfbport", "-1", "-SecurityTypes", "None", NULL);
+            exit(1);
+        }
+        if (!fb_dir.empty()) {
+            execlp("Xvfb", "Xvfb", display_str.c_str(), "-screen", "0", res.c_str(), "+extension", "RANDR",
+                   "-fbdir", fb_dir.c_str(), NULL);
+        }
         execlp("Xvfb", "Xvfb", display_str.c_str(), "-screen", "0", res.c_str(), "+extension", "RANDR", NULL);
         exit(1);
     }
@@ -300,6 +1099,13 @@ int main(int argc, char** argv) {
     XSetErrorHandler(MyXErrorHandler);
     XSetIOErrorHandler(MyXIOErrorHandler);
 
+    // Xvfb was started at -w/-h, which is the most the screen can grow to
+    if (fit_scale > 0) {
+        fitToTerminal(fit_scale, width, height);
+        resizeScreen(display, width, height);
+        std::cout << "Screen fitted to terminal: " << width << "x" << height << "\n";
+    }
+
     if (access(wm_binary.c_str(), X_OK) == 0) {
         setenv("MIRRORS_INTERNAL", "1", 1);
         wm_pid = fork();
@@ -312,39 +1118,39 @@ int main(int argc, char** argv) {
     }
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
 
-    app_pid = fork();
-    if (app_pid == 0) {
-        int devnull = open("/dev/null", O_WRONLY);
-        dup2(devnull, STDOUT_FILENO);
-        dup2(devnull, STDERR_FILENO);
-        close(devnull);
-        
-        std::vector<char*> args;
-        if (commandExists("dbus-run-session")) args.push_back(strdup("dbus-run-session"));
-        else if (commandExists("dbus-launch")) {
-            args.push_back(strdup("dbus-launch")); args.push_back(strdup("--exit-with-session"));
-        }
-
-        args.push_back(strdup(bin_path.c_str()));
-        for (const auto& a : bin_args) args.push_back(strdup(a.c_str()));
-        args.push_back(NULL);
-        execvp(args[0], args.data());
-        exit(1);
-    }
+    app_pid = launchApp(bin_path, bin_args);
     
     Window root_window = 0;
+    Window target_window = 0;
+    Window app_window = 0;
+    std::vector<Window> pane_windows;
     {
         std::cout << "Waiting for window...\n";
-        Window app_window = 0;
-        int wait_counter = 0;
-        while (wait_counter < wsecs && running) {
-            app_window = findAppWindow(display, DefaultRootWindow(display));
-            if (app_window != 0) break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            wait_counter++;
+        app_window = waitForAppWindow(display, wsecs, {});
+
+        // Apps are started one at a time so each new window can be told
+        // apart from the ones already placed
+        if (app_window != 0 && !pane_commands.empty()) {
+            pane_windows.push_back(app_window);
+            for (const auto& command : pane_commands) {
+                // A shell parses the command line, quotes and all
+                pane_pids.push_back(launchApp("sh", {"-c", "exec " + command}));
+                Window w = waitForAppWindow(display, wsecs, pane_windows);
+                if (w == 0) {
+                    std::cerr << "Error: no window appeared for pane '" << command << "'\n";
+                    cleanupChildren();
+                    exit(1);
+                }
+                pane_windows.push_back(w);
+            }
         }
 
-        if (app_window != 0) {
+        if (!pane_windows.empty()) {
+            placePaneWindows(display, pane_windows, width, height);
+        } else if (app_window != 0 && windowOnly) {
+            // The frame's title bar and handles are not worth capturing
+            target_window = clientWindow(display, app_window);
+        } else if (app_window != 0) {
             XMoveResizeWindow(display, app_window, 0, 0, width, height);
             XMapWindow(display, app_window);
             XFlush(display);
@@ -355,6 +1161,7 @@ int main(int argc, char** argv) {
             exit(1);
         }
         root_window = DefaultRootWindow(display);
+        if (!target_window) target_window = root_window;
     }
 
     struct winsize ts;
@@ -363,61 +1170,207 @@ int main(int argc, char** argv) {
     int term_lines = ts.ws_row;
 
     Capturer capturer;
+    VncCapturer vnc;
     ANSIRenderer renderer;
+    PaneView panes;
+    bool paned = !pane_windows.empty();
     InputHandler input;
+    SelectionOwner selection;
+    FrameRing ring;
+    FrameWriter writer;
+    LatencyTrace trace;
     
-    XCloseDisplay(display);
+    // Live resizing keeps this connection for RANDR requests
+    if (fit_scale == 0) {
+        XCloseDisplay(display);
+        display = nullptr;
+    }
 
-    if (!capturer.init(display_str.c_str(), root_window, width, height)) {
+    if (!fb_dir.empty()) capturer.setFramebufferPath(fb_dir + "/Xvfb_screen0");
+    capturer.setComposite(windowOnly);
+    capturer.setHugePages(hugePages);
+    if (useVnc) {
+        if (!vnc.init(vnc_dir + "/rfb.sock")) {
+            std::cerr << "Failed to initialize capturer\n";
+            cleanupChildren();
+            return 1;
+        }
+    } else if (!capturer.init(display_str.c_str(), target_window, width, height)) {
         std::cerr << "Failed to initialize capturer\n";
         cleanupChildren();
         return 1;
     }
     
-    if (!input.init(display_str.c_str(), root_window, width, height, term_cols, term_lines)) {
-        std::cerr << "Warning: Failed to initialize input handler\n";
+    if (!publish_path.empty() && !ring.init(publish_path)) {
+        std::cerr << "Warning: Failed to open frame ring socket\n";
     }
     
-    renderer.setDimensions(term_cols, term_lines);
-    renderer.setImageSize(width, height);
-    if (cell_char != 0) renderer.setCellChar(cell_char);
-    renderer.setMode(mode);
-    
-    input.setRenderer(&renderer);
-    input.setShellPid(app_pid);
-    input.setTrackMouseMove(trackMouse);
-
-    setupTerminal(trackMouse);
+    bool serving = !serve_path.empty();
+    // Only the local terminal's input is traced; viewers type from elsewhere
+    LatencyTrace* trace_ptr = showStats && !serving ? &trace : nullptr;
     
-    signal(SIGINT, SIG_IGN);
+    // Signals go to the reactor's signalfd. They are blocked here, before the
+    // server or any other thread starts, so no thread takes them the old way.
+    // Without a terminal of its own the server is stopped like any other daemon.
+    Reactor reactor;
+    std::vector<int> signals = {SIGTERM, SIGQUIT, SIGWINCH};
+    if (serving) signals.push_back(SIGINT);
+    else signal(SIGINT, SIG_IGN);
     signal(SIGTSTP, SIG_IGN);
     
-    signal(SIGTERM, signalHandler);
-    signal(SIGQUIT, signalHandler);
+    bool reactor_ok = reactor.init() && reactor.watchSignals(signals, [&](int sig) {
+        if (sig != SIGWINCH) {
+            running = false;
+            return;
+        }
+        struct winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+            input.updateTerminalSize(ws.ws_col, ws.ws_row);
+            if (paned) panes.requestDimensions(ws.ws_col, ws.ws_row);
+            else renderer.requestDimensions(ws.ws_col, ws.ws_row);
+        }
+        // The capturer sees the root ConfigureNotify and rebuilds its image
+        if (display) {
+            int w = width, h = height;
+            fitToTerminal(fit_scale, w, h);
+            resizeScreen(display, w, h);
+            if (paned) {
+                placePaneWindows(display, pane_windows, w, h);
+            } else if (app_window && !windowOnly) {
+                XMoveResizeWindow(display, app_window, 0, 0, w, h);
+                XFlush(display);
+            }
+        }
+    });
+    if (!reactor_ok) {
+        std::cerr << "Error: could not set up the event loop\n";
+        capturer.cleanup();
+        vnc.cleanup();
+        cleanupChildren();
+        return 1;
+    }
     
-    write(STDOUT_FILENO, "\033[2J\033[H", 7);
+    ViewServer server;
+    if (serving) {
+        server.setSharedInput(sharedInput);
+        server.setPasteKey(pasteKey);
+        if (!server.init(serve_path, display_str, root_window, width, height) || !server.start()) {
+            std::cerr << "Failed to open viewer socket\n";
+            capturer.cleanup();
+            vnc.cleanup();
+            cleanupChildren();
+            return 1;
+        }
+    } else {
+        if (!input.init(display_str.c_str(), root_window, width, height, term_cols, term_lines)) {
+            std::cerr << "Warning: Failed to initialize input handler\n";
+        }
+        
+        renderer.setDimensions(term_cols, term_lines);
+        renderer.setImageSize(width, height);
+        if (cell_char != 0) renderer.setCellChar(cell_char);
+        renderer.setMode(mode);
+        
+        renderer.setOutput(&writer);
+        if (paned) {
+            unsigned int threads = std::thread::hardware_concurrency();
+            panes.init((int)pane_windows.size(), &writer, threads > 0 ? (int)threads : 2);
+            panes.requestDimensions(term_cols, term_lines);
+            if (cell_char != 0) panes.setCellChar(cell_char);
+            panes.setMode(mode);
+            input.setPanes(panes.getRenderers());
+        } else {
+            input.setRenderer(&renderer);
+        }
+        input.setShellPid(app_pid);
+        input.setTrackMouseMove(trackMouse);
+        input.setWakeOnMotion(isCursor);
+        input.setPasteKey(pasteKey);
+        input.setLatencyTrace(trace_ptr);
+        writer.setLatencyTrace(trace_ptr);
+        if (pasteKey != InputHandler::PASTE_TYPE) {
+            if (selection.init(display_str.c_str())) input.setSelection(&selection);
+            else std::cerr << "Warning: Failed to open selection connection, pastes will be typed\n";
+        }
+
+        setupTerminal(trackMouse);
+    }
     
-    auto capture_thread = std::thread(captureThread, &capturer, &renderer, std::ref(running), fps, isCursor);
-    auto input_thread_obj = std::thread(inputThread, &input, std::ref(running));
+    if (serving) {
+        std::cout << "Serving on " << serve_path << "; attach with: mirrors --view " << serve_path << "\n";
+    } else {
+        write(STDOUT_FILENO, "\033[2J\033[H", 7);
+        writer.setQueueTarget(outq_target);
+        writer.start(STDOUT_FILENO);
+    }
     
-    while (running) {
-        if (wm_pid > 0) {
-            int status;
-            pid_t result = waitpid(wm_pid, &status, WNOHANG);
-            if (result != 0) {
-                running = false;
-                break;
-            }
+    FrameRing* ring_ptr = publish_path.empty() ? nullptr : &ring;
+    TerminalView view{&renderer, &writer};
+    std::thread capture_thread;
+    // Xvnc paints the pointer into the framebuffer, so there is no cursor to fetch
+    if (useVnc && serving) {
+        capture_thread = std::thread(captureThread<VncCapturer, ViewServer>, &vnc, &server, ring_ptr, nullptr, std::ref(running), fps, coalesce_ms, false);
+    } else if (useVnc && paned) {
+        capture_thread = std::thread(captureThread<VncCapturer, PaneView>, &vnc, &panes, ring_ptr, trace_ptr, std::ref(running), fps, coalesce_ms, false);
+    } else if (useVnc) {
+        capture_thread = std::thread(captureThread<VncCapturer, TerminalView>, &vnc, &view, ring_ptr, trace_ptr, std::ref(running), fps, coalesce_ms, false);
+    } else if (serving) {
+        capture_thread = std::thread(captureThread<Capturer, ViewServer>, &capturer, &server, ring_ptr, nullptr, std::ref(running), fps, coalesce_ms, isCursor);
+    } else if (paned) {
+        capture_thread = std::thread(captureThread<Capturer, PaneView>, &capturer, &panes, ring_ptr, trace_ptr, std::ref(running), fps, coalesce_ms, isCursor);
+    } else {
+        capture_thread = std::thread(captureThread<Capturer, TerminalView>, &capturer, &view, ring_ptr, trace_ptr, std::ref(running), fps, coalesce_ms, isCursor);
+    }
+    
+    if (!serving) {
+        reactor.add(STDIN_FILENO, EPOLLIN, [&](uint32_t events) {
+            if (events & EPOLLIN) input.processInput();
+            if (events & (EPOLLHUP | EPOLLERR)) running = false;
+        });
+        if (input.getEscapeFd() >= 0) {
+            reactor.add(input.getEscapeFd(), EPOLLIN, [&](uint32_t) { input.escapeTimeout(); });
+        }
+        if (selection.getConnectionFd() >= 0) {
+            reactor.add(selection.getConnectionFd(), EPOLLIN, [&](uint32_t) { selection.processEvents(); });
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+    // The WM or the X server going away ends the session; apps just get reaped
+    reactor.watchChild(wm_pid, [&](int) {
+        wm_pid = -1;
+        running = false;
+    });
+    reactor.watchChild(xvfb_pid, [&](int) {
+        xvfb_pid = -1;
+        running = false;
+    });
+    reactor.watchChild(app_pid, [&](int) { app_pid = -1; });
+    for (pid_t& pid : pane_pids) {
+        reactor.watchChild(pid, [&pid](int) { pid = -1; });
+    }
+    reactor.run(running);
 
+    renderer.invalidate();
+    panes.invalidate();
+    writer.stop();
+    server.stop();
     capture_thread.join();
-    input_thread_obj.join();
     
+    reactor.cleanup();
+    panes.cleanup();
+    server.cleanup();
     capturer.cleanup();
+    vnc.cleanup();
+    ring.cleanup();
     input.cleanup();
+    selection.cleanup();
+    if (display) XCloseDisplay(display);
     cleanupChildren();
     
+    if (showStats) {
+        std::cerr << "\n";
+        writer.printStats(std::cerr);
+        trace.printStats(std::cerr);
+    }
+    
     return 0;
 }
@@ -0,0 +1,144 @@
+#include "output.h"
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+static const unsigned RING_ENTRIES = 64;
+#endif
+
+OutputEngine::OutputEngine() : fd(-1) {
+#ifdef HAVE_LIBURING
+    uring_active = false;
+#endif
+}
+
+OutputEngine::~OutputEngine() {
+    cleanup();
+}
+
+bool OutputEngine::init(int out_fd, bool use_uring) {
+    fd = out_fd;
+#ifdef HAVE_LIBURING
+    // Kernels without io_uring, or with it disabled, just get writev()
+    if (use_uring && io_uring_queue_init(RING_ENTRIES, &ring, 0) == 0) {
+        uring_active = true;
+    }
+#else
+    (void)use_uring;
+#endif
+    return true;
+}
+
+bool OutputEngine::usingUring() const {
+#ifdef HAVE_LIBURING
+    return uring_active;
+#else
+    return false;
+#endif
+}
+
+bool OutputEngine::registerBuffers(const struct iovec* regions, int n) {
+#ifdef HAVE_LIBURING
+    if (!uring_active) return false;
+    if (!fixed.empty()) {
+        io_uring_unregister_buffers(&ring);
+        fixed.clear();
+    }
+    if (n == 0) return true;
+    if (io_uring_register_buffers(&ring, regions, n) != 0) return false;
+    fixed.assign(regions, regions + n);
+    return true;
+#else
+    (void)regions; (void)n;
+    return false;
+#endif
+}
+
+ssize_t OutputEngine::write(const struct iovec* iov, int iovcnt) {
+#ifdef HAVE_LIBURING
+    if (uring_active) return writeUring(iov, iovcnt);
+#endif
+    if (iovcnt > IOV_MAX) iovcnt = IOV_MAX;
+    return writev(fd, iov, iovcnt);
+}
+
+#ifdef HAVE_LIBURING
+int OutputEngine::findFixed(const void* base, size_t len) const {
+    const char* p = static_cast<const char*>(base);
+    for (size_t i = 0; i < fixed.size(); i++) {
+        const char* start = static_cast<const char*>(fixed[i].iov_base);
+        if (p >= start && p + len <= start + fixed[i].iov_len) return i;
+    }
+    return -1;
+}
+
+// One linked chain per call: the kernel runs the writes in order and cancels
+// the rest of the chain as soon as one comes up short, so what was accepted
+// is always a prefix of the segments.
+ssize_t OutputEngine::writeUring(const struct iovec* iov, int iovcnt) {
+    if (iovcnt > (int)RING_ENTRIES) iovcnt = RING_ENTRIES;
+    
+    int queued = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (!sqe) break;
+        
+        int index = findFixed(iov[i].iov_base, iov[i].iov_len);
+        // Offset -1 writes at the current position, which also keeps
+        // redirection to a regular file appending in order
+        if (index >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, iov[i].iov_base, iov[i].iov_len, (uint64_t)-1, index);
+        } else {
+            io_uring_prep_write(sqe, fd, iov[i].iov_base, iov[i].iov_len, (uint64_t)-1);
+        }
+        io_uring_sqe_set_data(sqe, (void*)(uintptr_t)i);
+        if (i + 1 < iovcnt) sqe->flags |= IOSQE_IO_LINK;
+        queued++;
+    }
+    if (queued == 0) return 0;
+    
+    int ret = io_uring_submit_and_wait(&ring, queued);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    
+    std::vector<int> results(queued, -ECANCELED);
+    for (int done = 0; done < queued; done++) {
+        struct io_uring_cqe* cqe;
+        ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0) {
+            errno = -ret;
+            return -1;
+        }
+        uintptr_t i = (uintptr_t)io_uring_cqe_get_data(cqe);
+        if (i < results.size()) results[i] = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+    }
+    
+    ssize_t total = 0;
+    for (int i = 0; i < queued; i++) {
+        if (results[i] < 0) {
+            if (total > 0) break;
+            errno = -results[i];
+            return -1;
+        }
+        total += results[i];
+        if ((size_t)results[i] < iov[i].iov_len) break;
+    }
+    return total;
+}
+#endif
+
+void OutputEngine::cleanup() {
+#ifdef HAVE_LIBURING
+    if (uring_active) {
+        io_uring_queue_exit(&ring);
+        uring_active = false;
+        fixed.clear();
+    }
+#endif
+    fd = -1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Submits terminal output as a list of segments, so a frame held in several
+// pieces goes out without first being copied into one buffer. With io_uring
+// the segments become one chain of linked writes per call, taken from
+// registered buffers where possible so the kernel skips pinning the pages on
+// every write; without it this is writev().
+//
+// write() behaves like writev(): it returns the bytes accepted, which may be
+// short, or -1 with errno set (EAGAIN when the fd is non-blocking and full).
+class OutputEngine {
+private:
+    int fd;
+    
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool uring_active;
+    std::vector<struct iovec> fixed;
+    
+    int findFixed(const void* base, size_t len) const;
+    ssize_t writeUring(const struct iovec* iov, int iovcnt);
+#endif
+    
+public:
+    OutputEngine();
+    ~OutputEngine();
+    
+    bool init(int out_fd, bool use_uring = true);
+    bool usingUring() const;
+    
+    // Replaces the set of registered buffers. Segments inside one of them
+    // are written with fixed-buffer writes; anything else still works.
+    bool registerBuffers(const struct iovec* regions, int n);
+    
+    ssize_t write(const struct iovec* iov, int iovcnt);
+    
+    void cleanup();
+};
@@ -0,0 +1,342 @@
+#include "pane.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+ArenaChunk* PaneView::PaneBuffer::acquireChunk() {
+    if (used == chunks.size()) {
+        blocks.emplace_back(new char[getChunkSize()]);
+        chunks.push_back(ArenaChunk{blocks.back().get(), 0, false});
+    }
+    ArenaChunk* chunk = &chunks[used++];
+    chunk->len = 0;
+    return chunk;
+}
+
+PaneView::PaneView()
+    : writer(nullptr), wake_fd(-1), pending_dims(0),
+      term_cols(80), term_lines(24), image_width(0), image_height(0),
+      image_origin_x(0), image_origin_y(0), layout_dirty(true),
+      out_chunk(nullptr), out_len(0),
+      next_job(0), jobs_left(0), job_generation(0), pool_stopping(false),
+      frame_data(nullptr), frame_bpp(4), frame_bpl(0) {}
+
+PaneView::~PaneView() {
+    cleanup();
+}
+
+// Closest to square, wider than tall: 2 side by side, 4 in a 2x2
+void PaneView::gridSize(int count, int& cols, int& rows) {
+    if (count < 1) count = 1;
+    cols = (int)std::ceil(std::sqrt((double)count));
+    rows = (count + cols - 1) / cols;
+}
+
+void PaneView::slotRect(int index, int count, int w, int h, int& x, int& y, int& sw, int& sh) {
+    int cols, rows;
+    gridSize(count, cols, rows);
+    int c = index % cols, r = index / cols;
+    x = c * w / cols;
+    y = r * h / rows;
+    sw = (c + 1) * w / cols - x;
+    sh = (r + 1) * h / rows - y;
+}
+
+bool PaneView::init(int count, FrameWriter* output, int threads) {
+    writer = output;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) return false;
+
+    for (int i = 0; i < count; i++) {
+        std::unique_ptr<Pane> pane(new Pane());
+        pane->slot_x = pane->slot_y = pane->slot_w = pane->slot_h = 0;
+        pane->view_serial = 0;
+        pane->dirty = true;
+        pane->renderer.shareWakeFd(wake_fd);
+        pane->renderer.setOutput(&pane->buffer);
+        panes.push_back(std::move(pane));
+    }
+
+    // The capture thread renders too, so it counts as one of the threads
+    int helpers = std::min(threads, count) - 1;
+    for (int i = 0; i < helpers; i++) {
+        workers.emplace_back(&PaneView::workerLoop, this);
+    }
+    return true;
+}
+
+void PaneView::setMode(RenderMode m) {
+    for (auto& pane : panes) pane->renderer.setMode(m);
+}
+
+void PaneView::setCellChar(char c) {
+    for (auto& pane : panes) pane->renderer.setCellChar(c);
+}
+
+std::vector<ANSIRenderer*> PaneView::getRenderers() {
+    std::vector<ANSIRenderer*> renderers;
+    for (auto& pane : panes) renderers.push_back(&pane->renderer);
+    return renderers;
+}
+
+void PaneView::invalidate() {
+    uint64_t one = 1;
+    if (wake_fd >= 0) write(wake_fd, &one, sizeof(one));
+}
+
+void PaneView::requestDimensions(int cols, int lines) {
+    if (cols <= 0 || lines <= 0) return;
+    pending_dims = ((uint32_t)cols << 16) | ((uint32_t)lines & 0xFFFF);
+    invalidate();
+}
+
+// Zoom and pan come from the input thread through the shared wake fd; the
+// view serial tells which pane they were for.
+bool PaneView::consumeInvalidation() {
+    uint64_t count = 0;
+    if (wake_fd < 0) return false;
+    bool woken = read(wake_fd, &count, sizeof(count)) == sizeof(count) && count > 0;
+
+    uint32_t dims = pending_dims.exchange(0);
+    if (dims) {
+        term_cols = dims >> 16;
+        term_lines = dims & 0xFFFF;
+        layout_dirty = true;
+    }
+
+    for (auto& pane : panes) {
+        uint32_t serial = pane->renderer.getViewSerial();
+        if (serial != pane->view_serial) {
+            pane->view_serial = serial;
+            pane->dirty = true;
+        }
+    }
+    return woken;
+}
+
+void PaneView::markDamage(int x, int y, int w, int h) {
+    if (w <= 0 || h <= 0) return;
+    for (auto& pane : panes) {
+        if (x < pane->slot_x + pane->slot_w && x + w > pane->slot_x &&
+            y < pane->slot_y + pane->slot_h && y + h > pane->slot_y) {
+            pane->dirty = true;
+        }
+    }
+}
+
+// Only the panes under the old and the new pointer image need a redraw
+void PaneView::setCursor(const CaptureBackend::CursorData& c) {
+    bool moved = c.changed || c.x != cursor.x || c.y != cursor.y || c.visible != cursor.visible;
+    if (moved) {
+        const CaptureBackend::CursorData* both[] = {&cursor, &c};
+        for (const CaptureBackend::CursorData* cur : both) {
+            if (!cur->visible || !cur->image) continue;
+            markDamage(cur->x - cur->image->xhot, cur->y - cur->image->yhot,
+                       cur->image->width, cur->image->height);
+        }
+    }
+    cursor = c;
+}
+
+void PaneView::setImageOrigin(int x, int y) {
+    if (x != image_origin_x || y != image_origin_y) layout_dirty = true;
+    image_origin_x = x;
+    image_origin_y = y;
+}
+
+void PaneView::applyLayout() {
+    int count = (int)panes.size();
+    int grid_cols, grid_rows;
+    gridSize(count, grid_cols, grid_rows);
+
+    // Dividers take one column between pane columns and one line between rows
+    int usable_cols = std::max(term_cols - (grid_cols - 1), grid_cols);
+    int usable_lines = std::max(term_lines - (grid_rows - 1), grid_rows);
+
+    for (int i = 0; i < count; i++) {
+        Pane* pane = panes[i].get();
+        int c = i % grid_cols, r = i / grid_cols;
+        int col = c * usable_cols / grid_cols;
+        int row = r * usable_lines / grid_rows;
+        int cols = (c + 1) * usable_cols / grid_cols - col;
+        int lines = (r + 1) * usable_lines / grid_rows - row;
+
+        slotRect(i, count, image_width, image_height,
+                 pane->slot_x, pane->slot_y, pane->slot_w, pane->slot_h);
+
+        pane->renderer.setDimensions(cols, lines);
+        pane->renderer.setPlacement(col + c, row + r);
+        pane->renderer.setImageOrigin(image_origin_x + pane->slot_x, image_origin_y + pane->slot_y);
+        pane->dirty = true;
+    }
+}
+
+void PaneView::renderPane(Pane* pane) {
+    CaptureBackend::CursorData local = cursor;
+    local.x -= pane->slot_x;
+    local.y -= pane->slot_y;
+    pane->renderer.setCursor(local);
+
+    pane->buffer.reset();
+    const uint8_t* origin = frame_data + (size_t)pane->slot_y * frame_bpl + (size_t)pane->slot_x * frame_bpp;
+    pane->renderer.renderFrame(origin, pane->slot_w, pane->slot_h, frame_bpp, frame_bpl);
+}
+
+// Takes jobs until none are left; run by the capture thread and the workers
+void PaneView::runJobs() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while (next_job < jobs.size()) {
+        Pane* pane = jobs[next_job++];
+        lock.unlock();
+        renderPane(pane);
+        lock.lock();
+        if (--jobs_left == 0) pool_done.notify_all();
+    }
+}
+
+void PaneView::workerLoop() {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            pool_start.wait(lock, [&] { return pool_stopping || job_generation != seen; });
+            if (pool_stopping) return;
+            seen = job_generation;
+        }
+        runJobs();
+    }
+}
+
+bool PaneView::emit(const char* data, size_t len) {
+    while (len > 0) {
+        if (!out_chunk || out_len == writer->getChunkSize()) {
+            if (out_chunk) {
+                out_chunk->len = out_len;
+                writer->pushChunk(out_chunk, false);
+            }
+            out_chunk = writer->acquireChunk();
+            out_len = 0;
+            if (!out_chunk) return false;
+        }
+        size_t n = std::min(len, writer->getChunkSize() - out_len);
+        memcpy(out_chunk->data + out_len, data, n);
+        out_len += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void PaneView::emitDividers() {
+    static const char vertical[] = "\xe2\x94\x82";
+    static const char horizontal[] = "\xe2\x94\x80";
+    static const char cross[] = "\xe2\x94\xbc";
+    char seq[32];
+
+    emit("\033[0m\033[2J", 8);
+
+    int grid_cols, grid_rows;
+    gridSize((int)panes.size(), grid_cols, grid_rows);
+
+    // A pane's right and bottom neighbours start just past its divider
+    std::vector<int> divider_cols, divider_rows;
+    for (size_t i = 0; i < panes.size(); i++) {
+        const ANSIRenderer& r = panes[i]->renderer;
+        int c = (int)i % grid_cols;
+        if (c > 0 && i < (size_t)grid_cols) divider_cols.push_back(r.getPlaceCol() - 1);
+        if (c == 0 && i > 0) divider_rows.push_back(r.getPlaceRow() - 1);
+    }
+
+    for (int y = 0; y < term_lines; y++) {
+        bool on_row = std::find(divider_rows.begin(), divider_rows.end(), y) != divider_rows.end();
+        if (on_row) {
+            int len = snprintf(seq, sizeof(seq), "\033[%d;1H", y + 1);
+            emit(seq, len);
+            for (int x = 0; x < term_cols; x++) {
+                bool on_col = std::find(divider_cols.begin(), divider_cols.end(), x) != divider_cols.end();
+                emit(on_col ? cross : horizontal, 3);
+            }
+            continue;
+        }
+        for (int x : divider_cols) {
+            int len = snprintf(seq, sizeof(seq), "\033[%d;%dH", y + 1, x + 1);
+            emit(seq, len);
+            emit(vertical, 3);
+        }
+    }
+}
+
+void PaneView::renderFrame(const uint8_t* rgb_data, int width, int height,
+                           int bytes_per_pixel, int bytes_per_line) {
+    if (!writer || panes.empty()) return;
+
+    bool relayout = layout_dirty || width != image_width || height != image_height;
+    if (relayout) {
+        image_width = width;
+        image_height = height;
+        applyLayout();
+    }
+
+    std::vector<Pane*> dirty;
+    for (auto& pane : panes) {
+        if (pane->dirty && pane->slot_w > 0 && pane->slot_h > 0) dirty.push_back(pane.get());
+        pane->dirty = false;
+    }
+    if (dirty.empty() && !relayout) return;
+
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        jobs = dirty;
+        next_job = 0;
+        jobs_left = dirty.size();
+        frame_data = rgb_data;
+        frame_bpp = bytes_per_pixel;
+        frame_bpl = bytes_per_line;
+        job_generation++;
+    }
+    if (!workers.empty() && dirty.size() > 1) pool_start.notify_all();
+    runJobs();
+    {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        pool_done.wait(lock, [&] { return jobs_left == 0; });
+    }
+
+    out_chunk = nullptr;
+    out_len = 0;
+    if (relayout) {
+        emitDividers();
+        layout_dirty = false;
+    }
+    for (Pane* pane : dirty) {
+        for (size_t i = 0; i < pane->buffer.getChunkCount(); i++) {
+            const ArenaChunk& chunk = pane->buffer.getChunk(i);
+            if (!emit(chunk.data, chunk.len)) return;
+        }
+    }
+    if (!out_chunk) {
+        out_chunk = writer->acquireChunk();
+        out_len = 0;
+        if (!out_chunk) return;
+    }
+    out_chunk->len = out_len;
+    writer->pushChunk(out_chunk, true);
+    out_chunk = nullptr;
+}
+
+void PaneView::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_stopping = true;
+    }
+    pool_start.notify_all();
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+    workers.clear();
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "renderer.h"
+#include "writer.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Several apps share one screen and one terminal, tiled in the same grid on
+// both: screen slot i is shown in terminal pane i, with a one cell divider
+// between panes. Each pane has its own renderer, so zoom and pan are per app.
+//
+// To the capture loop this looks like a renderer. Damage is tracked per pane
+// and only panes that changed are encoded, in parallel on a small worker
+// pool; each renders into a private buffer that is then copied into the
+// writer in pane order, so one frame still goes out as one write stream.
+class PaneView {
+private:
+    // Growable chunk storage a renderer can encode into off the writer
+    class PaneBuffer : public FrameSink {
+    private:
+        std::deque<ArenaChunk> chunks;
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used;
+
+    public:
+        PaneBuffer() : used(0) {}
+        ArenaChunk* acquireChunk() override;
+        void pushChunk(ArenaChunk* chunk, bool frame_end) override { (void)chunk; (void)frame_end; }
+        size_t getChunkSize() const override { return 16 * 1024; }
+
+        size_t getChunkCount() const { return used; }
+        const ArenaChunk& getChunk(size_t i) const { return chunks[i]; }
+        void reset() { used = 0; }
+    };
+
+    struct Pane {
+        ANSIRenderer renderer;
+        PaneBuffer buffer;
+        int slot_x, slot_y, slot_w, slot_h;
+        uint32_t view_serial;
+        bool dirty;
+    };
+
+    std::vector<std::unique_ptr<Pane>> panes;
+    FrameWriter* writer;
+    int wake_fd;
+    std::atomic<uint32_t> pending_dims;
+
+    int term_cols, term_lines;
+    int image_width, image_height;
+    int image_origin_x, image_origin_y;
+    bool layout_dirty;
+
+    CaptureBackend::CursorData cursor;
+
+    ArenaChunk* out_chunk;
+    size_t out_len;
+
+    std::vector<std::thread> workers;
+    std::mutex pool_mutex;
+    std::condition_variable pool_start;
+    std::condition_variable pool_done;
+    std::vector<Pane*> jobs;
+    size_t next_job;
+    size_t jobs_left;
+    uint64_t job_generation;
+    bool pool_stopping;
+    const uint8_t* frame_data;
+    int frame_bpp, frame_bpl;
+
+    void applyLayout();
+    void markDamage(int x, int y, int w, int h);
+    void renderPane(Pane* pane);
+    void runJobs();
+    void workerLoop();
+    bool emit(const char* data, size_t len);
+    void emitDividers();
+
+public:
+    PaneView();
+    ~PaneView();
+
+    // Grid of `count` tiles over a w x h area; also used to place the windows
+    static void gridSize(int count, int& cols, int& rows);
+    static void slotRect(int index, int count, int w, int h, int& x, int& y, int& sw, int& sh);
+
+    bool init(int count, FrameWriter* output, int threads);
+    void setMode(RenderMode m);
+    void setCellChar(char c);
+    std::vector<ANSIRenderer*> getRenderers();
+
+    void invalidate();
+    void requestDimensions(int cols, int lines);
+
+    // Capture loop interface
+    int getWakeFd() const { return wake_fd; }
+    bool consumeInvalidation();
+    int getReadyFd() const { return writer->getReadyFd(); }
+    void consumeReady() { writer->consumeReady(); }
+    bool canAccept() { return writer->canAccept(); }
+    void setCursor(const CaptureBackend::CursorData& c);
+    void setImageOrigin(int x, int y);
+    void setDamage(int x, int y, int w, int h) { markDamage(x, y, w, h); }
+    void renderFrame(const uint8_t* rgb_data, int width, int height,
+                     int bytes_per_pixel, int bytes_per_line);
+
+    void cleanup();
+};
@@ -0,0 +1,123 @@
+#include "reactor.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+Reactor::Reactor() : epoll_fd(-1), signal_fd(-1) {}
+
+Reactor::~Reactor() {
+    cleanup();
+}
+
+bool Reactor::init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        std::cerr << "Error: epoll_create1 failed\n";
+        return false;
+    }
+    return true;
+}
+
+bool Reactor::add(int fd, uint32_t events, Handler handler) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+    handlers[fd] = std::move(handler);
+    return true;
+}
+
+void Reactor::remove(int fd) {
+    if (handlers.erase(fd)) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool Reactor::watchSignals(const std::vector<int>& signals, std::function<void(int)> handler) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int sig : signals) sigaddset(&mask, sig);
+    sigaddset(&mask, SIGCHLD);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) return false;
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) return false;
+    on_signal = std::move(handler);
+    return add(signal_fd, EPOLLIN, [this](uint32_t) { readSignals(); });
+}
+
+bool Reactor::watchChild(pid_t pid, std::function<void(int)> on_exit) {
+    if (pid <= 0) return false;
+#ifdef SYS_pidfd_open
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd >= 0) {
+        pid_fds.push_back(fd);
+        return add(fd, EPOLLIN, [this, fd, pid, on_exit](uint32_t) {
+            int status = 0;
+            if (waitpid(pid, &status, WNOHANG) == 0) return;
+            remove(fd);
+            close(fd);
+            pid_fds.erase(std::find(pid_fds.begin(), pid_fds.end(), fd));
+            on_exit(status);
+        });
+    }
+#endif
+    children.push_back(Child{pid, std::move(on_exit)});
+    // It may have exited before SIGCHLD was blocked
+    reapChildren();
+    return true;
+}
+
+void Reactor::readSignals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) reapChildren();
+        else if (on_signal) on_signal(info.ssi_signo);
+    }
+}
+
+// SIGCHLD coalesces, so every fallback child is checked on each one
+void Reactor::reapChildren() {
+    for (size_t i = 0; i < children.size();) {
+        int status = 0;
+        if (waitpid(children[i].pid, &status, WNOHANG) == children[i].pid) {
+            auto on_exit = std::move(children[i].on_exit);
+            children.erase(children.begin() + i);
+            on_exit(status);
+        } else {
+            i++;
+        }
+    }
+}
+
+void Reactor::run(std::atomic<bool>& running) {
+    struct epoll_event events[16];
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n && running; i++) {
+            // An earlier handler may have removed this fd
+            auto it = handlers.find(events[i].data.fd);
+            if (it == handlers.end()) continue;
+            Handler handler = it->second;
+            handler(events[i].events);
+        }
+    }
+}
+
+void Reactor::cleanup() {
+    for (int fd : pid_fds) close(fd);
+    pid_fds.clear();
+    handlers.clear();
+    if (signal_fd >= 0) close(signal_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    signal_fd = epoll_fd = -1;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+// The main thread's event loop: one epoll set holding the terminal, a
+// signalfd and a pidfd per child, so it sleeps until one of them is ready
+// instead of waking up to poll. Handlers run on the thread calling run().
+class Reactor {
+public:
+    using Handler = std::function<void(uint32_t events)>;
+
+private:
+    int epoll_fd;
+    int signal_fd;
+    std::unordered_map<int, Handler> handlers;
+    std::function<void(int)> on_signal;
+
+    // Children whose pidfd could not be opened are reaped on SIGCHLD instead
+    struct Child {
+        pid_t pid;
+        std::function<void(int)> on_exit;
+    };
+    std::vector<Child> children;
+    std::vector<int> pid_fds;
+
+    void readSignals();
+    void reapChildren();
+
+public:
+    Reactor();
+    ~Reactor();
+
+    bool init();
+
+    bool add(int fd, uint32_t events, Handler handler);
+    void remove(int fd);
+
+    // Blocks the signals (and SIGCHLD) in the calling thread and in every
+    // thread it starts afterwards, and delivers them here. Call it before
+    // starting other threads, or they may still take the signals.
+    bool watchSignals(const std::vector<int>& signals, std::function<void(int)> handler);
+    // Reaps pid once it exits and hands over its wait status
+    bool watchChild(pid_t pid, std::function<void(int)> on_exit);
+
+    // Dispatches until running turns false; only handlers can clear it
+    void run(std::atomic<bool>& running);
+
+    void cleanup();
+};
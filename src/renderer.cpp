@@ -3,25 +3,37 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 struct AnsiCode {
     char str[16];
     size_t len;
 };
 
-static std::vector<int> x_map_cache;
-static std::vector<AnsiCode> ansi_code_cache;
+static std::vector<AnsiCode> buildAnsiCodes() {
+    std::vector<AnsiCode> codes(256);
+    for (int i = 0; i < 256; ++i) {
+        codes[i].len = snprintf(codes[i].str, sizeof(codes[i].str), "\033[48;5;%dm", i);
+    }
+    return codes;
+}
+
+// Built once; renderers on several threads only ever read it
+static const std::vector<AnsiCode> ansi_code_cache = buildAnsiCodes();
 
 ANSIRenderer::ANSIRenderer() 
     : term_cols(80), term_lines(24),
       zoom_level(1.0f), viewport_x(0), viewport_y(0), viewport_w(0), viewport_h(0),
-      image_width(0), image_height(0), cell_char(0), mode(RenderMode::ANSI256) {
+      image_width(0), image_height(0), image_origin_x(0), image_origin_y(0),
+      place_col(0), place_row(0), placed(false),
+      cell_char(0), mode(RenderMode::ANSI256),
+      output(nullptr), chunk(nullptr), out(nullptr), out_end(nullptr),
+      damage_valid(false), damage_y1(0), damage_y2(0), full_pending(true), drawn_serial(0),
+      cursor_y1(0), cursor_y2(0), pending_dims(0), view_serial(0) {
     
-    ansi_code_cache.resize(256);
-    for (int i = 0; i < 256; ++i) {
-        int len = snprintf(ansi_code_cache[i].str, sizeof(ansi_code_cache[i].str), "\033[48;5;%dm", i);
-        ansi_code_cache[i].len = len;
-    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    owns_wake_fd = true;
     
     for (int r = 0; r < 32; ++r) {
         for (int g = 0; g < 32; ++g) {
@@ -54,13 +66,61 @@ ANSIRenderer::ANSIRenderer()
         }
     }
     
-    buffer.reserve(1920 * 1080 / 2);
     x_map_cache.reserve(300);
 }
 
+ANSIRenderer::~ANSIRenderer() {
+    if (owns_wake_fd && wake_fd >= 0) close(wake_fd);
+}
+
+void ANSIRenderer::shareWakeFd(int fd) {
+    if (owns_wake_fd && wake_fd >= 0) close(wake_fd);
+    wake_fd = fd;
+    owns_wake_fd = false;
+}
+
+// Called from the input thread when the view changes without any new damage,
+// so the capture loop re-renders the last frame instead of sleeping on.
+void ANSIRenderer::invalidate() {
+    uint64_t one = 1;
+    if (wake_fd >= 0) write(wake_fd, &one, sizeof(one));
+}
+
+bool ANSIRenderer::consumeInvalidation() {
+    uint64_t count = 0;
+    if (wake_fd < 0) return false;
+    bool woken = read(wake_fd, &count, sizeof(count)) == sizeof(count) && count > 0;
+    
+    applyPendingDimensions();
+    return woken;
+}
+
+void ANSIRenderer::applyPendingDimensions() {
+    uint32_t dims = pending_dims.exchange(0);
+    if (dims) setDimensions(dims >> 16, dims & 0xFFFF);
+}
+
+bool ANSIRenderer::sameView(const ANSIRenderer& other) const {
+    return term_cols == other.term_cols && term_lines == other.term_lines &&
+           mode == other.mode && cell_char == other.cell_char &&
+           viewport_x == other.viewport_x && viewport_y == other.viewport_y &&
+           viewport_w == other.viewport_w && viewport_h == other.viewport_h &&
+           image_origin_x == other.image_origin_x && image_origin_y == other.image_origin_y;
+}
+
+// The terminal size comes from the main thread; it is applied by the render
+// thread on its next wakeup so the maps never change under renderFrame.
+void ANSIRenderer::requestDimensions(int cols, int lines) {
+    if (cols <= 0 || lines <= 0) return;
+    pending_dims = ((uint32_t)cols << 16) | ((uint32_t)lines & 0xFFFF);
+    invalidate();
+}
+
 void ANSIRenderer::setMode(RenderMode m) {
     mode = m;
     back_buffer.assign(term_cols * term_lines, -1);
+    view_serial++;
+    invalidate();
 }
 
 
@@ -69,6 +129,7 @@ void ANSIRenderer::setDimensions(int cols, int lines) {
     term_lines = lines;
     x_map_cache.resize(cols);
     back_buffer.assign(cols * lines, -1); 
+    full_pending = true;
 }
 
 void ANSIRenderer::setImageSize(int w, int h) {
@@ -76,6 +137,7 @@ void ANSIRenderer::setImageSize(int w, int h) {
 
     image_width = w;
     image_height = h;
+    full_pending = true;
     
     if (viewport_w == 0 || viewport_h == 0) {
         viewport_w = w;
@@ -118,6 +180,10 @@ void ANSIRenderer::mapTermToImage(int term_x, int term_y, int& img_x, int& img_y
     if (img_x >= image_width) img_x = image_width - 1;
     if (img_y < 0) img_y = 0;
     if (img_y >= image_height) img_y = image_height - 1;
+    
+    // The image may be a single window; input is injected in root coordinates
+    img_x += image_origin_x;
+    img_y += image_origin_y;
 }
 
 
@@ -148,6 +214,8 @@ void ANSIRenderer::setZoom(float zoom, int center_term_x, int center_term_y) {
     }
     
     back_buffer.assign(term_cols * term_lines, -1);
+    view_serial++;
+    invalidate();
 }
 
 void ANSIRenderer::moveViewport(int dx, int dy) {
@@ -161,12 +229,16 @@ void ANSIRenderer::moveViewport(int dx, int dy) {
         clampViewport();
         
         back_buffer.assign(term_cols * term_lines, -1);
+        view_serial++;
+        invalidate();
     }
 }
 
 void ANSIRenderer::setCellChar(char c) {
     cell_char = c;
     back_buffer.assign(term_cols * term_lines, -1);
+    view_serial++;
+    invalidate();
 }
 
 inline uint8_t ANSIRenderer::rgbToGrayAnsi(uint8_t r, uint8_t g, uint8_t b) {
@@ -179,20 +251,74 @@ inline uint8_t ANSIRenderer::rgbToAnsi256(uint8_t r, uint8_t g, uint8_t b) {
     return color_lookup[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
 }
 
+// Hands a full chunk to the writer and takes the next one. Fails only once
+// the writer has stopped; the frame is then abandoned.
+bool ANSIRenderer::reserveOutput(size_t n) {
+    if (chunk && (size_t)(out_end - out) >= n) return true;
+    if (chunk) {
+        chunk->len = out - chunk->data;
+        output->pushChunk(chunk, false);
+    }
+    chunk = output->acquireChunk();
+    if (!chunk) {
+        out = out_end = nullptr;
+        return false;
+    }
+    out = chunk->data;
+    out_end = out + output->getChunkSize();
+    return true;
+}
+
+inline void ANSIRenderer::appendOutput(const char* data, size_t n) {
+    memcpy(out, data, n);
+    out += n;
+}
+
+void ANSIRenderer::finishOutput() {
+    chunk->len = out - chunk->data;
+    output->pushChunk(chunk, true);
+    chunk = nullptr;
+    out = out_end = nullptr;
+}
+
+void ANSIRenderer::setDamage(int x, int y, int w, int h) {
+    (void)x;
+    if (w <= 0 || h <= 0) {
+        if (!damage_valid) damage_y1 = damage_y2 = 0;
+    } else if (!damage_valid || damage_y2 <= damage_y1) {
+        damage_y1 = y;
+        damage_y2 = y + h;
+    } else {
+        damage_y1 = std::min(damage_y1, y);
+        damage_y2 = std::max(damage_y2, y + h);
+    }
+    damage_valid = true;
+}
+
+void ANSIRenderer::cursorRows(int& y1, int& y2) const {
+    y1 = y2 = 0;
+    if (!current_cursor.visible || !current_cursor.image) return;
+    y1 = current_cursor.y - current_cursor.image->yhot;
+    y2 = y1 + current_cursor.image->height;
+}
+
+void ANSIRenderer::frameSent() {
+    damage_valid = false;
+    full_pending = false;
+    drawn_serial = view_serial.load();
+    cursorRows(cursor_y1, cursor_y2);
+}
+
 void ANSIRenderer::renderFrame(const uint8_t* rgb_data, int width, int height,
                                int bytes_per_pixel, int bytes_per_line) {
     if (width != image_width || height != image_height) {
         setImageSize(width, height);
     }
 
-    buffer.clear();
-    size_t char_size = (mode == RenderMode::TRUECOLOR) ? 25 : 15;
-    size_t needed_cap = term_cols * term_lines * char_size;
-    if (buffer.capacity() < needed_cap) buffer.reserve(needed_cap);
+    if (!output) return;
 
     clampViewport();
 
-    static std::vector<int> img_x_cache;
     if (x_map_cache.size() != (size_t)term_cols) x_map_cache.resize(term_cols);
     if (img_x_cache.size() != (size_t)term_cols) img_x_cache.resize(term_cols);
     
@@ -203,36 +329,67 @@ void ANSIRenderer::renderFrame(const uint8_t* rgb_data, int width, int height,
         img_x_cache[x] = img_x;
     }
 
-    buffer.append("\033[H", 3);
+    // A partial frame positions each row it redraws, and redraws the rows
+    // the cursor leaves as well as the ones it enters
+    bool partial = damage_valid && !needsFullFrame();
+    bool position_rows = placed || partial;
+    int old_cursor_y1 = cursor_y1, old_cursor_y2 = cursor_y2;
+    int new_cursor_y1, new_cursor_y2;
+    cursorRows(new_cursor_y1, new_cursor_y2);
+    frameSent();
+
+    // Room for the longest cell: a truecolor escape plus the character
+    const size_t cell_max = 24;
+    if (!reserveOutput(cell_max)) return;
+    if (!position_rows) appendOutput("\033[H", 3);
 
     int last_ansi = -1;
     int last_r = -1, last_g = -1, last_b = -1;
     
     char char_to_print = (cell_char == 0) ? ' ' : cell_char;
     char tmp_seq[32]; 
+    
+    // Hold our own reference so the snapshot stays valid for the whole frame
+    std::shared_ptr<const CaptureBackend::CursorImage> cursor =
+        current_cursor.visible ? current_cursor.image : nullptr;
+    int cursor_left = cursor ? current_cursor.x - cursor->xhot : 0;
+    int cursor_top = cursor ? current_cursor.y - cursor->yhot : 0;
 
     for (int y = 0; y < term_lines; ++y) {
         int img_y = viewport_y + (int)((long long)y * viewport_h / term_lines);
         if (img_y < 0) img_y = 0; else if (img_y >= height) img_y = height - 1;
         
+        if (partial && !(img_y >= damage_y1 && img_y < damage_y2) &&
+            !(img_y >= old_cursor_y1 && img_y < old_cursor_y2) &&
+            !(img_y >= new_cursor_y1 && img_y < new_cursor_y2)) {
+            continue;
+        }
+        
         const uint8_t* row_ptr = rgb_data + (img_y * bytes_per_line);
         
+        if (position_rows) {
+            int len = snprintf(tmp_seq, sizeof(tmp_seq), "\033[%d;%dH",
+                               place_row + y + 1, place_col + 1);
+            appendOutput(tmp_seq, len);
+        }
+        
         for (int x = 0; x < term_cols; ++x) {
+            if (!reserveOutput(cell_max)) return;
             const uint8_t* pixel = row_ptr + x_map_cache[x];
             
             uint8_t r = pixel[2];
             uint8_t g = pixel[1];
             uint8_t b = pixel[0];
 
-            if (current_cursor.visible) {
+            if (cursor) {
                 int img_x = img_x_cache[x];
-                int cur_x = img_x - (current_cursor.x - current_cursor.xhot);
-                int cur_y = img_y - (current_cursor.y - current_cursor.yhot);
+                int cur_x = img_x - cursor_left;
+                int cur_y = img_y - cursor_top;
                 
-                if (cur_x >= 0 && cur_x < current_cursor.width &&
-                    cur_y >= 0 && cur_y < current_cursor.height) {
+                if (cur_x >= 0 && cur_x < cursor->width &&
+                    cur_y >= 0 && cur_y < cursor->height) {
                     
-                    uint32_t c_pixel = current_cursor.pixels[cur_y * current_cursor.width + cur_x];
+                    uint32_t c_pixel = cursor->pixels[cur_y * cursor->width + cur_x];
                     uint8_t ca = (c_pixel >> 24) & 0xFF;
                     
                     if (ca > 0) {
@@ -250,13 +407,13 @@ void ANSIRenderer::renderFrame(const uint8_t* rgb_data, int width, int height,
             if (mode == RenderMode::TRUECOLOR) {
                 if (r == 0 && g == 0 && b == 0) {
                     if (last_r != 0 || last_g != 0 || last_b != 0 || last_ansi != -2) {
-                        buffer.append("\033[49m", 5);
+                        appendOutput("\033[49m", 5);
                         last_r = 0; last_g = 0; last_b = 0;
                         last_ansi = -2; // tf
                     }
                 } else if (r != last_r || g != last_g || b != last_b) {
                     int len = snprintf(tmp_seq, sizeof(tmp_seq), "\033[48;2;%d;%d;%dm", r, g, b);
-                    buffer.append(tmp_seq, len);
+                    appendOutput(tmp_seq, len);
                     last_r = r; last_g = g; last_b = b;
                     last_ansi = -1;
                 }
@@ -265,12 +422,12 @@ void ANSIRenderer::renderFrame(const uint8_t* rgb_data, int width, int height,
                 uint8_t ansi = rgbToGrayAnsi(r, g, b);
                 if (r == 0 && g == 0 && b == 0) {
                     if (last_ansi != -2) {
-                        buffer.append("\033[49m", 5);
+                        appendOutput("\033[49m", 5);
                         last_ansi = -2;
                     }
                 } else if (ansi != last_ansi) {
                     const AnsiCode& code = ansi_code_cache[ansi];
-                    buffer.append(code.str, code.len);
+                    appendOutput(code.str, code.len);
                     last_ansi = ansi;
                 }
             } 
@@ -278,22 +435,24 @@ void ANSIRenderer::renderFrame(const uint8_t* rgb_data, int width, int height,
                 uint8_t ansi = color_lookup[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
                 if (r == 0 && g == 0 && b == 0) {
                     if (last_ansi != -2) {
-                        buffer.append("\033[49m", 5);
+                        appendOutput("\033[49m", 5);
                         last_ansi = -2;
                     }
                 } else if (ansi != last_ansi) {
                     const AnsiCode& code = ansi_code_cache[ansi];
-                    buffer.append(code.str, code.len);
+                    appendOutput(code.str, code.len);
                     last_ansi = ansi;
                 }
             }
-            buffer.push_back(char_to_print);
+            *out++ = char_to_print;
         }
         
-        if (y < term_lines - 1) {
-            buffer.append("\r\n", 2);
-        } else {
-            buffer.append("\033[0m", 4);
+        if (!position_rows && y < term_lines - 1) {
+            if (!reserveOutput(cell_max)) return;
+            appendOutput("\r\n", 2);
         }
     }
+    if (!reserveOutput(cell_max)) return;
+    appendOutput("\033[0m", 4);
+    finishOutput();
 }
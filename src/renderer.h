@@ -1,11 +1,18 @@
 #pragma once
 
 #include "x11/capture.h"
+#include "writer.h"
+#ifdef HAVE_XCB_CAPTURE
+#include "x11/xcb_capture.h"
+using CaptureBackend = XCBCapturer;
+#else
 using CaptureBackend = X11Capturer;
+#endif
 
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <atomic>
 
 enum class RenderMode {
     ANSI256,
@@ -20,43 +27,101 @@ private:
     int viewport_x, viewport_y;
     int viewport_w, viewport_h;
     int image_width, image_height;
+    int image_origin_x, image_origin_y;
+    int place_col, place_row;
+    bool placed;
     
     char cell_char;
     RenderMode mode;
     
-    std::string buffer;
+    FrameSink* output;
+    ArenaChunk* chunk;
+    char* out;
+    char* out_end;
     std::vector<int> back_buffer;
+    std::vector<int> x_map_cache;
+    std::vector<int> img_x_cache;
     
     uint8_t color_lookup[32768];
     uint8_t grayscale_lookup[256];
     
     CaptureBackend::CursorData current_cursor;
     
+    // Image rows changed since the last frame. Without them, or after
+    // anything that moves cells around, the next frame is drawn whole;
+    // otherwise only terminal rows sampling a changed image row are.
+    bool damage_valid;
+    int damage_y1, damage_y2;
+    bool full_pending;
+    uint32_t drawn_serial;
+    // Image rows the cursor covered in the last frame
+    int cursor_y1, cursor_y2;
+    
+    int wake_fd;
+    bool owns_wake_fd;
+    std::atomic<uint32_t> pending_dims;
+    std::atomic<uint32_t> view_serial;
+    
     void clampViewport();
+    bool reserveOutput(size_t n);
+    void appendOutput(const char* data, size_t n);
+    void finishOutput();
+    void cursorRows(int& y1, int& y2) const;
     
     inline uint8_t rgbToAnsi256(uint8_t r, uint8_t g, uint8_t b);
     inline uint8_t rgbToGrayAnsi(uint8_t r, uint8_t g, uint8_t b);
 
 public:
     ANSIRenderer();
+    ~ANSIRenderer();
     
     void setDimensions(int cols, int lines);
     void setImageSize(int w, int h);
+    void setImageOrigin(int x, int y) { image_origin_x = x; image_origin_y = y; }
     void setZoom(float zoom, int center_term_x = -1, int center_term_y = -1);
     void moveViewport(int dx, int dy);
     void setCellChar(char c);
     void setMode(RenderMode m);
-    
+    void setOutput(FrameSink* sink) { output = sink; }
+    // Draws into a rectangle of the terminal at the given 0-based cell
+    // instead of the whole screen; every row is then positioned explicitly.
+    void setPlacement(int col, int row) { place_col = col; place_row = row; placed = true; full_pending = true; }
+    bool coversCell(int col, int row) const {
+        return col >= place_col && col < place_col + term_cols &&
+               row >= place_row && row < place_row + term_lines;
+    }
+    int getPlaceCol() const { return place_col; }
+    int getPlaceRow() const { return place_row; }
+    float getZoom() const { return zoom_level; }
+    // Bumped whenever zoom, pan, mode or cell character change
+    uint32_t getViewSerial() const { return view_serial.load(); }
 
     void mapTermToImage(int term_x, int term_y, int& img_x, int& img_y);
     
+    int getWakeFd() const { return wake_fd; }
+    // Signals an eventfd owned by someone else, who then reads it and calls
+    // applyPendingDimensions() in place of consumeInvalidation()
+    void shareWakeFd(int fd);
+    void invalidate();
+    bool consumeInvalidation();
+    void applyPendingDimensions();
+    // True when both would encode a frame to the same bytes
+    bool sameView(const ANSIRenderer& other) const;
+    void requestDimensions(int cols, int lines);
+    
     void setCursor(const CaptureBackend::CursorData& cursor) {
         current_cursor = cursor;
     }
     
+    // The image rectangle that changed since the last frame, for the next one
+    void setDamage(int x, int y, int w, int h);
+    // The terminal may not show the last frame (it was skipped or cut off)
+    void forceFullFrame() { full_pending = true; }
+    bool needsFullFrame() const { return full_pending || drawn_serial != view_serial.load(); }
+    // Another renderer with the same view drew the frame for this one
+    void frameSent();
+    
     void renderFrame(const uint8_t* rgb_data, int width, int height,
                     int bytes_per_pixel, int bytes_per_line);
-    
-    const char* getData() const { return buffer.c_str(); }
-    size_t getSize() const { return buffer.size(); }
+
 };
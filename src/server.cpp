@@ -0,0 +1,407 @@
+#include "server.h"
+#include "unixsocket.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Hands every chunk of one encode to several writers. The first writer's
+// chunk is the one rendered into; the others get copies, which costs a
+// memcpy per chunk instead of a render per viewer. Only the first writer
+// may block the render: a copy that finds its writer's arena full drops that
+// viewer from the rest of the frame, and it gets a whole one once it drains.
+class FanoutSink : public FrameSink {
+private:
+    std::vector<FrameWriter*> targets;
+    std::vector<std::atomic<bool>*> stale_flags;
+    
+public:
+    void add(FrameWriter* writer, std::atomic<bool>* stale) {
+        targets.push_back(writer);
+        stale_flags.push_back(stale);
+    }
+    
+    ArenaChunk* acquireChunk() override {
+        return targets[0]->acquireChunk();
+    }
+    
+    void pushChunk(ArenaChunk* chunk, bool frame_end) override {
+        for (size_t i = 1; i < targets.size(); i++) {
+            if (!targets[i]) continue;
+            ArenaChunk* copy = targets[i]->tryAcquireChunk();
+            // Its output is backed up, or the viewer went away mid-frame
+            if (!copy) {
+                targets[i]->abortFrame();
+                *stale_flags[i] = true;
+                targets[i] = nullptr;
+                continue;
+            }
+            memcpy(copy->data, chunk->data, chunk->len);
+            copy->len = chunk->len;
+            targets[i]->pushChunk(copy, frame_end);
+        }
+        targets[0]->pushChunk(chunk, frame_end);
+    }
+    
+    size_t getChunkSize() const override {
+        return targets[0]->getChunkSize();
+    }
+};
+
+ViewServer::ViewServer()
+    : listen_fd(-1), wake_fd(-1), ready_fd(-1), stop_fd(-1),
+      root_window(0), image_width(0), image_height(0), shared_input(false),
+      paste_key(InputHandler::PASTE_CTRL_V),
+      image_origin_x(0), image_origin_y(0), damage_x(0), damage_y(0), damage_w(0), damage_h(0) {
+}
+
+ViewServer::~ViewServer() {
+    cleanup();
+}
+
+bool ViewServer::init(const std::string& path, const std::string& display, Window root,
+                      int width, int height) {
+    if (path.size() >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        std::cerr << "Viewer socket path too long\n";
+        return false;
+    }
+    
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return false;
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (!clearStaleSocket(path, addr)) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 8) != 0) {
+        std::cerr << "Failed to listen on " << path << "\n";
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    socket_path = path;
+    
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 || ready_fd < 0 || stop_fd < 0) {
+        cleanup();
+        return false;
+    }
+    
+    display_name = display;
+    root_window = root;
+    if (paste_key != InputHandler::PASTE_TYPE && !selection.init(display.c_str())) {
+        std::cerr << "Warning: Failed to open selection connection, pastes will be typed\n";
+    }
+    image_width = width;
+    image_height = height;
+    return true;
+}
+
+bool ViewServer::start() {
+    if (listen_fd < 0) return false;
+    thread = std::thread(&ViewServer::run, this);
+    return true;
+}
+
+void ViewServer::stop() {
+    if (!thread.joinable()) return;
+    notify(stop_fd);
+    thread.join();
+    
+    std::vector<std::shared_ptr<Viewer>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining = viewers;
+    }
+    for (auto& viewer : remaining) removeViewer(viewer);
+}
+
+void ViewServer::notify(int fd) {
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+size_t ViewServer::getViewerCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return viewers.size();
+}
+
+void ViewServer::run() {
+    std::vector<struct pollfd> fds;
+    std::vector<std::shared_ptr<Viewer>> polled;
+    
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            polled = viewers;
+        }
+        
+        // Per viewer: its socket, its writer's ready fd, its escape timeout
+        fds.resize(3 + polled.size() * 3);
+        fds[0].fd = stop_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = POLLIN;
+        fds[2].fd = selection.getConnectionFd();
+        fds[2].events = POLLIN;
+        for (size_t i = 0; i < polled.size(); i++) {
+            fds[3 + i * 3].fd = polled[i]->fd;
+            fds[3 + i * 3].events = POLLIN;
+            fds[4 + i * 3].fd = polled[i]->ready ? polled[i]->writer.getReadyFd() : -1;
+            fds[4 + i * 3].events = POLLIN;
+            fds[5 + i * 3].fd = polled[i]->ready ? polled[i]->input.getEscapeFd() : -1;
+            fds[5 + i * 3].events = POLLIN;
+        }
+        
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+        if (fds[0].revents & POLLIN) break;
+        if (fds[1].revents & POLLIN) acceptViewer();
+        if (fds[2].revents & POLLIN) selection.processEvents();
+        
+        for (size_t i = 0; i < polled.size(); i++) {
+            Viewer* viewer = polled[i].get();
+            if (fds[3 + i * 3].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!readViewer(viewer)) {
+                    removeViewer(polled[i]);
+                    continue;
+                }
+            }
+            if (fds[5 + i * 3].revents & POLLIN) viewer->input.escapeTimeout();
+            if (fds[4 + i * 3].revents & POLLIN) {
+                viewer->writer.consumeReady();
+                notify(ready_fd);
+                // It missed a frame while busy; render again so it catches up
+                if (viewer->stale) notify(wake_fd);
+            }
+        }
+    }
+}
+
+void ViewServer::acceptViewer() {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    
+    auto viewer = std::make_shared<Viewer>(fd);
+    std::lock_guard<std::mutex> lock(mutex);
+    viewers.push_back(viewer);
+}
+
+bool ViewServer::readViewer(Viewer* viewer) {
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(viewer->fd, buf, sizeof(buf));
+        if (n > 0) {
+            viewer->inbuf.insert(viewer->inbuf.end(), buf, buf + n);
+            continue;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return false;
+    }
+    
+    size_t pos = 0;
+    while (viewer->inbuf.size() - pos >= sizeof(ViewerMessageHeader)) {
+        ViewerMessageHeader header;
+        memcpy(&header, viewer->inbuf.data() + pos, sizeof(header));
+        if (header.length > 65536) return false;
+        if (viewer->inbuf.size() - pos - sizeof(header) < header.length) break;
+        
+        const char* payload = viewer->inbuf.data() + pos + sizeof(header);
+        if (!handleMessage(viewer, header.type, payload, header.length)) return false;
+        pos += sizeof(header) + header.length;
+    }
+    viewer->inbuf.erase(viewer->inbuf.begin(), viewer->inbuf.begin() + pos);
+    return true;
+}
+
+bool ViewServer::handleMessage(Viewer* viewer, uint8_t type, const char* payload, uint32_t length) {
+    if (type == VIEWER_HELLO) {
+        if (viewer->ready || length < sizeof(ViewerHello)) return false;
+        ViewerHello hello;
+        memcpy(&hello, payload, sizeof(hello));
+        if (hello.cols == 0 || hello.lines == 0 || hello.cols > MAX_VIEWER_DIM || hello.lines > MAX_VIEWER_DIM ||
+            hello.mode > (uint8_t)RenderMode::GRAYSCALE) return false;
+        
+        viewer->renderer.shareWakeFd(wake_fd);
+        viewer->renderer.setDimensions(hello.cols, hello.lines);
+        viewer->renderer.setImageSize(image_width, image_height);
+        viewer->renderer.setMode((RenderMode)hello.mode);
+        if (hello.cell_char != 0) viewer->renderer.setCellChar(hello.cell_char);
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bool has_controller = false;
+            for (auto& other : viewers) has_controller |= other->controller;
+            viewer->controller = !has_controller;
+        }
+        
+        viewer->input.setRenderer(&viewer->renderer);
+        viewer->input.setAllowQuit(false);
+        viewer->input.setViewOnly(!shared_input && !viewer->controller);
+        viewer->input.setSelection(&selection);
+        viewer->input.setPasteKey(paste_key);
+        if (!viewer->input.init(display_name.c_str(), root_window, image_width, image_height,
+                                hello.cols, hello.lines)) {
+            std::cerr << "Warning: Failed to initialize input for viewer\n";
+        }
+        
+        if (!viewer->writer.start(viewer->fd)) return false;
+        viewer->ready = true;
+        // A fresh viewer starts with a full frame
+        notify(wake_fd);
+        return true;
+    }
+    
+    if (!viewer->ready) return false;
+    
+    if (type == VIEWER_RESIZE) {
+        if (length < sizeof(ViewerResize)) return false;
+        ViewerResize resize;
+        memcpy(&resize, payload, sizeof(resize));
+        if (resize.cols == 0 || resize.lines == 0 || resize.cols > MAX_VIEWER_DIM || resize.lines > MAX_VIEWER_DIM) {
+            return false;
+        }
+        viewer->input.updateTerminalSize(resize.cols, resize.lines);
+        viewer->renderer.requestDimensions(resize.cols, resize.lines);
+    } else if (type == VIEWER_INPUT) {
+        // A sequence split across messages is resolved by the escape timeout
+        viewer->input.processBytes(payload, length);
+    }
+    return true;
+}
+
+// Stopping the writer first lets a render for this viewer bail out; the
+// viewer itself is freed once the capture loop lets go of it too
+void ViewServer::removeViewer(const std::shared_ptr<Viewer>& viewer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = std::find(viewers.begin(), viewers.end(), viewer);
+        if (it == viewers.end()) return;
+        viewers.erase(it);
+        
+        // Hand the controls to whoever has been attached longest
+        if (viewer->controller) {
+            for (auto& other : viewers) {
+                if (!other->ready) continue;
+                other->controller = true;
+                other->input.setViewOnly(false);
+                break;
+            }
+        }
+    }
+    
+    viewer->ready = false;
+    viewer->writer.stop();
+    viewer->input.cleanup();
+    close(viewer->fd);
+    notify(ready_fd);
+}
+
+bool ViewServer::consumeInvalidation() {
+    uint64_t count = 0;
+    bool woken = read(wake_fd, &count, sizeof(count)) == sizeof(count) && count > 0;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& viewer : viewers) {
+        if (viewer->ready) viewer->renderer.applyPendingDimensions();
+    }
+    return woken;
+}
+
+void ViewServer::consumeReady() {
+    uint64_t count;
+    read(ready_fd, &count, sizeof(count));
+}
+
+// With nobody attached this stays false, so the loop captures and renders
+// nothing at all
+bool ViewServer::canAccept() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& viewer : viewers) {
+        if (viewer->ready && viewer->writer.canAccept()) return true;
+    }
+    return false;
+}
+
+void ViewServer::renderFrame(const uint8_t* rgb_data, int width, int height,
+                             int bytes_per_pixel, int bytes_per_line) {
+    std::vector<std::shared_ptr<Viewer>> targets;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& viewer : viewers) {
+            if (!viewer->ready) continue;
+            if (viewer->writer.canAccept()) {
+                // It missed frames, so its terminal cannot take a partial one
+                if (viewer->stale) viewer->renderer.forceFullFrame();
+                viewer->stale = false;
+                targets.push_back(viewer);
+            } else {
+                viewer->stale = true;
+            }
+        }
+    }
+    
+    for (auto& viewer : targets) {
+        viewer->renderer.setCursor(cursor);
+        viewer->renderer.setImageOrigin(image_origin_x, image_origin_y);
+    }
+    
+    // Each pass renders once for the first remaining viewer and everyone
+    // whose view matches it
+    while (!targets.empty()) {
+        Viewer* lead = targets[0].get();
+        FanoutSink fanout;
+        fanout.add(&lead->writer, &lead->stale);
+        
+        // Only changed rows go out if every copy can take them
+        std::vector<Viewer*> copies;
+        bool full = lead->renderer.needsFullFrame();
+        std::vector<std::shared_ptr<Viewer>> rest;
+        for (size_t i = 1; i < targets.size(); i++) {
+            if (targets[i]->renderer.sameView(lead->renderer)) {
+                fanout.add(&targets[i]->writer, &targets[i]->stale);
+                copies.push_back(targets[i].get());
+                full |= targets[i]->renderer.needsFullFrame();
+            } else {
+                rest.push_back(targets[i]);
+            }
+        }
+        
+        if (full) lead->renderer.forceFullFrame();
+        lead->renderer.setDamage(damage_x, damage_y, damage_w, damage_h);
+        lead->renderer.setOutput(&fanout);
+        lead->renderer.renderFrame(rgb_data, width, height, bytes_per_pixel, bytes_per_line);
+        lead->renderer.setOutput(nullptr);
+        for (Viewer* copy : copies) copy->renderer.frameSent();
+        targets.swap(rest);
+    }
+}
+
+void ViewServer::cleanup() {
+    stop();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path.c_str());
+    }
+    if (wake_fd >= 0) close(wake_fd);
+    if (ready_fd >= 0) close(ready_fd);
+    if (stop_fd >= 0) close(stop_fd);
+    wake_fd = ready_fd = stop_fd = -1;
+    selection.cleanup();
+}
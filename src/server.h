@@ -0,0 +1,126 @@
+#pragma once
+
+#include "renderer.h"
+#include "writer.h"
+#include "x11/input.h"
+#include "x11/selection.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Viewers connect to a Unix socket and talk in messages: a header, then
+// `length` bytes of payload. The first message must be a hello; after that
+// the viewer sends resizes and raw terminal input. The server answers with
+// nothing but the terminal output stream, to be written to the tty as is.
+enum ViewerMessageType : uint8_t {
+    VIEWER_HELLO = 1,
+    VIEWER_RESIZE = 2,
+    VIEWER_INPUT = 3
+};
+
+struct ViewerMessageHeader {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t length;
+};
+
+struct ViewerHello {
+    uint16_t cols;
+    uint16_t lines;
+    uint8_t mode;
+    char cell_char;
+    uint8_t reserved[2];
+};
+
+struct ViewerResize {
+    uint16_t cols;
+    uint16_t lines;
+};
+
+// Larger sizes are refused; the renderer keeps a cell per column and line
+const int MAX_VIEWER_DIM = 4096;
+
+// Serves one capture to any number of attached terminals. Every viewer has
+// its own renderer (size, mode, zoom and pan), its own writer and with it its
+// own pacing; viewers whose renderers would produce the same bytes share one
+// encode per frame. Only one viewer at a time drives the app, the first to
+// attach, unless input is shared; the others can still zoom and pan.
+//
+// To the capture loop this looks like a renderer: it is woken through
+// getWakeFd() and getReadyFd() and renders to every viewer that can take a
+// frame. A viewer that was busy is rendered for again once it drains.
+class ViewServer {
+private:
+    struct Viewer {
+        int fd;
+        std::atomic<bool> ready;
+        std::atomic<bool> stale;
+        bool controller;
+        std::vector<char> inbuf;
+        ANSIRenderer renderer;
+        FrameWriter writer;
+        InputHandler input;
+        
+        Viewer(int socket_fd) : fd(socket_fd), ready(false), stale(false), controller(false) {}
+    };
+    
+    std::string socket_path;
+    int listen_fd;
+    int wake_fd;
+    int ready_fd;
+    int stop_fd;
+    std::thread thread;
+    
+    std::string display_name;
+    Window root_window;
+    int image_width, image_height;
+    bool shared_input;
+    InputHandler::PasteKey paste_key;
+    // Pastes from every viewer go through the one owner on the server thread
+    SelectionOwner selection;
+    
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Viewer>> viewers;
+    
+    CaptureBackend::CursorData cursor;
+    int image_origin_x, image_origin_y;
+    int damage_x, damage_y, damage_w, damage_h;
+    
+    void run();
+    void acceptViewer();
+    bool readViewer(Viewer* viewer);
+    bool handleMessage(Viewer* viewer, uint8_t type, const char* payload, uint32_t length);
+    void removeViewer(const std::shared_ptr<Viewer>& viewer);
+    void notify(int fd);
+    
+public:
+    ViewServer();
+    ~ViewServer();
+    
+    void setSharedInput(bool shared) { shared_input = shared; }
+    void setPasteKey(InputHandler::PasteKey key) { paste_key = key; }
+    
+    bool init(const std::string& path, const std::string& display, Window root, int width, int height);
+    bool start();
+    void stop();
+    
+    size_t getViewerCount();
+    
+    // Capture loop interface
+    int getWakeFd() const { return wake_fd; }
+    bool consumeInvalidation();
+    int getReadyFd() const { return ready_fd; }
+    void consumeReady();
+    bool canAccept();
+    void setCursor(const CaptureBackend::CursorData& c) { cursor = c; }
+    void setImageOrigin(int x, int y) { image_origin_x = x; image_origin_y = y; }
+    void setDamage(int x, int y, int w, int h) { damage_x = x; damage_y = y; damage_w = w; damage_h = h; }
+    void renderFrame(const uint8_t* rgb_data, int width, int height,
+                     int bytes_per_pixel, int bytes_per_line);
+    
+    void cleanup();
+};
@@ -0,0 +1,35 @@
+#include "unixsocket.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+bool clearStaleSocket(const std::string& path, const struct sockaddr_un& addr) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        if (errno == ENOENT) return true;
+        std::cerr << "Cannot stat " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        std::cerr << path << " exists and is not a socket\n";
+        return false;
+    }
+    
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return false;
+    int rc = connect(probe, (const struct sockaddr*)&addr, sizeof(addr));
+    int err = errno;
+    close(probe);
+    if (rc == 0) {
+        std::cerr << "Another server is already listening on " << path << "\n";
+        return false;
+    }
+    if (err != ECONNREFUSED) {
+        std::cerr << "Cannot probe " << path << ": " << strerror(err) << "\n";
+        return false;
+    }
+    return unlink(path.c_str()) == 0 || errno == ENOENT;
+}
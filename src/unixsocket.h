@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+#include <sys/un.h>
+
+// Makes way for a listening socket at path: true if the path is free, or
+// held by a socket nobody listens on any more, which is removed. A live
+// listener or anything that is not a socket is left in place and reported.
+bool clearStaleSocket(const std::string& path, const struct sockaddr_un& addr);
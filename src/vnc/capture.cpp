@@ -0,0 +1,581 @@
+#include "capture.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// RFB message and encoding numbers (RFC 6143)
+enum {
+    MSG_FRAMEBUFFER_UPDATE = 0,
+    MSG_SET_COLOUR_MAP = 1,
+    MSG_BELL = 2,
+    MSG_CUT_TEXT = 3,
+};
+
+enum {
+    ENC_RAW = 0,
+    ENC_COPYRECT = 1,
+    ENC_ZRLE = 16,
+    ENC_DESKTOP_SIZE = -223,
+};
+
+static inline uint16_t be16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void putBe16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void putBe32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+VncCapturer::VncCapturer()
+    : sock(-1), in_pos(0), width(0), height(0),
+      frame_ready(false), frame_changed(false), event_count(0),
+      damage_x1(0), damage_y1(0), damage_x2(0), damage_y2(0),
+      changed_x1(0), changed_y1(0), changed_x2(0), changed_y2(0) {
+#ifdef HAVE_ZLIB
+    memset(&zstream, 0, sizeof(zstream));
+    zstream_active = false;
+#endif
+}
+
+VncCapturer::~VncCapturer() {
+    cleanup();
+}
+
+bool VncCapturer::readExact(void* buf, size_t n) {
+    uint8_t* p = (uint8_t*)buf;
+    while (n > 0) {
+        ssize_t r = read(sock, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool VncCapturer::writeAll(const void* buf, size_t n) {
+    const uint8_t* p = (const uint8_t*)buf;
+    while (n > 0) {
+        ssize_t w = send(sock, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { sock, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// Versions 3.3 to 3.8 with the None security type; Xvnc is started without
+// authentication and only listens on a socket in our private directory.
+bool VncCapturer::handshake() {
+    char version[13] = {0};
+    if (!readExact(version, 12) || strncmp(version, "RFB ", 4) != 0) return false;
+    int minor = atoi(version + 8);
+
+    const char* reply = minor >= 8 ? "RFB 003.008\n" : minor == 7 ? "RFB 003.007\n" : "RFB 003.003\n";
+    if (!writeAll(reply, 12)) return false;
+
+    if (minor >= 7) {
+        uint8_t count = 0;
+        if (!readExact(&count, 1) || count == 0) return false;
+        std::vector<uint8_t> types(count);
+        if (!readExact(types.data(), count)) return false;
+        if (std::find(types.begin(), types.end(), 1) == types.end()) {
+            std::cerr << "VNC server requires authentication\n";
+            return false;
+        }
+        uint8_t none = 1;
+        if (!writeAll(&none, 1)) return false;
+    } else {
+        uint8_t type[4];
+        if (!readExact(type, 4) || be32(type) != 1) return false;
+    }
+
+    if (minor >= 8) {
+        uint8_t result[4];
+        if (!readExact(result, 4) || be32(result) != 0) return false;
+    }
+
+    uint8_t shared = 1;
+    if (!writeAll(&shared, 1)) return false;
+
+    uint8_t server_init[24];
+    if (!readExact(server_init, 24)) return false;
+    std::vector<char> name(be32(server_init + 20));
+    if (!name.empty() && !readExact(name.data(), name.size())) return false;
+    resize(be16(server_init), be16(server_init + 2));
+
+    // 32bpp little-endian with red in bits 16-23 is B,G,R,X in memory,
+    // the layout the renderer expects
+    uint8_t format[20] = {0};
+    format[0] = 0; // SetPixelFormat
+    format[4] = 32;
+    format[5] = 24;
+    format[6] = 0;
+    format[7] = 1;
+    putBe16(format + 8, 255);
+    putBe16(format + 10, 255);
+    putBe16(format + 12, 255);
+    format[14] = 16;
+    format[15] = 8;
+    format[16] = 0;
+    if (!writeAll(format, sizeof(format))) return false;
+
+    std::vector<int32_t> encodings;
+#ifdef HAVE_ZLIB
+    encodings.push_back(ENC_ZRLE);
+#endif
+    encodings.push_back(ENC_COPYRECT);
+    encodings.push_back(ENC_RAW);
+    encodings.push_back(ENC_DESKTOP_SIZE);
+
+    std::vector<uint8_t> msg(4 + encodings.size() * 4);
+    msg[0] = 2; // SetEncodings
+    putBe16(msg.data() + 2, encodings.size());
+    for (size_t i = 0; i < encodings.size(); ++i) {
+        putBe32(msg.data() + 4 + i * 4, (uint32_t)encodings[i]);
+    }
+    return writeAll(msg.data(), msg.size());
+}
+
+void VncCapturer::requestUpdate(bool incremental) {
+    uint8_t msg[10];
+    msg[0] = 3; // FramebufferUpdateRequest
+    msg[1] = incremental ? 1 : 0;
+    putBe16(msg + 2, 0);
+    putBe16(msg + 4, 0);
+    putBe16(msg + 6, width);
+    putBe16(msg + 8, height);
+    writeAll(msg, sizeof(msg));
+}
+
+bool VncCapturer::init(const std::string& socket_path) {
+    cleanup();
+
+    struct sockaddr_un addr;
+    if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return false;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::cerr << "Failed to connect to VNC server at " << socket_path << "\n";
+        cleanup();
+        return false;
+    }
+
+    if (!handshake()) {
+        std::cerr << "VNC handshake failed\n";
+        cleanup();
+        return false;
+    }
+
+#ifdef HAVE_ZLIB
+    if (inflateInit(&zstream) == Z_OK) zstream_active = true;
+#endif
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    requestUpdate(false);
+
+    std::cout << "VNC connected: " << width << "x" << height << "\n";
+    return true;
+}
+
+void VncCapturer::resize(int w, int h) {
+    width = w;
+    height = h;
+    framebuffer.assign((size_t)w * h * 4, 0);
+    addDamage(0, 0, w, h);
+}
+
+void VncCapturer::addDamage(int x, int y, int w, int h) {
+    if (damage_x2 <= damage_x1) {
+        damage_x1 = x;
+        damage_y1 = y;
+        damage_x2 = x + w;
+        damage_y2 = y + h;
+    } else {
+        damage_x1 = std::min(damage_x1, x);
+        damage_y1 = std::min(damage_y1, y);
+        damage_x2 = std::max(damage_x2, x + w);
+        damage_y2 = std::max(damage_y2, y + h);
+    }
+}
+
+int VncCapturer::processEvents() {
+    if (sock < 0) return 0;
+
+    event_count = 0;
+    const size_t chunk = 256 * 1024;
+    while (true) {
+        size_t old = inbuf.size();
+        inbuf.resize(old + chunk);
+        ssize_t n = recv(sock, inbuf.data() + old, chunk, 0);
+        inbuf.resize(old + std::max<ssize_t>(n, 0));
+
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        std::cerr << "VNC server closed the connection\n";
+        close(sock);
+        sock = -1;
+        break;
+    }
+
+    if (!parseMessages()) {
+        std::cerr << "Unsupported or corrupt message from VNC server\n";
+        if (sock >= 0) close(sock);
+        sock = -1;
+    }
+
+    if (in_pos > 0) {
+        inbuf.erase(inbuf.begin(), inbuf.begin() + in_pos);
+        in_pos = 0;
+    }
+    return event_count;
+}
+
+bool VncCapturer::parseMessages() {
+    while (in_pos < inbuf.size()) {
+        const uint8_t* p = inbuf.data() + in_pos;
+        size_t avail = inbuf.size() - in_pos;
+
+        switch (p[0]) {
+            case MSG_FRAMEBUFFER_UPDATE: {
+                size_t end;
+                bool complete;
+                if (!measureUpdate(in_pos, end, complete)) return false;
+                if (!complete) return true;
+                if (!applyUpdate(in_pos)) return false;
+                in_pos = end;
+                frame_ready = true;
+                event_count++;
+                // Answered only once there is something new to send
+                requestUpdate(true);
+                break;
+            }
+            case MSG_SET_COLOUR_MAP: {
+                if (avail < 6) return true;
+                size_t len = 6 + (size_t)be16(p + 4) * 6;
+                if (avail < len) return true;
+                in_pos += len;
+                break;
+            }
+            case MSG_BELL:
+                in_pos += 1;
+                break;
+            case MSG_CUT_TEXT: {
+                if (avail < 8) return true;
+                size_t len = 8 + (size_t)be32(p + 4);
+                if (avail < len) return true;
+                in_pos += len;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Payload sizes follow from the rectangle headers alone, so an update can be
+// checked for completeness before any of it is applied.
+bool VncCapturer::measureUpdate(size_t pos, size_t& end, bool& complete) const {
+    complete = false;
+    size_t size = inbuf.size();
+    if (size - pos < 4) return true;
+
+    int nrects = be16(inbuf.data() + pos + 2);
+    pos += 4;
+
+    for (int i = 0; i < nrects; ++i) {
+        if (size - pos < 12) return true;
+        const uint8_t* r = inbuf.data() + pos;
+        size_t w = be16(r + 4), h = be16(r + 6);
+        int32_t encoding = (int32_t)be32(r + 8);
+        pos += 12;
+
+        size_t payload;
+        switch (encoding) {
+            case ENC_RAW: payload = w * h * 4; break;
+            case ENC_COPYRECT: payload = 4; break;
+            case ENC_DESKTOP_SIZE: payload = 0; break;
+#ifdef HAVE_ZLIB
+            case ENC_ZRLE:
+                if (size - pos < 4) return true;
+                payload = 4 + (size_t)be32(inbuf.data() + pos);
+                break;
+#endif
+            default:
+                return false;
+        }
+        if (size - pos < payload) return true;
+        pos += payload;
+    }
+
+    end = pos;
+    complete = true;
+    return true;
+}
+
+bool VncCapturer::applyUpdate(size_t pos) {
+    int nrects = be16(inbuf.data() + pos + 2);
+    pos += 4;
+
+    for (int i = 0; i < nrects; ++i) {
+        const uint8_t* r = inbuf.data() + pos;
+        int x = be16(r), y = be16(r + 2);
+        int w = be16(r + 4), h = be16(r + 6);
+        int32_t encoding = (int32_t)be32(r + 8);
+        const uint8_t* data = r + 12;
+        pos += 12;
+
+        switch (encoding) {
+            case ENC_RAW:
+                applyRaw(data, x, y, w, h);
+                pos += (size_t)w * h * 4;
+                break;
+            case ENC_COPYRECT:
+                applyCopyRect(be16(data), be16(data + 2), x, y, w, h);
+                pos += 4;
+                break;
+            case ENC_DESKTOP_SIZE:
+                resize(w, h);
+                break;
+#ifdef HAVE_ZLIB
+            case ENC_ZRLE: {
+                size_t len = be32(data);
+                // A bad tile leaves the shared zlib stream out of step for good
+                if (!applyZrle(data + 4, len, x, y, w, h)) return false;
+                pos += 4 + len;
+                break;
+            }
+#endif
+        }
+    }
+    return true;
+}
+
+void VncCapturer::applyRaw(const uint8_t* src, int x, int y, int w, int h) {
+    int cw = std::min(w, width - x);
+    int ch = std::min(h, height - y);
+    if (cw <= 0 || ch <= 0) return;
+
+    size_t stride = (size_t)width * 4;
+    for (int row = 0; row < ch; ++row) {
+        memcpy(framebuffer.data() + (size_t)(y + row) * stride + (size_t)x * 4,
+               src + (size_t)row * w * 4, (size_t)cw * 4);
+    }
+    addDamage(x, y, cw, ch);
+}
+
+// The server has already shifted this region; repeating the move locally is
+// a memmove per row instead of resending the pixels.
+void VncCapturer::applyCopyRect(int src_x, int src_y, int x, int y, int w, int h) {
+    w = std::min({w, width - x, width - src_x});
+    h = std::min({h, height - y, height - src_y});
+    if (w <= 0 || h <= 0) return;
+
+    size_t stride = (size_t)width * 4;
+    uint8_t* fb = framebuffer.data();
+
+    // Walk rows away from the overlap so no source row is overwritten first
+    if (src_y < y) {
+        for (int row = h - 1; row >= 0; --row) {
+            memmove(fb + (size_t)(y + row) * stride + (size_t)x * 4,
+                    fb + (size_t)(src_y + row) * stride + (size_t)src_x * 4, (size_t)w * 4);
+        }
+    } else {
+        for (int row = 0; row < h; ++row) {
+            memmove(fb + (size_t)(y + row) * stride + (size_t)x * 4,
+                    fb + (size_t)(src_y + row) * stride + (size_t)src_x * 4, (size_t)w * 4);
+        }
+    }
+    addDamage(x, y, w, h);
+}
+
+#ifdef HAVE_ZLIB
+// ZRLE: one zlib stream for the whole connection, carrying 64x64 tiles that
+// are raw, solid, palette-packed or run-length coded. With our pixel format
+// a compressed pixel is the low three bytes, B,G,R.
+bool VncCapturer::applyZrle(const uint8_t* src, size_t len, int x, int y, int w, int h) {
+    if (!zstream_active) return false;
+
+    size_t tiles = (size_t)((w + 63) / 64) * ((h + 63) / 64);
+    // Worst case is plain RLE at four bytes a pixel plus a full palette per tile
+    size_t bound = (size_t)w * h * 4 + tiles * (1 + 127 * 3) + 1024;
+    if (zrle_buf.size() < bound) zrle_buf.resize(bound);
+
+    zstream.next_in = (Bytef*)src;
+    zstream.avail_in = len;
+    zstream.next_out = zrle_buf.data();
+    zstream.avail_out = zrle_buf.size();
+    int ret = inflate(&zstream, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || zstream.avail_in != 0) return false;
+
+    const uint8_t* p = zrle_buf.data();
+    const uint8_t* end = zrle_buf.data() + (zrle_buf.size() - zstream.avail_out);
+    size_t stride = (size_t)width * 4;
+    uint8_t* fb = framebuffer.data();
+
+    auto put = [&](int px, int py, const uint8_t* c) {
+        if (px >= width || py >= height) return;
+        uint8_t* d = fb + (size_t)py * stride + (size_t)px * 4;
+        d[0] = c[0];
+        d[1] = c[1];
+        d[2] = c[2];
+        d[3] = 0;
+    };
+    auto runLength = [&](size_t& out) {
+        out = 1;
+        uint8_t b;
+        do {
+            if (p >= end) return false;
+            b = *p++;
+            out += b;
+        } while (b == 255);
+        return true;
+    };
+
+    for (int ty = y; ty < y + h; ty += 64) {
+        int th = std::min(64, y + h - ty);
+        for (int tx = x; tx < x + w; tx += 64) {
+            int tw = std::min(64, x + w - tx);
+            if (p >= end) return false;
+            uint8_t sub = *p++;
+
+            if (sub == 0) {
+                if ((size_t)(end - p) < (size_t)tw * th * 3) return false;
+                for (int j = 0; j < th; ++j) {
+                    for (int i = 0; i < tw; ++i, p += 3) put(tx + i, ty + j, p);
+                }
+            } else if (sub == 1) {
+                if (end - p < 3) return false;
+                for (int j = 0; j < th; ++j) {
+                    for (int i = 0; i < tw; ++i) put(tx + i, ty + j, p);
+                }
+                p += 3;
+            } else if (sub <= 16) {
+                const uint8_t* palette = p;
+                p += sub * 3;
+                int bits = sub == 2 ? 1 : sub <= 4 ? 2 : 4;
+                size_t row_bytes = (tw * bits + 7) / 8;
+                if (p > end || (size_t)(end - p) < row_bytes * th) return false;
+                for (int j = 0; j < th; ++j) {
+                    const uint8_t* row = p + row_bytes * j;
+                    for (int i = 0; i < tw; ++i) {
+                        int bit = i * bits;
+                        int idx = (row[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+                        if (idx < sub) put(tx + i, ty + j, palette + idx * 3);
+                    }
+                }
+                p += row_bytes * th;
+            } else if (sub == 128) {
+                int i = 0, j = 0;
+                while (j < th) {
+                    if (end - p < 3) return false;
+                    const uint8_t* c = p;
+                    p += 3;
+                    size_t run;
+                    if (!runLength(run)) return false;
+                    for (; run > 0 && j < th; --run) {
+                        put(tx + i, ty + j, c);
+                        if (++i == tw) { i = 0; ++j; }
+                    }
+                }
+            } else if (sub >= 130) {
+                int size = sub - 128;
+                const uint8_t* palette = p;
+                p += size * 3;
+                if (p > end) return false;
+                int i = 0, j = 0;
+                while (j < th) {
+                    if (p >= end) return false;
+                    uint8_t idx = *p++;
+                    size_t run = 1;
+                    if ((idx & 128) && !runLength(run)) return false;
+                    idx &= 127;
+                    if (idx >= size) return false;
+                    for (; run > 0 && j < th; --run) {
+                        put(tx + i, ty + j, palette + idx * 3);
+                        if (++i == tw) { i = 0; ++j; }
+                    }
+                }
+            } else {
+                return false;
+            }
+        }
+    }
+
+    addDamage(x, y, std::min(w, width - x), std::min(h, height - y));
+    return true;
+}
+#endif
+
+uint8_t* VncCapturer::captureFrame(bool force) {
+    if (framebuffer.empty()) return nullptr;
+
+    if (frame_ready || force) {
+        frame_ready = false;
+        frame_changed = true;
+        if (damage_x2 > damage_x1 && !force) {
+            changed_x1 = damage_x1; changed_y1 = damage_y1;
+            changed_x2 = damage_x2; changed_y2 = damage_y2;
+        } else {
+            changed_x1 = 0; changed_y1 = 0;
+            changed_x2 = width; changed_y2 = height;
+        }
+        damage_x1 = damage_y1 = damage_x2 = damage_y2 = 0;
+    } else {
+        frame_changed = false;
+    }
+    return framebuffer.data();
+}
+
+void VncCapturer::cleanup() {
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+#ifdef HAVE_ZLIB
+    if (zstream_active) {
+        inflateEnd(&zstream);
+        zstream_active = false;
+    }
+    memset(&zstream, 0, sizeof(zstream));
+#endif
+    inbuf.clear();
+    in_pos = 0;
+    framebuffer.clear();
+    width = height = 0;
+    frame_ready = false;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "x11/capture.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Mirrors the screen of a local Xvnc over RFB instead of grabbing it through
+// X. An incremental update request is always outstanding, and the server
+// answers it only once something changed, with exactly the rectangles that
+// did and CopyRect for content that merely moved. Updates are applied to a
+// local copy of the framebuffer as they arrive; the socket is read without
+// blocking and a message is only parsed once all of it is buffered.
+class VncCapturer {
+private:
+    int sock;
+    std::vector<uint8_t> inbuf;
+    size_t in_pos;
+
+    std::vector<uint8_t> framebuffer;
+    int width, height;
+
+    bool frame_ready;
+    bool frame_changed;
+    int event_count;
+    int damage_x1, damage_y1, damage_x2, damage_y2;
+    int changed_x1, changed_y1, changed_x2, changed_y2;
+
+#ifdef HAVE_ZLIB
+    z_stream zstream;
+    bool zstream_active;
+    std::vector<uint8_t> zrle_buf;
+#endif
+
+    bool readExact(void* buf, size_t n);
+    bool writeAll(const void* buf, size_t n);
+    bool handshake();
+    void requestUpdate(bool incremental);
+
+    bool parseMessages();
+    bool measureUpdate(size_t pos, size_t& end, bool& complete) const;
+    bool applyUpdate(size_t pos);
+    void applyRaw(const uint8_t* src, int x, int y, int w, int h);
+    void applyCopyRect(int src_x, int src_y, int x, int y, int w, int h);
+    bool applyZrle(const uint8_t* src, size_t len, int x, int y, int w, int h);
+    void addDamage(int x, int y, int w, int h);
+    void resize(int w, int h);
+
+public:
+    VncCapturer();
+    ~VncCapturer();
+
+    bool init(const std::string& socket_path);
+
+    int getConnectionFd() const { return sock; }
+    bool hasDamage() const { return true; }
+    int processEvents();
+
+    // Same loop hooks as X11Capturer. The server paints the pointer into the
+    // framebuffer itself since we do not ask for the cursor pseudo-encoding.
+    void beginFrame(bool want_cursor) { (void)want_cursor; }
+    bool hasPendingFrame() const { return frame_ready; }
+    void markPointerMoved() {}
+    X11Capturer::CursorData getCursor() { return X11Capturer::CursorData(); }
+
+    uint8_t* captureFrame(bool force = false);
+    bool frameChanged() const { return frame_changed; }
+    void getChangedRect(int& x, int& y, int& w, int& h) const {
+        x = changed_x1; y = changed_y1;
+        w = changed_x2 - changed_x1; h = changed_y2 - changed_y1;
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getOriginX() const { return 0; }
+    int getOriginY() const { return 0; }
+    int getBytesPerLine() const { return width * 4; }
+
+    void cleanup();
+};
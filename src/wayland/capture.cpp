@@ -0,0 +1,336 @@
+#include "capture.h"
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+const struct wl_registry_listener WaylandCapturer::registry_listener = {
+    WaylandCapturer::handleGlobal,
+    WaylandCapturer::handleGlobalRemove,
+};
+
+const struct zwlr_screencopy_frame_v1_listener WaylandCapturer::frame_listener = {
+    WaylandCapturer::handleBuffer,
+    WaylandCapturer::handleFlags,
+    WaylandCapturer::handleReady,
+    WaylandCapturer::handleFailed,
+    WaylandCapturer::handleDamage,
+    WaylandCapturer::handleDmabuf,
+    WaylandCapturer::handleBufferDone,
+};
+
+WaylandCapturer::WaylandCapturer()
+    : display(nullptr), registry(nullptr), shm(nullptr), output(nullptr), seat(nullptr),
+      screencopy(nullptr), pointer_manager(nullptr), keyboard_manager(nullptr),
+      screencopy_version(0), frame(nullptr), pool(nullptr), buffers{nullptr, nullptr},
+      pool_data(nullptr), pool_size(0), front(0), back(0), have_front(false),
+      buffer_format(0), width(0), height(0), stride(0), y_invert(false), overlay_cursor(false),
+      frame_ready(false), frame_failed(false), frame_changed(false), event_count(0),
+      damage_x1(0), damage_y1(0), damage_x2(0), damage_y2(0),
+      changed_x1(0), changed_y1(0), changed_x2(0), changed_y2(0) {
+}
+
+WaylandCapturer::~WaylandCapturer() {
+    cleanup();
+}
+
+void WaylandCapturer::handleGlobal(void* data, struct wl_registry* registry, uint32_t name,
+                                   const char* interface, uint32_t version) {
+    WaylandCapturer* self = (WaylandCapturer*)data;
+
+    if (strcmp(interface, wl_shm_interface.name) == 0) {
+        self->shm = (struct wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (strcmp(interface, wl_output_interface.name) == 0 && !self->output) {
+        self->output = (struct wl_output*)wl_registry_bind(registry, name, &wl_output_interface, 1);
+    } else if (strcmp(interface, wl_seat_interface.name) == 0 && !self->seat) {
+        self->seat = (struct wl_seat*)wl_registry_bind(registry, name, &wl_seat_interface, 1);
+    } else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+        self->screencopy_version = std::min(version, 3u);
+        self->screencopy = (struct zwlr_screencopy_manager_v1*)wl_registry_bind(
+            registry, name, &zwlr_screencopy_manager_v1_interface, self->screencopy_version);
+    } else if (strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
+        self->pointer_manager = (struct zwlr_virtual_pointer_manager_v1*)wl_registry_bind(
+            registry, name, &zwlr_virtual_pointer_manager_v1_interface, 1);
+    } else if (strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0) {
+        self->keyboard_manager = (struct zwp_virtual_keyboard_manager_v1*)wl_registry_bind(
+            registry, name, &zwp_virtual_keyboard_manager_v1_interface, 1);
+    }
+}
+
+void WaylandCapturer::handleGlobalRemove(void* data, struct wl_registry* registry, uint32_t name) {
+    (void)data; (void)registry; (void)name;
+}
+
+void WaylandCapturer::handleBuffer(void* data, struct zwlr_screencopy_frame_v1* frame,
+                                   uint32_t format, uint32_t w, uint32_t h, uint32_t s) {
+    WaylandCapturer* self = (WaylandCapturer*)data;
+
+    // Both are B,G,R,X in memory, which is what the renderer reads
+    if (format != WL_SHM_FORMAT_XRGB8888 && format != WL_SHM_FORMAT_ARGB8888) {
+        if (self->screencopy_version < 3) handleFailed(data, frame);
+        return;
+    }
+
+    if (!self->buffers[0] || format != self->buffer_format ||
+        (int)w != self->width || (int)h != self->height || (int)s != self->stride) {
+        if (!self->createBuffers(format, w, h, s)) {
+            handleFailed(data, frame);
+            return;
+        }
+    }
+
+    // Before version 3 this is the only buffer event; later ones end with buffer_done
+    if (self->screencopy_version < 3) self->startCopy();
+}
+
+void WaylandCapturer::handleFlags(void* data, struct zwlr_screencopy_frame_v1* frame, uint32_t flags) {
+    (void)frame;
+    WaylandCapturer* self = (WaylandCapturer*)data;
+    bool invert = (flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT) != 0;
+    if (invert && !self->y_invert) {
+        std::cerr << "Compositor delivers y-inverted frames; the image will be upside down\n";
+    }
+    self->y_invert = invert;
+}
+
+void WaylandCapturer::handleReady(void* data, struct zwlr_screencopy_frame_v1* frame,
+                                  uint32_t sec_hi, uint32_t sec_lo, uint32_t nsec) {
+    (void)sec_hi; (void)sec_lo; (void)nsec;
+    WaylandCapturer* self = (WaylandCapturer*)data;
+    zwlr_screencopy_frame_v1_destroy(frame);
+    self->frame = nullptr;
+    self->frame_ready = true;
+    self->event_count++;
+}
+
+void WaylandCapturer::handleFailed(void* data, struct zwlr_screencopy_frame_v1* frame) {
+    WaylandCapturer* self = (WaylandCapturer*)data;
+    zwlr_screencopy_frame_v1_destroy(frame);
+    self->frame = nullptr;
+    self->frame_failed = true;
+    self->event_count++;
+}
+
+void WaylandCapturer::handleDamage(void* data, struct zwlr_screencopy_frame_v1* frame,
+                                   uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    (void)frame;
+    WaylandCapturer* self = (WaylandCapturer*)data;
+    if (self->damage_x2 <= self->damage_x1) {
+        self->damage_x1 = x;
+        self->damage_y1 = y;
+        self->damage_x2 = x + w;
+        self->damage_y2 = y + h;
+    } else {
+        self->damage_x1 = std::min(self->damage_x1, (int)x);
+        self->damage_y1 = std::min(self->damage_y1, (int)y);
+        self->damage_x2 = std::max(self->damage_x2, (int)(x + w));
+        self->damage_y2 = std::max(self->damage_y2, (int)(y + h));
+    }
+}
+
+void WaylandCapturer::handleDmabuf(void* data, struct zwlr_screencopy_frame_v1* frame,
+                                   uint32_t format, uint32_t w, uint32_t h) {
+    (void)data; (void)frame; (void)format; (void)w; (void)h;
+}
+
+void WaylandCapturer::handleBufferDone(void* data, struct zwlr_screencopy_frame_v1* frame) {
+    WaylandCapturer* self = (WaylandCapturer*)data;
+    if (!self->buffers[0]) {
+        handleFailed(data, frame);
+        return;
+    }
+    self->startCopy();
+}
+
+// One pool holds both buffers, so a size change costs a single mapping
+bool WaylandCapturer::createBuffers(uint32_t format, int w, int h, int s) {
+    destroyBuffers();
+
+    size_t size = (size_t)s * h;
+    int fd = memfd_create("mirrors-wl", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    if (ftruncate(fd, size * 2) != 0) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    pool = wl_shm_create_pool(shm, fd, size * 2);
+    close(fd);
+
+    buffers[0] = wl_shm_pool_create_buffer(pool, 0, w, h, s, format);
+    buffers[1] = wl_shm_pool_create_buffer(pool, size, w, h, s, format);
+    pool_data = (uint8_t*)map;
+    pool_size = size * 2;
+    buffer_format = format;
+    width = w;
+    height = h;
+    stride = s;
+    front = 0;
+    have_front = false;
+    return true;
+}
+
+void WaylandCapturer::destroyBuffers() {
+    for (int i = 0; i < 2; ++i) {
+        if (buffers[i]) wl_buffer_destroy(buffers[i]);
+        buffers[i] = nullptr;
+    }
+    if (pool) {
+        wl_shm_pool_destroy(pool);
+        pool = nullptr;
+    }
+    if (pool_data) {
+        munmap(pool_data, pool_size);
+        pool_data = nullptr;
+        pool_size = 0;
+    }
+    have_front = false;
+}
+
+void WaylandCapturer::requestFrame() {
+    if (frame || !screencopy || !output) return;
+
+    frame_failed = false;
+    frame = zwlr_screencopy_manager_v1_capture_output(screencopy, overlay_cursor ? 1 : 0, output);
+    zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, this);
+}
+
+// Copy into whichever buffer the renderer is not reading
+void WaylandCapturer::startCopy() {
+    back = have_front ? 1 - front : 0;
+    if (screencopy_version >= 2) {
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, buffers[back]);
+    } else {
+        zwlr_screencopy_frame_v1_copy(frame, buffers[back]);
+    }
+}
+
+bool WaylandCapturer::init(const char* socket_path) {
+    cleanup();
+
+    display = wl_display_connect(socket_path);
+    if (!display) {
+        std::cerr << "Failed to connect to Wayland display\n";
+        return false;
+    }
+
+    registry = wl_display_get_registry(display);
+    wl_registry_add_listener(registry, &registry_listener, this);
+    wl_display_roundtrip(display);
+
+    if (!shm || !output || !screencopy) {
+        std::cerr << "Compositor lacks wl_shm, an output or wlr-screencopy\n";
+        cleanup();
+        return false;
+    }
+
+    // The first copy is not held back for damage, so this settles the geometry
+    requestFrame();
+    for (int i = 0; i < 10 && !frame_ready && !frame_failed; ++i) {
+        wl_display_roundtrip(display);
+    }
+    if (!buffers[0]) {
+        std::cerr << "Compositor offered no usable SHM buffer format\n";
+        cleanup();
+        return false;
+    }
+
+    std::cout << "Wayland screencopy v" << screencopy_version << ": "
+              << width << "x" << height << ", " << stride << " bytes/line\n";
+    return true;
+}
+
+int WaylandCapturer::getConnectionFd() const {
+    return display ? wl_display_get_fd(display) : -1;
+}
+
+int WaylandCapturer::processEvents() {
+    if (!display) return 0;
+
+    event_count = 0;
+    while (wl_display_prepare_read(display) != 0) {
+        wl_display_dispatch_pending(display);
+    }
+    wl_display_flush(display);
+
+    struct pollfd pfd = { wl_display_get_fd(display), POLLIN, 0 };
+    if (poll(&pfd, 1, 0) > 0) {
+        wl_display_read_events(display);
+    } else {
+        wl_display_cancel_read(display);
+    }
+    wl_display_dispatch_pending(display);
+    return event_count;
+}
+
+uint8_t* WaylandCapturer::captureFrame(bool force) {
+    if (!display) return nullptr;
+
+    if (frame_ready) {
+        frame_ready = false;
+        front = back;
+        have_front = true;
+        frame_changed = true;
+
+        if (damage_x2 > damage_x1 && !force) {
+            changed_x1 = damage_x1; changed_y1 = damage_y1;
+            changed_x2 = damage_x2; changed_y2 = damage_y2;
+        } else {
+            changed_x1 = 0; changed_y1 = 0;
+            changed_x2 = width; changed_y2 = height;
+        }
+        damage_x1 = damage_y1 = damage_x2 = damage_y2 = 0;
+
+        requestFrame();
+        wl_display_flush(display);
+    } else {
+        frame_changed = force && have_front;
+        // Retried at frame rate rather than as fast as the compositor refuses
+        if (frame_failed) {
+            requestFrame();
+            wl_display_flush(display);
+        }
+    }
+
+    return have_front ? pool_data + (size_t)front * (pool_size / 2) : nullptr;
+}
+
+void WaylandCapturer::cleanup() {
+    if (frame) {
+        zwlr_screencopy_frame_v1_destroy(frame);
+        frame = nullptr;
+    }
+    destroyBuffers();
+
+    if (screencopy) zwlr_screencopy_manager_v1_destroy(screencopy);
+    if (pointer_manager) zwlr_virtual_pointer_manager_v1_destroy(pointer_manager);
+    if (keyboard_manager) zwp_virtual_keyboard_manager_v1_destroy(keyboard_manager);
+    if (seat) wl_seat_destroy(seat);
+    if (output) wl_output_destroy(output);
+    if (shm) wl_shm_destroy(shm);
+    if (registry) wl_registry_destroy(registry);
+    screencopy = nullptr;
+    pointer_manager = nullptr;
+    keyboard_manager = nullptr;
+    seat = nullptr;
+    output = nullptr;
+    shm = nullptr;
+    registry = nullptr;
+
+    if (display) {
+        wl_display_disconnect(display);
+        display = nullptr;
+    }
+
+    frame_ready = false;
+    frame_failed = false;
+    width = height = stride = 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <wayland-client.h>
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include "wlr-virtual-pointer-unstable-v1-client-protocol.h"
+#include "virtual-keyboard-unstable-v1-client-protocol.h"
+#include "x11/capture.h"
+#include <cstdint>
+#include <cstddef>
+
+// Captures the first output of a headless wlroots compositor with
+// wlr-screencopy. A copy is always outstanding; with copy_with_damage the
+// compositor holds it until something changes, so a finished copy doubles as
+// the damage notification. Copies alternate between two buffers of one SHM
+// pool, so the frame being rendered is never overwritten.
+class WaylandCapturer {
+private:
+    struct wl_display* display;
+    struct wl_registry* registry;
+    struct wl_shm* shm;
+    struct wl_output* output;
+    struct wl_seat* seat;
+    struct zwlr_screencopy_manager_v1* screencopy;
+    struct zwlr_virtual_pointer_manager_v1* pointer_manager;
+    struct zwp_virtual_keyboard_manager_v1* keyboard_manager;
+    uint32_t screencopy_version;
+
+    struct zwlr_screencopy_frame_v1* frame;
+    struct wl_shm_pool* pool;
+    struct wl_buffer* buffers[2];
+    uint8_t* pool_data;
+    size_t pool_size;
+    int front;
+    int back;
+    bool have_front;
+
+    uint32_t buffer_format;
+    int width, height, stride;
+    bool y_invert;
+    bool overlay_cursor;
+
+    bool frame_ready;
+    bool frame_failed;
+    bool frame_changed;
+    int event_count;
+    int damage_x1, damage_y1, damage_x2, damage_y2;
+    int changed_x1, changed_y1, changed_x2, changed_y2;
+
+    bool createBuffers(uint32_t format, int w, int h, int s);
+    void destroyBuffers();
+    void requestFrame();
+    void startCopy();
+
+    static void handleGlobal(void* data, struct wl_registry* registry, uint32_t name,
+                             const char* interface, uint32_t version);
+    static void handleGlobalRemove(void* data, struct wl_registry* registry, uint32_t name);
+    static void handleBuffer(void* data, struct zwlr_screencopy_frame_v1* frame,
+                             uint32_t format, uint32_t w, uint32_t h, uint32_t s);
+    static void handleFlags(void* data, struct zwlr_screencopy_frame_v1* frame, uint32_t flags);
+    static void handleReady(void* data, struct zwlr_screencopy_frame_v1* frame,
+                            uint32_t sec_hi, uint32_t sec_lo, uint32_t nsec);
+    static void handleFailed(void* data, struct zwlr_screencopy_frame_v1* frame);
+    static void handleDamage(void* data, struct zwlr_screencopy_frame_v1* frame,
+                             uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+    static void handleDmabuf(void* data, struct zwlr_screencopy_frame_v1* frame,
+                             uint32_t format, uint32_t w, uint32_t h);
+    static void handleBufferDone(void* data, struct zwlr_screencopy_frame_v1* frame);
+
+    static const struct wl_registry_listener registry_listener;
+    static const struct zwlr_screencopy_frame_v1_listener frame_listener;
+
+public:
+    WaylandCapturer();
+    ~WaylandCapturer();
+
+    void setOverlayCursor(bool overlay) { overlay_cursor = overlay; }
+
+    bool init(const char* socket_path);
+
+    int getConnectionFd() const;
+    bool hasDamage() const { return true; }
+    int processEvents();
+
+    // Same loop hooks as X11Capturer; the compositor draws the pointer itself
+    void beginFrame(bool want_cursor) { (void)want_cursor; }
+    bool hasPendingFrame() const { return frame_ready; }
+    void markPointerMoved() {}
+    X11Capturer::CursorData getCursor() { return X11Capturer::CursorData(); }
+
+    uint8_t* captureFrame(bool force = false);
+    bool frameChanged() const { return frame_changed; }
+    void getChangedRect(int& x, int& y, int& w, int& h) const {
+        x = changed_x1; y = changed_y1;
+        w = changed_x2 - changed_x1; h = changed_y2 - changed_y1;
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getOriginX() const { return 0; }
+    int getOriginY() const { return 0; }
+    int getBytesPerLine() const { return stride; }
+
+    struct wl_display* getDisplay() const { return display; }
+    struct wl_seat* getSeat() const { return seat; }
+    struct zwlr_virtual_pointer_manager_v1* getPointerManager() const { return pointer_manager; }
+    struct zwp_virtual_keyboard_manager_v1* getKeyboardManager() const { return keyboard_manager; }
+
+    void cleanup();
+};
@@ -0,0 +1,167 @@
+#include "input.h"
+#include <X11/keysym.h>
+#include <linux/input-event-codes.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/mman.h>
+
+WaylandInput::WaylandInput()
+    : source(nullptr), display(nullptr), pointer(nullptr), keyboard(nullptr),
+      xkb(nullptr), keymap(nullptr),
+      shift_mask(0), ctrl_mask(0), alt_mask(0), modifiers(0), pointer_dirty(false) {
+}
+
+WaylandInput::~WaylandInput() {
+    cleanup();
+}
+
+void WaylandInput::collectKey(struct xkb_keymap* keymap, xkb_keycode_t key, void* data) {
+    WaylandInput* self = (WaylandInput*)data;
+    const xkb_keysym_t* syms = nullptr;
+    int n = xkb_keymap_key_get_syms_by_level(keymap, key, 0, 0, &syms);
+    for (int i = 0; i < n; ++i) {
+        // First key wins, as with XKeysymToKeycode
+        self->keycodes.emplace(syms[i], key);
+    }
+}
+
+bool WaylandInput::uploadKeymap() {
+    xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (!xkb) return false;
+    keymap = xkb_keymap_new_from_names(xkb, nullptr, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (!keymap) return false;
+    
+    char* text = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    if (!text) return false;
+    size_t size = strlen(text) + 1;
+    
+    int fd = memfd_create("mirrors-keymap", MFD_CLOEXEC);
+    bool ok = fd >= 0 && write(fd, text, size) == (ssize_t)size;
+    free(text);
+    if (!ok) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    
+    zwp_virtual_keyboard_v1_keymap(keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, size);
+    close(fd);
+    
+    xkb_keymap_key_for_each(keymap, collectKey, this);
+    
+    xkb_mod_index_t idx;
+    if ((idx = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_SHIFT)) != XKB_MOD_INVALID) shift_mask = 1u << idx;
+    if ((idx = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CTRL)) != XKB_MOD_INVALID) ctrl_mask = 1u << idx;
+    if ((idx = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_ALT)) != XKB_MOD_INVALID) alt_mask = 1u << idx;
+    return true;
+}
+
+bool WaylandInput::init(const WaylandCapturer& capturer) {
+    cleanup();
+    
+    source = &capturer;
+    display = capturer.getDisplay();
+    if (!display || !capturer.getPointerManager() || !capturer.getKeyboardManager() || !capturer.getSeat()) {
+        std::cerr << "Compositor lacks virtual pointer or keyboard support\n";
+        return false;
+    }
+    
+    pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
+        capturer.getPointerManager(), capturer.getSeat());
+    keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+        capturer.getKeyboardManager(), capturer.getSeat());
+    
+    if (!uploadKeymap()) {
+        std::cerr << "Failed to build an xkb keymap for the virtual keyboard\n";
+        cleanup();
+        return false;
+    }
+    
+    wl_display_flush(display);
+    return true;
+}
+
+uint32_t WaylandInput::timestamp() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WaylandInput::key(KeySym ks, bool press) {
+    if (!keyboard) return;
+    auto it = keycodes.find(ks);
+    if (it == keycodes.end()) return;
+    
+    // xkb keycodes are evdev codes offset by 8
+    zwp_virtual_keyboard_v1_key(keyboard, timestamp(), it->second - 8,
+                                press ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED);
+    
+    // The compositor does not track modifier state for virtual keyboards
+    uint32_t mask = 0;
+    if (ks == XK_Shift_L || ks == XK_Shift_R) mask = shift_mask;
+    else if (ks == XK_Control_L || ks == XK_Control_R) mask = ctrl_mask;
+    else if (ks == XK_Alt_L || ks == XK_Alt_R) mask = alt_mask;
+    if (mask) {
+        modifiers = press ? (modifiers | mask) : (modifiers & ~mask);
+        zwp_virtual_keyboard_v1_modifiers(keyboard, modifiers, 0, 0, 0);
+    }
+}
+
+void WaylandInput::button(int xbutton, bool press) {
+    if (!pointer) return;
+    uint32_t time = timestamp();
+    
+    // X wheel buttons become one discrete axis step on press
+    if (xbutton >= 4 && xbutton <= 7) {
+        if (!press) return;
+        uint32_t axis = xbutton <= 5 ? WL_POINTER_AXIS_VERTICAL_SCROLL : WL_POINTER_AXIS_HORIZONTAL_SCROLL;
+        int step = (xbutton == 4 || xbutton == 6) ? -1 : 1;
+        zwlr_virtual_pointer_v1_axis_source(pointer, WL_POINTER_AXIS_SOURCE_WHEEL);
+        zwlr_virtual_pointer_v1_axis_discrete(pointer, time, axis, wl_fixed_from_int(step * 15), step);
+    } else {
+        uint32_t code = xbutton == 1 ? BTN_LEFT : xbutton == 2 ? BTN_MIDDLE : BTN_RIGHT;
+        zwlr_virtual_pointer_v1_button(pointer, time, code,
+                                       press ? WL_POINTER_BUTTON_STATE_PRESSED : WL_POINTER_BUTTON_STATE_RELEASED);
+    }
+    pointer_dirty = true;
+}
+
+void WaylandInput::motion(int x, int y) {
+    if (!pointer || !source) return;
+    int w = source->getWidth();
+    int h = source->getHeight();
+    if (w <= 0 || h <= 0) return;
+    
+    x = std::max(0, std::min(x, w - 1));
+    y = std::max(0, std::min(y, h - 1));
+    zwlr_virtual_pointer_v1_motion_absolute(pointer, timestamp(), x, y, w, h);
+    pointer_dirty = true;
+}
+
+void WaylandInput::flush() {
+    if (!display) return;
+    if (pointer_dirty) {
+        zwlr_virtual_pointer_v1_frame(pointer);
+        pointer_dirty = false;
+    }
+    wl_display_flush(display);
+}
+
+void WaylandInput::cleanup() {
+    if (pointer) zwlr_virtual_pointer_v1_destroy(pointer);
+    if (keyboard) zwp_virtual_keyboard_v1_destroy(keyboard);
+    pointer = nullptr;
+    keyboard = nullptr;
+    if (display) wl_display_flush(display);
+    display = nullptr;
+    source = nullptr;
+    
+    if (keymap) xkb_keymap_unref(keymap);
+    if (xkb) xkb_context_unref(xkb);
+    keymap = nullptr;
+    xkb = nullptr;
+    keycodes.clear();
+    modifiers = 0;
+}
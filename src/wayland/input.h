@@ -0,0 +1,42 @@
+#pragma once
+#include "x11/input.h"
+#include "capture.h"
+#include <xkbcommon/xkbcommon.h>
+#include <unordered_map>
+
+// Feeds InputHandler's synthesized events to the compositor through the
+// wlr virtual-pointer and virtual-keyboard protocols. The keyboard uploads a
+// default xkb keymap, and keysyms are looked up in it the way XTest looks
+// them up in the X server's mapping.
+class WaylandInput : public InputSink {
+private:
+    const WaylandCapturer* source;
+    struct wl_display* display;
+    struct zwlr_virtual_pointer_v1* pointer;
+    struct zwp_virtual_keyboard_v1* keyboard;
+    
+    struct xkb_context* xkb;
+    struct xkb_keymap* keymap;
+    std::unordered_map<uint32_t, uint32_t> keycodes;
+    
+    uint32_t shift_mask, ctrl_mask, alt_mask;
+    uint32_t modifiers;
+    bool pointer_dirty;
+    
+    static void collectKey(struct xkb_keymap* keymap, xkb_keycode_t key, void* data);
+    bool uploadKeymap();
+    uint32_t timestamp() const;
+    
+public:
+    WaylandInput();
+    ~WaylandInput();
+    
+    bool init(const WaylandCapturer& capturer);
+    
+    void key(KeySym ks, bool press) override;
+    void button(int xbutton, bool press) override;
+    void motion(int x, int y) override;
+    void flush() override;
+    
+    void cleanup();
+};
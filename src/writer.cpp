@@ -0,0 +1,339 @@
+#include "writer.h"
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+FrameWriter::FrameWriter()
+    : out_fd(-1), wake_fd(-1), ready_fd(-1), queue_target(4096),
+      frames_in_flight(0), frame_open(false), frame_aborted(false), trace(nullptr), stopping(false),
+      bytes_total(0), stalled(false), stalled_bytes(0), drain_rate(0),
+      frames_written(0), congestion_count(0),
+      queue_sum(0), queue_max(0), latency_sum(0), latency_max(0) {
+}
+
+FrameWriter::~FrameWriter() {
+    stop();
+}
+
+bool FrameWriter::start(int fd, size_t chunk_size, int chunk_count) {
+    if (!arena.init(chunk_size, chunk_count)) return false;
+    
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 || ready_fd < 0) {
+        if (wake_fd >= 0) close(wake_fd);
+        if (ready_fd >= 0) close(ready_fd);
+        wake_fd = ready_fd = -1;
+        arena.cleanup();
+        return false;
+    }
+    
+    out_fd = fd;
+    engine.init(fd);
+    write_history.assign(1, std::make_pair(clock::now(), bytes_total));
+    struct iovec region;
+    region.iov_base = arena.getBase();
+    region.iov_len = arena.getMapSize();
+    engine.registerBuffers(&region, 1);
+    
+    stopping = false;
+    thread = std::thread(&FrameWriter::run, this);
+    return true;
+}
+
+void FrameWriter::pushChunk(ArenaChunk* chunk, bool frame_end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+        arena.release(chunk);
+        return;
+    }
+    if (!frame_open) {
+        frame_open = true;
+        frame_start = clock::now();
+    }
+    chunk->frame_end = frame_end;
+    queue.push_back(chunk);
+    if (frame_end) {
+        frame_open = false;
+        frame_starts.push_back(frame_start);
+        frame_inputs.push_back(trace ? trace->takeFrame() : 0);
+        frames_in_flight++;
+    }
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+}
+
+// Chunks only ever end between cells, so whatever part of the frame was
+// already written leaves the terminal half painted but never inside an
+// escape; the next frame starts from the home position and paints it all.
+void FrameWriter::abortFrame() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return;
+    while (!queue.empty() && !queue.back()->frame_end) {
+        arena.release(queue.back());
+        queue.pop_back();
+    }
+    frame_open = false;
+    frame_aborted = true;
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+}
+
+// Closing the arena releases a renderer blocked waiting for a chunk. The
+// mapping itself stays until destruction, since the renderer may still be
+// filling one.
+void FrameWriter::stop() {
+    if (!thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    arena.close();
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+    thread.join();
+    
+    // The render thread only writes wake_fd under the lock after checking
+    // stopping, so it never sees a closed (or reused) descriptor
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        close(wake_fd);
+        close(ready_fd);
+        wake_fd = ready_fd = -1;
+    }
+    engine.cleanup();
+}
+
+void FrameWriter::consumeReady() {
+    uint64_t count;
+    read(ready_fd, &count, sizeof(count));
+}
+
+bool FrameWriter::canAccept() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return frames_in_flight == 0 && !frame_aborted;
+}
+
+void FrameWriter::signalReady() {
+    uint64_t one = 1;
+    write(ready_fd, &one, sizeof(one));
+}
+
+// Bytes written but not yet read by whatever is on the other end of the tty.
+// Pipes and files have no queue worth waiting for.
+int FrameWriter::outputQueue() const {
+    int queued = 0;
+    if (ioctl(out_fd, TIOCOUTQ, &queued) != 0) return 0;
+    return queued;
+}
+
+// stdout may share its file description with a non-blocking stdin, so EAGAIN
+// is expected; poll until the terminal takes more instead of spinning.
+// Advances through the segments in place as the engine accepts them.
+bool FrameWriter::writeSegments(struct iovec* iov, int iovcnt) {
+    struct pollfd fds[2];
+    fds[0].fd = out_fd;
+    fds[0].events = POLLOUT;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+    
+    while (iovcnt > 0) {
+        ssize_t n = engine.write(iov, iovcnt);
+        if (n > 0) {
+            if (stalled) stalled_bytes += n;
+            bytes_total += n;
+            while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!stalled) {
+                stalled = true;
+                stall_start = clock::now();
+            }
+            poll(fds, 2, -1);
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                read(wake_fd, &count, sizeof(count));
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return false;
+            }
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+// A pty reports an empty queue no matter how far behind the reader is, and
+// over ssh the backlog sits in socket buffers past it anyway, so write
+// completion times stand in for it. While a write waits for room, room
+// appears as fast as the far end reads, which gives the drain rate; a
+// buffer along the way refilling in one gulp can make a single wait look
+// far faster, so the slowest recent one counts. Whatever was written since
+// any recent point, less what that rate could have taken since then, is
+// still on its way; the largest such amount is the backlog.
+int FrameWriter::estimateQueue() {
+    auto now = clock::now();
+    if (stalled) {
+        double ms = std::chrono::duration<double, std::milli>(now - stall_start).count();
+        if (ms > 0 && stalled_bytes > 0) {
+            rate_samples.push_back(stalled_bytes / ms);
+            if (rate_samples.size() > 8) rate_samples.pop_front();
+            drain_rate = *std::min_element(rate_samples.begin(), rate_samples.end());
+        }
+    }
+    stalled = false;
+    stalled_bytes = 0;
+    
+    write_history.push_back(std::make_pair(now, bytes_total));
+    while (write_history.size() > 256 ||
+           (write_history.size() > 1 && now - write_history.front().first > std::chrono::seconds(10))) {
+        write_history.pop_front();
+    }
+    if (drain_rate <= 0) return 0;
+    
+    double backlog = 0;
+    for (const auto& sample : write_history) {
+        double ms = std::chrono::duration<double, std::milli>(now - sample.first).count();
+        backlog = std::max(backlog, (bytes_total - sample.second) - drain_rate * ms);
+    }
+    return (int)std::min(backlog, 1e9);
+}
+
+// The queue gives no readiness event, so sample it every couple of
+// milliseconds until the reader has caught up. When only the estimate is
+// over the target, wait out its drain time instead.
+bool FrameWriter::drainQueue() {
+    int queued = outputQueue();
+    int estimated = estimateQueue();
+    int depth = std::max(queued, estimated);
+    queue_sum += depth;
+    queue_max = std::max(queue_max, depth);
+    
+    if (queue_target < 0 || depth <= queue_target) return true;
+    if (queued <= queue_target && drain_rate <= 0) return true;
+    congestion_count++;
+    
+    struct pollfd pfd;
+    pfd.fd = wake_fd;
+    pfd.events = POLLIN;
+    
+    // New chunks wake the poll too; only stopping cuts the wait short
+    if (queued <= queue_target) {
+        auto until = clock::now() + std::chrono::microseconds((int64_t)((estimated - queue_target) / drain_rate * 1000));
+        for (auto now = clock::now(); now < until; now = clock::now()) {
+            int wait_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+            if (poll(&pfd, 1, wait_ms) > 0) {
+                uint64_t count;
+                read(wake_fd, &count, sizeof(count));
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return false;
+            }
+        }
+        return true;
+    }
+    
+    while (queued > queue_target) {
+        if (poll(&pfd, 1, 2) > 0) {
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return false;
+        }
+        queued = outputQueue();
+    }
+    return true;
+}
+
+void FrameWriter::run() {
+    struct pollfd pfd;
+    pfd.fd = wake_fd;
+    pfd.events = POLLIN;
+    
+    std::vector<ArenaChunk*> batch;
+    std::vector<struct iovec> iov;
+    
+    while (true) {
+        // Take whatever is queued, up to the end of the current frame
+        batch.clear();
+        bool drained_abort = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) break;
+            while (!queue.empty()) {
+                ArenaChunk* chunk = queue.front();
+                queue.pop_front();
+                batch.push_back(chunk);
+                if (chunk->frame_end) break;
+            }
+            if (batch.empty() && frame_aborted) {
+                frame_aborted = false;
+                drained_abort = true;
+            }
+        }
+        if (drained_abort) signalReady();
+        
+        if (batch.empty()) {
+            poll(&pfd, 1, -1);
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+            continue;
+        }
+        
+        iov.resize(batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            iov[i].iov_base = batch[i]->data;
+            iov[i].iov_len = batch[i]->len;
+        }
+        bool ok = writeSegments(iov.data(), iov.size());
+        
+        bool frame_end = batch.back()->frame_end;
+        for (ArenaChunk* chunk : batch) arena.release(chunk);
+        if (!ok) break;
+        if (!frame_end) continue;
+        
+        if (!drainQueue()) break;
+        
+        clock::time_point started;
+        int64_t input_stamp;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            started = frame_starts.front();
+            frame_starts.pop_front();
+            input_stamp = frame_inputs.front();
+            frame_inputs.pop_front();
+            frames_in_flight--;
+        }
+        if (input_stamp) trace->frameWritten(input_stamp);
+        double latency = std::chrono::duration<double, std::milli>(clock::now() - started).count();
+        latency_sum += latency;
+        latency_max = std::max(latency_max, latency);
+        frames_written++;
+        signalReady();
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    for (ArenaChunk* chunk : queue) arena.release(chunk);
+    queue.clear();
+}
+
+void FrameWriter::printStats(std::ostream& out) const {
+    out << "frames: " << frames_written << " written, "
+        << congestion_count << " held for a full output queue\n";
+    if (frames_written == 0) return;
+    out << "output queue: " << queue_sum / frames_written << " bytes avg, " << queue_max << " bytes max\n";
+    out << "output latency: " << latency_sum / frames_written << " ms avg, " << latency_max << " ms max\n";
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "arena.h"
+#include "latency.h"
+#include "output.h"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+// Where the renderer streams an encoded frame, one filled chunk at a time
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+    virtual ArenaChunk* acquireChunk() = 0;
+    virtual void pushChunk(ArenaChunk* chunk, bool frame_end) = 0;
+    virtual size_t getChunkSize() const = 0;
+};
+
+// Owns the terminal output. The renderer encodes each frame into arena
+// chunks and pushes them as they fill; the writer sends them in order while
+// the rest of the frame is still being rendered. The arena is registered
+// with the output engine once, so io_uring writes come from fixed buffers.
+//
+// Over ssh or tmux the pty queue absorbs whole frames before anything blocks,
+// so after each frame the writer also waits for the output queue (TIOCOUTQ,
+// or an estimate from write completion times where that reads 0) to fall
+// below a target. Until the frame is out and the queue has drained canAccept() is
+// false and the render thread holds off, which keeps exactly one fresh frame
+// in flight instead of a stale backlog.
+class FrameWriter : public FrameSink {
+private:
+    using clock = std::chrono::steady_clock;
+    
+    int out_fd;
+    int wake_fd;
+    int ready_fd;
+    int queue_target;
+    ChunkArena arena;
+    OutputEngine engine;
+    std::thread thread;
+    
+    std::mutex mutex;
+    std::deque<ArenaChunk*> queue;
+    int frames_in_flight;
+    bool frame_open;
+    // A frame was abandoned; report ready once what was sent of it is out
+    bool frame_aborted;
+    clock::time_point frame_start;
+    std::deque<clock::time_point> frame_starts;
+    LatencyTrace* trace;
+    std::deque<int64_t> frame_inputs;
+    bool stopping;
+    
+    // Bytes written in total, sampled after each frame
+    uint64_t bytes_total;
+    std::deque<std::pair<clock::time_point, uint64_t>> write_history;
+    bool stalled;
+    clock::time_point stall_start;
+    uint64_t stalled_bytes;
+    std::deque<double> rate_samples;
+    double drain_rate;
+    
+    uint64_t frames_written;
+    uint64_t congestion_count;
+    uint64_t queue_sum;
+    int queue_max;
+    double latency_sum;
+    double latency_max;
+    
+    void run();
+    bool writeSegments(struct iovec* iov, int iovcnt);
+    bool drainQueue();
+    int outputQueue() const;
+    int estimateQueue();
+    void signalReady();
+    
+public:
+    FrameWriter();
+    ~FrameWriter();
+    
+    // Bytes allowed to sit in the terminal's output queue before new frames
+    // are held back; negative disables pacing
+    void setQueueTarget(int bytes) { queue_target = bytes; }
+    // Frames carry traced input through to when they are written
+    void setLatencyTrace(LatencyTrace* t) { trace = t; }
+    
+    bool start(int fd, size_t chunk_size = 64 * 1024, int chunk_count = 16);
+    void stop();
+    
+    // Blocks while every chunk is queued for output; nullptr after stop()
+    ArenaChunk* acquireChunk() override { return arena.acquire(); }
+    ArenaChunk* tryAcquireChunk() { return arena.tryAcquire(); }
+    // Drops the chunks of the open frame that have not been written yet
+    void abortFrame();
+    size_t getChunkSize() const override { return arena.getChunkSize(); }
+    void pushChunk(ArenaChunk* chunk, bool frame_end) override;
+    
+    // Readable whenever canAccept() may have turned true
+    int getReadyFd() const { return ready_fd; }
+    void consumeReady();
+    bool canAccept();
+    
+    // Only meaningful once stop() has returned
+    void printStats(std::ostream& out) const;
+};
@@ -1,19 +1,42 @@
 #include "capture.h"
 #include <cstring>
+#include <cstdlib>
 #include <iostream>
+#include <algorithm>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <X11/Xutil.h>
+#include <X11/XWDFile.h>
+#include <X11/extensions/Xcomposite.h>
+#ifdef HAVE_XCB_SHM
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 X11Capturer::X11Capturer() 
     : display(nullptr), window(0), ximage(nullptr), 
-      width(0), height(0), using_shm(false),
+      width(0), height(0), using_shm(false), shm_is_memfd(false), shm_size(0), use_hugepages(false),
+      fb_map(nullptr), fb_map_size(0), fb_pixels(nullptr), fb_bytes_per_line(0),
+      use_composite(false), composite_active(false), window_pixmap(0),
+      origin_x(0), origin_y(0), pending_width(0), pending_height(0),
       damage(0), damage_event_base(0), damage_error_base(0), damage_available(false),
       xfixes_event_base(0), xfixes_error_base(0),
-      frame_dirty(true) {
+      frame_dirty(true), frame_changed(true), first_frame(true),
+      damage_x1(0), damage_y1(0), damage_x2(0), damage_y2(0),
+      tiles_x(0), tiles_y(0),
+      changed_x1(0), changed_y1(0), changed_x2(0), changed_y2(0), fallback_image(nullptr),
+      cursor_x(0), cursor_y(0), cursor_dirty(true), pointer_dirty(true) {
     memset(&shminfo, 0, sizeof(shminfo));
     shminfo.shmid = -1;
-    cursor_cache.hash = 0;
+    memset(fb_masks, 0, sizeof(fb_masks));
 }
 
 X11Capturer::~X11Capturer() {
@@ -27,7 +50,9 @@ bool X11Capturer::initDamage() {
     }
     
 
-    damage = XDamageCreate(display, window, XDamageReportNonEmpty);
+    // BoundingBox keeps reporting while an app is still repainting, which the
+    // capture loop uses to coalesce bursts; NonEmpty goes silent after one event.
+    damage = XDamageCreate(display, window, XDamageReportBoundingBox);
     if (!damage) {
         std::cerr << "Failed to create damage object\n";
         return false;
@@ -54,6 +79,248 @@ bool X11Capturer::initXFixes() {
     return true;
 }
 
+// Xvfb -fbdir keeps the screen in an XWD file that it mmaps MAP_SHARED, so
+// mapping the same file gives live pixels with no server round trip.
+bool X11Capturer::initFramebuffer() {
+    int fd = open(fb_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open framebuffer " << fb_path << "\n";
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sz_XWDheader) {
+        close(fd);
+        return false;
+    }
+    
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to mmap framebuffer\n";
+        return false;
+    }
+    
+    // Xvfb writes the header most significant byte first
+    const XWDFileHeader* hdr = (const XWDFileHeader*)map;
+    uint32_t header_size = ntohl(hdr->header_size);
+    uint32_t version = ntohl(hdr->file_version);
+    uint32_t format = ntohl(hdr->pixmap_format);
+    uint32_t bpp = ntohl(hdr->bits_per_pixel);
+    uint32_t ncolors = ntohl(hdr->ncolors);
+    int fb_width = ntohl(hdr->pixmap_width);
+    int fb_height = ntohl(hdr->pixmap_height);
+    int bpl = ntohl(hdr->bytes_per_line);
+    
+    size_t offset = (size_t)header_size + (size_t)ncolors * sz_XWDColor;
+    if (version != XWD_FILE_VERSION || format != ZPixmap || bpp != 32 ||
+        offset + (size_t)bpl * fb_height > (size_t)st.st_size) {
+        std::cerr << "Unsupported framebuffer format (version " << version
+                  << ", bpp " << bpp << ")\n";
+        munmap(map, st.st_size);
+        return false;
+    }
+    
+    fb_map = (uint8_t*)map;
+    fb_map_size = st.st_size;
+    fb_pixels = fb_map + offset;
+    fb_bytes_per_line = bpl;
+    fb_masks[0] = ntohl(hdr->red_mask);
+    fb_masks[1] = ntohl(hdr->green_mask);
+    fb_masks[2] = ntohl(hdr->blue_mask);
+    width = fb_width;
+    height = fb_height;
+    
+    std::cout << "Framebuffer mapped: " << width << "x" << height
+              << ", " << fb_bytes_per_line << " bytes/line\n";
+    return true;
+}
+
+// Redirecting the window keeps its contents in an offscreen pixmap, so it can
+// be grabbed at native size even when other windows cover it.
+bool X11Capturer::initComposite() {
+    int event_base, error_base;
+    if (!XCompositeQueryExtension(display, &event_base, &error_base)) {
+        return false;
+    }
+    if (window == DefaultRootWindow(display)) {
+        return false;
+    }
+    
+    XWindowAttributes attrs;
+    if (!XGetWindowAttributes(display, window, &attrs)) {
+        return false;
+    }
+    
+    XCompositeRedirectWindow(display, window, CompositeRedirectAutomatic);
+    XSelectInput(display, window, StructureNotifyMask);
+    
+    width = attrs.width;
+    height = attrs.height;
+    updateOrigin();
+    window_pixmap = XCompositeNameWindowPixmap(display, window);
+    composite_active = true;
+    return true;
+}
+
+// The window usually sits inside a WM frame, so its own x and y are relative
+// to that; the origin is where it is on the screen
+void X11Capturer::updateOrigin() {
+    Window child;
+    if (!XTranslateCoordinates(display, window, DefaultRootWindow(display), 0, 0,
+                               &origin_x, &origin_y, &child)) {
+        origin_x = origin_y = 0;
+    }
+}
+
+// MIT-SHM 1.2 lets the server map a memfd we pass over the socket. Unlike
+// SysV segments it is not bound by shmmax/shmall and disappears with the
+// last reference, so a crashed session cannot leak it.
+bool X11Capturer::attachMemfdSegment(size_t size, uint32_t& seg, char*& addr, size_t& map_size) {
+#ifdef HAVE_XCB_SHM
+    int major = 0, minor = 0;
+    Bool pixmaps;
+    if (!XShmQueryVersion(display, &major, &minor, &pixmaps) ||
+        major < 1 || (major == 1 && minor < 2)) {
+        return false;
+    }
+    
+    int fd = -1;
+    map_size = size;
+    if (use_hugepages) {
+        const size_t huge = 2 * 1024 * 1024;
+        map_size = (size + huge - 1) & ~(huge - 1);
+        fd = memfd_create("mirrors-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+        if (fd >= 0 && ftruncate(fd, map_size) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            std::cerr << "Hugepage memfd unavailable, using regular pages\n";
+            map_size = size;
+        }
+    }
+    if (fd < 0) {
+        fd = memfd_create("mirrors-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) return false;
+        if (ftruncate(fd, map_size) != 0) {
+            close(fd);
+            return false;
+        }
+    }
+    
+    // Neither side may resize the buffer under the other
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    
+    void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    
+    xcb_connection_t* conn = XGetXCBConnection(display);
+    seg = xcb_generate_id(conn);
+    // xcb takes ownership of the fd and closes it once sent
+    xcb_generic_error_t* err = xcb_request_check(conn, xcb_shm_attach_fd_checked(conn, seg, fd, 0));
+    if (err) {
+        free(err);
+        munmap(map, map_size);
+        return false;
+    }
+    addr = (char*)map;
+    return true;
+#else
+    (void)size; (void)seg; (void)addr; (void)map_size;
+    return false;
+#endif
+}
+
+bool X11Capturer::attachMemfd(size_t size) {
+    uint32_t seg;
+    char* addr;
+    size_t map_size;
+    if (!attachMemfdSegment(size, seg, addr, map_size)) return false;
+    
+    shminfo.shmseg = seg;
+    shminfo.shmid = -1;
+    shminfo.shmaddr = addr;
+    shminfo.readOnly = False;
+    ximage->data = shminfo.shmaddr;
+    shm_is_memfd = true;
+    shm_size = map_size;
+    using_shm = true;
+    return true;
+}
+
+bool X11Capturer::createShmImage() {
+    Visual* visual = DefaultVisual(display, DefaultScreen(display));
+    int depth = DefaultDepth(display, DefaultScreen(display));
+    
+    ximage = XShmCreateImage(display, visual, depth, ZPixmap, 
+                             nullptr, &shminfo, width, height);
+    
+    if (ximage) {
+        size_t size = ximage->bytes_per_line * ximage->height;
+        
+        if (attachMemfd(size)) return true;
+        
+        shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+        
+        if (shminfo.shmid != -1) {
+            shminfo.shmaddr = (char*)shmat(shminfo.shmid, nullptr, 0);
+            
+            if (shminfo.shmaddr != (char*)-1) {
+                ximage->data = shminfo.shmaddr;
+                shminfo.readOnly = False;
+                
+               
+                shmctl(shminfo.shmid, IPC_RMID, nullptr);
+                
+                if (XShmAttach(display, &shminfo)) {
+                    XSync(display, False);
+                    using_shm = true;
+                } else {
+                    std::cerr << "XShmAttach failed\n";
+                    shmdt(shminfo.shmaddr);
+                    shminfo.shmaddr = nullptr;
+                }
+            } else {
+                std::cerr << "shmat failed\n";
+            }
+        } else {
+            std::cerr << "shmget failed\n";
+        }
+        
+        if (!using_shm) {
+            XDestroyImage(ximage);
+            ximage = nullptr;
+        }
+    }
+    return using_shm;
+}
+
+void X11Capturer::destroyShmImage() {
+    if (!using_shm || !ximage) return;
+    
+    XShmDetach(display, &shminfo);
+    
+    if (shm_is_memfd) {
+        munmap(shminfo.shmaddr, shm_size);
+        shminfo.shmaddr = nullptr;
+        shm_is_memfd = false;
+        shm_size = 0;
+    } else if (shminfo.shmaddr && shminfo.shmaddr != (char*)-1) {
+        shmdt(shminfo.shmaddr);
+        shminfo.shmaddr = nullptr;
+    }
+    
+    
+    ximage->data = nullptr;
+    XDestroyImage(ximage);
+    ximage = nullptr;
+    using_shm = false;
+}
+
 bool X11Capturer::init(const char* display_name, Window target_window, int w, int h) {
     cleanup();
     
@@ -71,62 +338,34 @@ bool X11Capturer::init(const char* display_name, Window target_window, int w, in
     
     initXFixes();
     
+    if (!fb_path.empty() && !use_composite && initFramebuffer()) {
+        XSelectInput(display, window, StructureNotifyMask);
+        if (!initDamage()) {
+            std::cerr << "Damage extension not available - will capture every frame\n";
+        }
+        return true;
+    }
+    
+    if (use_composite && !initComposite()) {
+        std::cerr << "Composite not available - capturing the root window\n";
+        window = DefaultRootWindow(display);
+    }
+    if (!composite_active) XSelectInput(display, window, StructureNotifyMask);
     
     if (XShmQueryExtension(display)) {
-        Visual* visual = DefaultVisual(display, DefaultScreen(display));
-        int depth = DefaultDepth(display, DefaultScreen(display));
-        
-        ximage = XShmCreateImage(display, visual, depth, ZPixmap, 
-                                 nullptr, &shminfo, width, height);
-        
-        if (ximage) {
-            size_t size = ximage->bytes_per_line * ximage->height;
-            
-            
-            shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
-            
-            if (shminfo.shmid != -1) {
-                shminfo.shmaddr = (char*)shmat(shminfo.shmid, nullptr, 0);
-                
-                if (shminfo.shmaddr != (char*)-1) {
-                    ximage->data = shminfo.shmaddr;
-                    shminfo.readOnly = False;
-                    
-                   
-                    shmctl(shminfo.shmid, IPC_RMID, nullptr);
-                    
-                    if (XShmAttach(display, &shminfo)) {
-                        XSync(display, False);
-                        using_shm = true;
-                        std::cout << "XShm initialized: " << width << "x" << height 
-                                  << ", " << ximage->bytes_per_line << " bytes/line, depth=" 
-                                  << ximage->depth << ", bpp=" << ximage->bits_per_pixel << "\n";
-                        std::cout << "Red mask: 0x" << std::hex << ximage->red_mask 
-                                  << ", Green: 0x" << ximage->green_mask 
-                                  << ", Blue: 0x" << ximage->blue_mask << std::dec << "\n";
-                    } else {
-                        std::cerr << "XShmAttach failed\n";
-                        shmdt(shminfo.shmaddr);
-                        shminfo.shmaddr = nullptr;
-                    }
-                } else {
-                    std::cerr << "shmat failed\n";
-                }
-            } else {
-                std::cerr << "shmget failed\n";
-            }
-            
-            if (!using_shm) {
-                XDestroyImage(ximage);
-                ximage = nullptr;
-            }
+        if (createShmImage()) {
+            std::cout << "XShm initialized (" << (shm_is_memfd ? "memfd" : "SysV") << "): "
+                      << width << "x" << height 
+                      << ", " << ximage->bytes_per_line << " bytes/line, depth=" 
+                      << ximage->depth << ", bpp=" << ximage->bits_per_pixel << "\n";
+            std::cout << "Red mask: 0x" << std::hex << ximage->red_mask 
+                      << ", Green: 0x" << ximage->green_mask 
+                      << ", Blue: 0x" << ximage->blue_mask << std::dec << "\n";
         }
     } else {
         std::cerr << "XShm extension not available\n";
     }
     
-    
-    
     if (using_shm) {
         if (!initDamage()) {
             std::cerr << "Damage extension not available - will capture every frame\n";
@@ -136,18 +375,69 @@ bool X11Capturer::init(const char* display_name, Window target_window, int w, in
     return using_shm || (display != nullptr);
 }
 
-void X11Capturer::processEvents() {
-    if (!display) return;
-    
+int X11Capturer::processEvents() {
+    if (!display) return 0;
     
+    int count = 0;
     while (XPending(display) > 0) {
         XEvent event;
         XNextEvent(display, &event);
         
         if (damage_available && event.type == damage_event_base + XDamageNotify) {
+            XDamageNotifyEvent* de = (XDamageNotifyEvent*)&event;
+            if (damage_x2 <= damage_x1) {
+                damage_x1 = de->area.x;
+                damage_y1 = de->area.y;
+                damage_x2 = de->area.x + de->area.width;
+                damage_y2 = de->area.y + de->area.height;
+            } else {
+                damage_x1 = std::min(damage_x1, (int)de->area.x);
+                damage_y1 = std::min(damage_y1, (int)de->area.y);
+                damage_x2 = std::max(damage_x2, de->area.x + de->area.width);
+                damage_y2 = std::max(damage_y2, de->area.y + de->area.height);
+            }
             frame_dirty = true;
+            count++;
+        } else if (composite_active && event.type == ConfigureNotify &&
+                   event.xconfigure.window == window) {
+            updateOrigin();
+            if (event.xconfigure.width != width || event.xconfigure.height != height) {
+                pending_width = event.xconfigure.width;
+                pending_height = event.xconfigure.height;
+                frame_dirty = true;
+                count++;
+            }
+        } else if (!composite_active && event.type == ConfigureNotify &&
+                   event.xconfigure.window == window) {
+            // The screen itself was resized through RANDR
+            if (event.xconfigure.width != width || event.xconfigure.height != height) {
+                pending_width = event.xconfigure.width;
+                pending_height = event.xconfigure.height;
+                frame_dirty = true;
+                count++;
+            }
+        } else if (composite_active && event.type == DestroyNotify &&
+                   event.xdestroywindow.window == window) {
+            // The captured window is gone; carry on with the whole screen
+            if (window_pixmap) XFreePixmap(display, window_pixmap);
+            window_pixmap = 0;
+            composite_active = false;
+            window = DefaultRootWindow(display);
+            origin_x = origin_y = 0;
+            XSelectInput(display, window, StructureNotifyMask);
+            pending_width = DisplayWidth(display, DefaultScreen(display));
+            pending_height = DisplayHeight(display, DefaultScreen(display));
+            if (damage_available) {
+                damage = XDamageCreate(display, window, XDamageReportBoundingBox);
+            }
+            frame_dirty = true;
+            count++;
+        } else if (event.type == xfixes_event_base + XFixesCursorNotify) {
+            cursor_dirty = true;
+            count++;
         }
     }
+    return count;
 }
 
 bool X11Capturer::isDirty() {
@@ -163,29 +453,79 @@ void X11Capturer::clearDamage() {
     frame_dirty = false;
 }
 
-uint8_t* X11Capturer::captureFrame(bool force) {
-    if (!display || !window) return nullptr;
-    
-    
-    static bool first_frame = true;
+bool X11Capturer::needsGrab(bool& force) {
     if (first_frame) {
         force = true;
         first_frame = false;
     }
+    if (force || !damage_available) return true;
     
+    processEvents();
+    return frame_dirty;
+}
+
+// Only tiles under the reported damage need hashing; anything else
+// (forced frames, no Damage at all) is checked in full.
+void X11Capturer::takeDamageRegion(bool force, int& x1, int& y1, int& x2, int& y2) {
+    x1 = 0; y1 = 0; x2 = width; y2 = height;
+    if (!force && damage_available && damage_x2 > damage_x1) {
+        x1 = damage_x1; y1 = damage_y1;
+        x2 = damage_x2; y2 = damage_y2;
+    }
+    damage_x1 = damage_y1 = damage_x2 = damage_y2 = 0;
     
-    if (!force && damage_available) {
-        processEvents();
-        if (!frame_dirty) {
-            
-            return (using_shm && ximage) ? (uint8_t*)ximage->data : nullptr;
+    // Subtract before grabbing so damage landing mid-copy is reported again
+    if (damage_available) clearDamage();
+}
+
+// The window pixmap is only valid for one size; name a fresh one after a resize
+void X11Capturer::applyPendingResize() {
+    if (pending_width <= 0) return;
+    
+    if (window_pixmap) XFreePixmap(display, window_pixmap);
+    window_pixmap = 0;
+    destroyShmImage();
+    width = pending_width;
+    height = pending_height;
+    pending_width = pending_height = 0;
+    createShmImage();
+    if (composite_active) window_pixmap = XCompositeNameWindowPixmap(display, window);
+}
+
+uint8_t* X11Capturer::captureFrame(bool force) {
+    if (!display || !window) return nullptr;
+    
+    if (!needsGrab(force)) {
+        frame_changed = false;
+        if (fb_pixels) return fb_pixels;
+        if (fallback_image) return (uint8_t*)fallback_image->data;
+        return (using_shm && ximage) ? (uint8_t*)ximage->data : nullptr;
+    }
+    
+    int x1, y1, x2, y2;
+    takeDamageRegion(force, x1, y1, x2, y2);
+    
+    if (fb_pixels) {
+        // Xvfb keeps its framebuffer and stride when RANDR shrinks the screen
+        if (pending_width > 0) {
+            size_t rows = (fb_map_size - (fb_pixels - fb_map)) / fb_bytes_per_line;
+            width = std::min(pending_width, fb_bytes_per_line / 4);
+            height = std::min(pending_height, (int)rows);
+            pending_width = pending_height = 0;
         }
+        frame_changed = updateTileHashes(fb_pixels, fb_bytes_per_line, x1, y1, x2, y2);
+        return fb_pixels;
     }
     
+    applyPendingResize();
+    
+    Drawable source = composite_active ? window_pixmap : window;
+    
     if (using_shm && ximage) {
         
-        if (XShmGetImage(display, window, ximage, 0, 0, AllPlanes)) {
-            if (damage_available) clearDamage();
+        if (XShmGetImage(display, source, ximage, 0, 0, AllPlanes)) {
+            frame_changed = updateTileHashes((uint8_t*)ximage->data, ximage->bytes_per_line,
+                                             x1, y1, x2, y2);
             return (uint8_t*)ximage->data;
         } else {
             std::cerr << "XShmGetImage failed\n";
@@ -193,114 +533,165 @@ uint8_t* X11Capturer::captureFrame(bool force) {
         }
     } else {
         
-        XImage* img = XGetImage(display, window, 0, 0, width, height, 
-                                AllPlanes, ZPixmap);
-        if (img) {
-            static std::vector<uint8_t> fallback_buffer;
-            size_t size = img->bytes_per_line * height;
-            
-            fallback_buffer.assign((uint8_t*)img->data, 
-                                   (uint8_t*)img->data + size);
-            
-            XDestroyImage(img);
-            if (damage_available) clearDamage();
-            return fallback_buffer.data();
+        // The image is handed out as-is and kept alive until the next grab
+        if (fallback_image) {
+            XDestroyImage(fallback_image);
+            fallback_image = nullptr;
+        }
+        fallback_image = XGetImage(display, source, 0, 0, width, height, 
+                                   AllPlanes, ZPixmap);
+        if (fallback_image) {
+            frame_changed = updateTileHashes((uint8_t*)fallback_image->data,
+                                             fallback_image->bytes_per_line, x1, y1, x2, y2);
+            return (uint8_t*)fallback_image->data;
         }
     }
     
     return nullptr;
 }
 
-X11Capturer::CursorData X11Capturer::getCursor() {
-    CursorData data;
-    data.visible = false;
-    data.changed = false;
-    
-    if (!display) return data;
-
-    XFixesCursorImage* img = XFixesGetCursorImage(display);
-    if (!img) return data;
+static inline uint32_t hashSpan(uint32_t h, const uint8_t* p, size_t len) {
+#ifdef __SSE4_2__
+    uint64_t crc = h;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        crc = _mm_crc32_u64(crc, v);
+    }
+    for (; i < len; ++i) crc = _mm_crc32_u8((uint32_t)crc, p[i]);
+    return (uint32_t)crc;
+#else
+    uint64_t acc = h ^ 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        acc = (acc ^ v) * 0x100000001B3ull;
+        acc ^= acc >> 29;
+    }
+    for (; i < len; ++i) acc = (acc ^ p[i]) * 0x100000001B3ull;
+    return (uint32_t)(acc ^ (acc >> 32));
+#endif
+}
 
-    
-    uint64_t hash = 5381;
-    for (int i = 0; i < img->width * img->height; ++i) {
-        hash = ((hash << 5) + hash) + (uint32_t)img->pixels[i];
+// Rehashes the tiles overlapping the given rectangle and reports whether any
+// of them differ from the previous frame. Apps that repaint identical pixels
+// still raise Damage, so this is what actually decides if a frame is new.
+bool X11Capturer::updateTileHashes(const uint8_t* pixels, int bytes_per_line,
+                                   int x1, int y1, int x2, int y2) {
+    int tx = (width + TILE_W - 1) / TILE_W;
+    int ty = (height + TILE_H - 1) / TILE_H;
+    bool changed = false;
+    int cx1 = width, cy1 = height, cx2 = 0, cy2 = 0;
+    
+    if (tx != tiles_x || ty != tiles_y || tile_hashes.size() != (size_t)(tx * ty)) {
+        tiles_x = tx;
+        tiles_y = ty;
+        tile_hashes.assign(tx * ty, 0);
+        x1 = 0; y1 = 0; x2 = width; y2 = height;
+        cx1 = 0; cy1 = 0; cx2 = width; cy2 = height;
+        changed = true;
     }
     
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    x2 = std::min(x2, width);
+    y2 = std::min(y2, height);
+    if (x2 <= x1 || y2 <= y1) {
+        changed_x1 = cx1; changed_y1 = cy1;
+        changed_x2 = cx2; changed_y2 = cy2;
+        return changed;
+    }
     
-    if (hash == cursor_cache.hash && 
-        cursor_cache.width == img->width && 
-        cursor_cache.height == img->height) {
-        
-        data = {
-            cursor_cache.pixels,
-            cursor_cache.width,
-            cursor_cache.height,
-            0, 0, 
-            cursor_cache.xhot,
-            cursor_cache.yhot,
-            true,
-            cursor_cache.name,
-            hash,
-            false 
-        };
+    for (int ty_i = y1 / TILE_H; ty_i <= (y2 - 1) / TILE_H; ++ty_i) {
+        int row_start = ty_i * TILE_H;
+        int row_end = std::min(row_start + TILE_H, height);
         
-        
-        int dest_x, dest_y;
-        Window child;
-        XTranslateCoordinates(display, DefaultRootWindow(display), window, 
-                              img->x, img->y, &dest_x, &dest_y, &child);
-        data.x = dest_x;
-        data.y = dest_y;
-        
-        XFree(img);
-        return data;
+        for (int tx_i = x1 / TILE_W; tx_i <= (x2 - 1) / TILE_W; ++tx_i) {
+            int col_start = tx_i * TILE_W;
+            int col_end = std::min(col_start + TILE_W, width);
+            size_t span = (size_t)(col_end - col_start) * 4;
+            
+            uint32_t h = 0;
+            for (int y = row_start; y < row_end; ++y) {
+                h = hashSpan(h, pixels + (size_t)y * bytes_per_line + col_start * 4, span);
+            }
+            
+            uint32_t& prev = tile_hashes[ty_i * tiles_x + tx_i];
+            if (h != prev) {
+                prev = h;
+                changed = true;
+                cx1 = std::min(cx1, col_start);
+                cy1 = std::min(cy1, row_start);
+                cx2 = std::max(cx2, col_end);
+                cy2 = std::max(cy2, row_end);
+            }
+        }
     }
     
-    
-    data.visible = true;
-    data.changed = true;
-    data.width = img->width;
-    data.height = img->height;
-    data.xhot = img->xhot;
-    data.yhot = img->yhot;
-    data.hash = hash;
-    
-    
-    int dest_x, dest_y;
-    Window child;
-    XTranslateCoordinates(display, DefaultRootWindow(display), window, 
-                          img->x, img->y, &dest_x, &dest_y, &child);
-    data.x = dest_x;
-    data.y = dest_y;
+    changed_x1 = cx1; changed_y1 = cy1;
+    changed_x2 = cx2; changed_y2 = cy2;
+    return changed;
+}
 
-    
-    if (img->atom) {
-        char* name = XGetAtomName(display, img->atom);
-        if (name) {
-            data.name = name;
-            XFree(name);
+X11Capturer::CursorData X11Capturer::getCursor() {
+    if (display && cursor_dirty) {
+        XFixesCursorImage* img = XFixesGetCursorImage(display);
+        if (img) {
+            auto image = std::make_shared<CursorImage>();
+            image->width = img->width;
+            image->height = img->height;
+            image->xhot = img->xhot;
+            image->yhot = img->yhot;
+            image->serial = img->cursor_serial;
+            image->pixels.resize(img->width * img->height);
+            for (int i = 0; i < img->width * img->height; ++i) {
+                image->pixels[i] = (uint32_t)img->pixels[i];
+            }
+            if (img->atom) {
+                char* name = XGetAtomName(display, img->atom);
+                if (name) {
+                    image->name = name;
+                    XFree(name);
+                }
+            }
+            
+            // The reply carries the root position as well, so no separate query
+            cursor_x = img->x - origin_x;
+            cursor_y = img->y - origin_y;
+            cursor_image = image;
+            XFree(img);
         }
+        cursor_dirty = false;
+        pointer_dirty = false;
+        
+        CursorData data;
+        data.image = cursor_image;
+        data.x = cursor_x;
+        data.y = cursor_y;
+        data.visible = (bool)cursor_image;
+        data.changed = true;
+        return data;
     }
-
     
-    data.pixels.resize(data.width * data.height);
-    for (int i = 0; i < data.width * data.height; ++i) {
-        data.pixels[i] = (uint32_t)img->pixels[i];
+    if (display && pointer_dirty) {
+        Window root_ret, child;
+        int root_x, root_y, win_x, win_y;
+        unsigned int mask;
+        if (XQueryPointer(display, window, &root_ret, &child, &root_x, &root_y,
+                          &win_x, &win_y, &mask)) {
+            cursor_x = win_x;
+            cursor_y = win_y;
+        }
+        pointer_dirty = false;
     }
-
     
-    cursor_cache = {
-        hash,
-        data.pixels,
-        data.width,
-        data.height,
-        data.xhot,
-        data.yhot,
-        data.name
-    };
-
-    XFree(img);
+    CursorData data;
+    data.image = cursor_image;
+    data.x = cursor_x;
+    data.y = cursor_y;
+    data.visible = (bool)cursor_image;
     return data;
 }
 
@@ -313,19 +704,27 @@ void X11Capturer::cleanup() {
     }
     
     
-    if (using_shm && ximage) {
-        XShmDetach(display, &shminfo);
-        
-        if (shminfo.shmaddr && shminfo.shmaddr != (char*)-1) {
-            shmdt(shminfo.shmaddr);
-            shminfo.shmaddr = nullptr;
-        }
-        
-        
-        ximage->data = nullptr;
-        XDestroyImage(ximage);
-        ximage = nullptr;
-        using_shm = false;
+    if (composite_active) {
+        if (window_pixmap) XFreePixmap(display, window_pixmap);
+        XCompositeUnredirectWindow(display, window, CompositeRedirectAutomatic);
+        window_pixmap = 0;
+        composite_active = false;
+    }
+    
+    destroyShmImage();
+    
+    if (fallback_image) {
+        XDestroyImage(fallback_image);
+        fallback_image = nullptr;
+    }
+    
+    tile_hashes.clear();
+    
+    if (fb_map) {
+        munmap(fb_map, fb_map_size);
+        fb_map = nullptr;
+        fb_map_size = 0;
+        fb_pixels = nullptr;
     }
     
     if (display) {
@@ -335,5 +734,8 @@ void X11Capturer::cleanup() {
     
     window = 0;
     frame_dirty = true;
-    cursor_cache.hash = 0;
+    first_frame = true;
+    cursor_image.reset();
+    cursor_dirty = true;
+    pointer_dirty = true;
 }
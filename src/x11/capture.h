@@ -10,7 +10,16 @@
 #include <memory>
 
 class X11Capturer {
-private:
+public:
+    struct CursorImage {
+        std::vector<uint32_t> pixels;
+        int width, height;
+        int xhot, yhot;
+        std::string name;
+        uint64_t serial;
+    };
+
+protected:
     Display* display;
     Window window;
     XShmSegmentInfo shminfo;
@@ -18,6 +27,22 @@ private:
     int width;
     int height;
     bool using_shm;
+    bool shm_is_memfd;
+    size_t shm_size;
+    bool use_hugepages;
+    
+    std::string fb_path;
+    uint8_t* fb_map;
+    size_t fb_map_size;
+    uint8_t* fb_pixels;
+    int fb_bytes_per_line;
+    uint32_t fb_masks[3];
+    
+    bool use_composite;
+    bool composite_active;
+    Pixmap window_pixmap;
+    int origin_x, origin_y;
+    int pending_width, pending_height;
     
 
     Damage damage;
@@ -31,56 +56,102 @@ private:
     
 
     bool frame_dirty;
+    bool frame_changed;
+    bool first_frame;
+    int damage_x1, damage_y1, damage_x2, damage_y2;
+    
+    static const int TILE_W = 64;
+    static const int TILE_H = 16;
+    int tiles_x, tiles_y;
+    std::vector<uint32_t> tile_hashes;
+    int changed_x1, changed_y1, changed_x2, changed_y2;
+    
+    XImage* fallback_image;
     
 
-    struct CursorCache {
-        uint64_t hash;
-        std::vector<uint32_t> pixels;
-        int width, height;
-        int xhot, yhot;
-        std::string name;
-    };
-    CursorCache cursor_cache;
+    // The image is only refetched on XFixes cursor notifies and the position
+    // only queried after pointer motion, so a still pointer costs nothing.
+    std::shared_ptr<const CursorImage> cursor_image;
+    int cursor_x, cursor_y;
+    bool cursor_dirty;
+    bool pointer_dirty;
     
 
     bool initDamage();
     bool initXFixes();
+    bool initFramebuffer();
+    bool initComposite();
+    void updateOrigin();
+    bool createShmImage();
+    bool attachMemfd(size_t size);
+    bool attachMemfdSegment(size_t size, uint32_t& seg, char*& addr, size_t& map_size);
+    void destroyShmImage();
+    bool updateTileHashes(const uint8_t* pixels, int bytes_per_line,
+                          int x1, int y1, int x2, int y2);
+    bool needsGrab(bool& force);
+    void takeDamageRegion(bool force, int& x1, int& y1, int& x2, int& y2);
+    void applyPendingResize();
 
 public:
     X11Capturer();
     ~X11Capturer();
     
+    void setFramebufferPath(const std::string& path) { fb_path = path; }
+    void setComposite(bool enable) { use_composite = enable; }
+    void setHugePages(bool enable) { use_hugepages = enable; }
+    
     bool init(const char* display_name, Window target_window, int w, int h);
     
     bool isDirty();
     
     void clearDamage();
     
+    int getConnectionFd() const { return display ? ConnectionNumber(display) : -1; }
+    bool hasDamage() const { return damage_available; }
+    
+    void beginFrame(bool want_cursor) { (void)want_cursor; }
+    bool hasPendingFrame() const { return false; }
+    
     uint8_t* captureFrame(bool force = false);
     
+    bool frameChanged() const { return frame_changed; }
+    
+    // Tile-aligned bounds of what differed from the previous frame
+    void getChangedRect(int& x, int& y, int& w, int& h) const {
+        x = changed_x1;
+        y = changed_y1;
+        w = changed_x2 > changed_x1 ? changed_x2 - changed_x1 : 0;
+        h = changed_y2 > changed_y1 ? changed_y2 - changed_y1 : 0;
+    }
+    
     int getWidth() const { return width; }
     int getHeight() const { return height; }
+    int getOriginX() const { return origin_x; }
+    int getOriginY() const { return origin_y; }
     
-    int getBytesPerLine() const { return ximage ? ximage->bytes_per_line : width * 4; }
+    int getBytesPerLine() const {
+        if (fb_pixels) return fb_bytes_per_line;
+        if (fallback_image) return fallback_image->bytes_per_line;
+        return ximage ? ximage->bytes_per_line : width * 4;
+    }
     
-    uint32_t getRedMask() const { return ximage ? ximage->red_mask : 0; }
-    uint32_t getGreenMask() const { return ximage ? ximage->green_mask : 0; }
-    uint32_t getBlueMask() const { return ximage ? ximage->blue_mask : 0; }
+    uint32_t getRedMask() const { return fb_pixels ? fb_masks[0] : (ximage ? ximage->red_mask : 0); }
+    uint32_t getGreenMask() const { return fb_pixels ? fb_masks[1] : (ximage ? ximage->green_mask : 0); }
+    uint32_t getBlueMask() const { return fb_pixels ? fb_masks[2] : (ximage ? ximage->blue_mask : 0); }
     
     void cleanup();
 
+    // A snapshot for the renderer; the image is shared and never modified, so
+    // handing one over is a reference count bump rather than a pixel copy.
     struct CursorData {
-        std::vector<uint32_t> pixels;
-        int width, height;
-        int x, y;
-        int xhot, yhot;
-        bool visible;
-        std::string name;
-        uint64_t hash;
-        bool changed;
+        std::shared_ptr<const CursorImage> image;
+        int x = 0, y = 0;
+        bool visible = false;
+        bool changed = false;
     };
     
     CursorData getCursor();
+    void markPointerMoved() { pointer_dirty = true; }
     
-    void processEvents();
+    int processEvents();
 };
@@ -1,8 +1,11 @@
 #include "input.h"
 #include "renderer.h"
+#include "selection.h"
+#include "latency.h"
 #include <X11/keysym.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 #include <cstring>
 #include <csignal>
 #include <iostream>
@@ -11,97 +14,137 @@ InputHandler::InputHandler()
     : display(nullptr), target_window(0), term_cols(0), term_lines(0),
       button_state(0), last_mouse_x(0), last_mouse_y(0),
       potential_pan(false), panning_active(false), pan_start_x(0), pan_start_y(0),
-      shell_pid(-1), renderer(nullptr), track_mouse_move(true) {
+      shell_pid(-1), renderer(nullptr), pane_grab(nullptr), sink(nullptr), track_mouse_move(true), wake_on_motion(false),
+      view_only(false), allow_quit(true), parse_state(PARSE_GROUND),
+      seq_nparams(0), seq_len(0), seq_marker(0), seq_intermediate(false), seq_subparam(false),
+      escape_fd(-1), escape_armed(false),
+      selection(nullptr), paste_key(PASTE_CTRL_V), paste_match(0),
+      motion_pending(false), motion_x(0), motion_y(0), sent_x(-1), sent_y(-1),
+      flush_pending(false), wake_target(nullptr), trace(nullptr), read_stamp(0) {
+    memset(latin_keycodes, 0, sizeof(latin_keycodes));
+    memset(function_keycodes, 0, sizeof(function_keycodes));
 }
 
 InputHandler::~InputHandler() {
     cleanup();
 }
 
-void InputHandler::initKeyMappings() {
+// How long a sequence may sit unfinished before its bytes count as keys.
+// Short enough that Escape feels immediate, long enough that a sequence
+// split across reads (or ssh packets) still arrives whole.
+static const int ESCAPE_TIMEOUT_MS = 50;
 
-    key_mapping["\r"] = XK_Return;
-    key_mapping["\n"] = XK_Return;
-    key_mapping[" "] = XK_space;
-    key_mapping["\t"] = XK_Tab;
-    key_mapping["\177"] = XK_BackSpace;
-    key_mapping["\033[3~"] = XK_Delete;
-    key_mapping["\033[Z"] = XK_ISO_Left_Tab;
-    
-
-    key_mapping["\033[13;2u"] = XK_Return;
-    key_mapping["\033\177"] = XK_BackSpace;
-    key_mapping["\033[7;5~"] = XK_BackSpace;
-    key_mapping["\010"] = XK_BackSpace;
-    key_mapping["\033[3;5~"] = XK_Delete;
-
-   
-    key_mapping["\033[A"] = XK_Up;
-    key_mapping["\033[B"] = XK_Down;
-    key_mapping["\033[C"] = XK_Right;
-    key_mapping["\033[D"] = XK_Left;
-    
+// Modifier bits as in xterm's modifier parameter, which is 1 + these
+enum {
+    MOD_SHIFT = 1,
+    MOD_ALT = 2,
+    MOD_CTRL = 4
+};
 
-    key_mapping["\033[a"] = XK_Up;   
-    key_mapping["\033[b"] = XK_Down;  
-    key_mapping["\033[c"] = XK_Right;
-    key_mapping["\033[d"] = XK_Left; 
+struct ByteKey {
+    KeySym ks;
+    uint8_t mods;
+};
 
-
-    key_mapping["\033[1;2A"] = XK_Up;
-    key_mapping["\033[1;2B"] = XK_Down;
-    key_mapping["\033[1;2C"] = XK_Right;
-    key_mapping["\033[1;2D"] = XK_Left;
+// What each ASCII byte types on a US layout
+static std::vector<ByteKey> buildByteKeys() {
+    std::vector<ByteKey> keys(128, ByteKey{NoSymbol, 0});
+    for (int c = 1; c <= 26; c++) keys[c] = {(KeySym)(XK_a + c - 1), MOD_CTRL};
+    keys['\b'] = {XK_BackSpace, 0};
+    keys['\t'] = {XK_Tab, 0};
+    keys['\n'] = {XK_Return, 0};
+    keys['\r'] = {XK_Return, 0};
+    keys[0x1B] = {XK_Escape, 0};
+    keys[0x7F] = {XK_BackSpace, 0};
     
-   
-    key_mapping["\033[1;5A"] = XK_Up;
-    key_mapping["\033[1;5B"] = XK_Down;
-    key_mapping["\033[1;5C"] = XK_Right;
-    key_mapping["\033[1;5D"] = XK_Left;
+    for (int c = 'a'; c <= 'z'; c++) keys[c] = {(KeySym)(XK_a + c - 'a'), 0};
+    for (int c = 'A'; c <= 'Z'; c++) keys[c] = {(KeySym)(XK_a + c - 'A'), MOD_SHIFT};
+    for (int c = '0'; c <= '9'; c++) keys[c] = {(KeySym)(XK_0 + c - '0'), 0};
     
-  
-    key_mapping["\033[1;6A"] = XK_Up;
-    key_mapping["\033[1;6B"] = XK_Down;
-    key_mapping["\033[1;6C"] = XK_Right;
-    key_mapping["\033[1;6D"] = XK_Left;
+    const char* shifted = ")!@#$%^&*(";
+    for (int d = 0; d < 10; d++) keys[(unsigned char)shifted[d]] = {(KeySym)(XK_0 + d), MOD_SHIFT};
     
+    static const struct { char plain, shift; KeySym ks; } punct[] = {
+        {'-', '_', XK_minus}, {'=', '+', XK_equal}, {'[', '{', XK_bracketleft},
+        {']', '}', XK_bracketright}, {'\\', '|', XK_backslash}, {';', ':', XK_semicolon},
+        {'\'', '"', XK_apostrophe}, {',', '<', XK_comma}, {'.', '>', XK_period},
+        {'/', '?', XK_slash}, {'`', '~', XK_grave}
+    };
+    for (const auto& p : punct) {
+        keys[(unsigned char)p.plain] = {p.ks, 0};
+        keys[(unsigned char)p.shift] = {p.ks, MOD_SHIFT};
+    }
+    keys[' '] = {XK_space, 0};
+    return keys;
+}
 
-    key_mapping["\033[1;2H"] = XK_Home;
-    key_mapping["\033[1;2F"] = XK_End;
-    
- 
-    key_mapping["\033[5;2~"] = XK_Page_Up;
-    key_mapping["\033[6;2~"] = XK_Page_Down;
-    
-  
-    key_mapping["\033[H"] = XK_Home;
-    key_mapping["\033[1~"] = XK_Home;
-    key_mapping["\033[F"] = XK_End;
-    key_mapping["\033[4~"] = XK_End;
-    key_mapping["\033[2~"] = XK_Insert;
-    key_mapping["\033[3~"] = XK_Delete;
-    key_mapping["\033[5~"] = XK_Page_Up;
-    key_mapping["\033[6~"] = XK_Page_Down;
-    
+static const std::vector<ByteKey> byte_keys = buildByteKeys();
 
-    key_mapping["\033OP"] = XK_F1;
-    key_mapping["\033OQ"] = XK_F2;
-    key_mapping["\033OR"] = XK_F3;
-    key_mapping["\033OS"] = XK_F4;
-    key_mapping["\033[15~"] = XK_F5;
-    key_mapping["\033[17~"] = XK_F6;
-    key_mapping["\033[18~"] = XK_F7;
-    key_mapping["\033[19~"] = XK_F8;
-    key_mapping["\033[20~"] = XK_F9;
-    key_mapping["\033[21~"] = XK_F10;
-    key_mapping["\033[23~"] = XK_F11;
-    key_mapping["\033[24~"] = XK_F12;
+// CSI <n> ~ keys; 7 is what some terminals send for Ctrl+Backspace
+static KeySym tildeKey(int code) {
+    switch (code) {
+        case 1: return XK_Home;
+        case 2: return XK_Insert;
+        case 3: return XK_Delete;
+        case 4: return XK_End;
+        case 5: return XK_Page_Up;
+        case 6: return XK_Page_Down;
+        case 7: return XK_BackSpace;
+        case 11: return XK_F1;
+        case 12: return XK_F2;
+        case 13: return XK_F3;
+        case 14: return XK_F4;
+        case 15: return XK_F5;
+        case 17: return XK_F6;
+        case 18: return XK_F7;
+        case 19: return XK_F8;
+        case 20: return XK_F9;
+        case 21: return XK_F10;
+        case 23: return XK_F11;
+        case 24: return XK_F12;
+        default: return NoSymbol;
+    }
+}
+
+// Final bytes shared by CSI and SS3 (ESC O) key sequences
+static KeySym finalKey(char final) {
+    switch (final) {
+        case 'A': return XK_Up;
+        case 'B': return XK_Down;
+        case 'C': return XK_Right;
+        case 'D': return XK_Left;
+        case 'H': return XK_Home;
+        case 'F': return XK_End;
+        case 'P': return XK_F1;
+        case 'Q': return XK_F2;
+        case 'R': return XK_F3;
+        case 'S': return XK_F4;
+        default: return NoSymbol;
+    }
+}
+
+// The keymap of our Xvfb never changes, so the keysyms we send are looked up once
+void InputHandler::initKeycodes() {
+    for (int i = 0; i < 256; i++) {
+        latin_keycodes[i] = display ? XKeysymToKeycode(display, (KeySym)i) : 0;
+        function_keycodes[i] = display ? XKeysymToKeycode(display, (KeySym)(0xFF00 | i)) : 0;
+    }
+}
+
+KeyCode InputHandler::keycodeFor(KeySym ks) {
+    if (ks < 0x100) return latin_keycodes[ks];
+    if ((ks & ~0xFFul) == 0xFF00) return function_keycodes[ks & 0xFF];
+    return XKeysymToKeycode(display, ks);
 }
 
 bool InputHandler::init(const char* display_name, Window win,
                        int win_w, int win_h, int t_cols, int t_lines) {
-    display = XOpenDisplay(display_name);
-    if (!display) return false;
+    if (escape_fd < 0) escape_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    
+    if (!sink) {
+        display = XOpenDisplay(display_name);
+        if (!display) return false;
+    }
     
     target_window = win;
     window_width = win_w;
@@ -109,7 +152,7 @@ bool InputHandler::init(const char* display_name, Window win,
     term_cols = t_cols;
     term_lines = t_lines;
     
-    initKeyMappings();
+    initKeycodes();
     
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
@@ -118,224 +161,376 @@ bool InputHandler::init(const char* display_name, Window win,
     return true;
 }
 
+void InputHandler::sendKey(KeySym ks, bool press) {
+    if (view_only) return;
+    sendPendingMotion();
+    if (sink) {
+        sink->key(ks, press);
+        return;
+    }
+    if (!display) return;
+    KeyCode kc = keycodeFor(ks);
+    if (kc != 0) XTestFakeKeyEvent(display, kc, press, 0);
+}
+
+void InputHandler::sendButton(int xbutton, bool press) {
+    if (view_only) return;
+    sendPendingMotion();
+    if (sink) sink->button(xbutton, press);
+    else if (display) XTestFakeButtonEvent(display, xbutton, press, 0);
+}
+
+void InputHandler::sendMotion(int x, int y) {
+    if (view_only || (x == sent_x && y == sent_y)) return;
+    if (sink) sink->motion(x, y);
+    else if (display) XTestFakeMotionEvent(display, -1, x, y, 0);
+    sent_x = x;
+    sent_y = y;
+}
+
+void InputHandler::queueMotion(int x, int y) {
+    motion_pending = true;
+    motion_x = x;
+    motion_y = y;
+}
+
+void InputHandler::sendPendingMotion() {
+    if (!motion_pending) return;
+    motion_pending = false;
+    sendMotion(motion_x, motion_y);
+}
+
+void InputHandler::flushEvents() {
+    flush_pending = true;
+}
+
+// Everything parsed from one read goes to the server in a single flush
+void InputHandler::endBatch() {
+    sendPendingMotion();
+    if (flush_pending) {
+        if (sink) sink->flush();
+        else if (display) XFlush(display);
+        flush_pending = false;
+        if (trace) trace->inputSent(read_stamp ? read_stamp : LatencyTrace::now());
+    }
+    // Someone else may move the pointer between batches
+    sent_x = sent_y = -1;
+    
+    // Pointer moves produce no damage; wake the capture loop to redraw the cursor
+    if (wake_target) {
+        wake_target->invalidate();
+        wake_target = nullptr;
+    }
+}
+
+void InputHandler::sendKeyWithMods(KeySym ks, int mods) {
+    if (mods & MOD_SHIFT) sendKey(XK_Shift_L, true);
+    if (mods & MOD_CTRL) sendKey(XK_Control_L, true);
+    if (mods & MOD_ALT) sendKey(XK_Alt_L, true);
+    
+    sendKey(ks, true);
+    sendKey(ks, false);
+    
+    if (mods & MOD_ALT) sendKey(XK_Alt_L, false);
+    if (mods & MOD_CTRL) sendKey(XK_Control_L, false);
+    if (mods & MOD_SHIFT) sendKey(XK_Shift_L, false);
+    
+    flushEvents();
+}
+
+void InputHandler::typeByte(unsigned char c, int mods) {
+    if (c >= 128) return;
+    const ByteKey& key = byte_keys[c];
+    if (key.ks != NoSymbol) sendKeyWithMods(key.ks, key.mods | mods);
+}
+
 void InputHandler::processInput() {
-    char buf[256];
+    char buf[4096];
     int n = read(STDIN_FILENO, buf, sizeof(buf));
     
     if (n <= 0) return;
-    
-    int pos = 0;
-    while (pos < n) {
-        int consumed = 0;
-         if (buf[pos] == '\033') {
-            if (parseEscapeSequence(buf + pos, n - pos, consumed) ||
-                parseSGRMouse(buf + pos, n - pos, consumed)) {
-                pos += consumed;
-                continue;
-            }
-        }
-        
-        
-        // Ctrl+\ (0x1C) - exit mirrors application
-        if (buf[pos] == 0x1C) {
-            std::cerr << "Ctrl+\\ detected, exiting" << std::endl;
-            kill(getpid(), SIGTERM);
-            return;
-        }
-        
-        bool handled = false;
+    if (trace) read_stamp = LatencyTrace::now();
+    processBytes(buf, n);
+    read_stamp = 0;
+}
+
+// One pass over the bytes with no lookahead: each byte either completes a
+// key, or advances the sequence state, which survives to the next call.
+void InputHandler::processBytes(const char* buf, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned char c = buf[i];
         
-        std::string single_char(1, buf[pos]);
-        auto it = key_mapping.find(single_char);
-        if (it != key_mapping.end()) {
-             KeyCode kc = XKeysymToKeycode(display, it->second);
-             if (kc != 0) {
-                 XTestFakeKeyEvent(display, kc, True, 0);
-                 XTestFakeKeyEvent(display, kc, False, 0);
-                 XFlush(display);
-             }
-             handled = true;
-        } else if (buf[pos] > 0 && buf[pos] <= 26) {
+        switch (parse_state) {
+        case PARSE_GROUND:
+            if (c == 0x1B) {
+                parse_state = PARSE_ESCAPE;
+            } else if (c == 0x1C && allow_quit) {
+                // Ctrl+\ (0x1C) - exit mirrors application
+                std::cerr << "Ctrl+\\ detected, exiting" << std::endl;
+                endBatch();
+                kill(getpid(), SIGTERM);
+                return;
+            } else {
+                typeByte(c, 0);
+            }
+            break;
             
-            KeySym ks = XK_a + (buf[pos] - 1);
-            KeyCode kc = XKeysymToKeycode(display, ks);
-            KeyCode ctrl_l = XKeysymToKeycode(display, XK_Control_L);
+        case PARSE_ESCAPE:
+            if (c == '[') {
+                beginSequence();
+                parse_state = PARSE_CSI;
+            } else if (c == 'O') {
+                parse_state = PARSE_SS3;
+            } else if (c == 0x1B) {
+                sendKeyWithMods(XK_Escape, 0);
+            } else if (c == 0x1C) {
+                sendKeyWithMods(XK_Escape, 0);
+                parse_state = PARSE_GROUND;
+                i--;
+            } else {
+                // ESC before a key is how terminals send Alt
+                typeByte(c, MOD_ALT);
+                parse_state = PARSE_GROUND;
+            }
+            break;
             
-            if (kc != 0) {
-                XTestFakeKeyEvent(display, ctrl_l, True, 0);
-                XTestFakeKeyEvent(display, kc, True, 0);
-                XTestFakeKeyEvent(display, kc, False, 0);
-                XTestFakeKeyEvent(display, ctrl_l, False, 0);
-                XFlush(display);
+        case PARSE_SS3:
+            parse_state = PARSE_GROUND;
+            if (c >= 0x40 && c <= 0x7E) {
+                dispatchSs3(c);
+            } else {
+                // Not a sequence after all: Alt+O, then this byte on its own
+                typeByte('O', MOD_ALT);
+                i--;
             }
-            handled = true;
-        }
-        
-        if (!handled) {
+            break;
             
-            char c = buf[pos];
-            KeySym ks = NoSymbol;
-            KeyCode kc = 0;
-            bool need_shift = false;
+        case PARSE_CSI:
+            csiByte(c);
+            break;
             
+        case PARSE_PASTE:
+            if (paste_match == 0 && c != 0x1B) {
+                // Copy the run up to the next ESC in one go
+                const char* esc = (const char*)memchr(buf + i, 0x1B, n - i);
+                int end = esc ? (int)(esc - buf) : n;
+                appendPaste(buf + i, end - i);
+                i = end - 1;
+            } else {
+                pasteByte(c);
+            }
+            break;
+        }
+    }
+    endBatch();
+    armEscapeTimeout();
+}
 
-            if (c >= 32 && c <= 126) {
-
-                switch (c) {
-                    case '!': ks = XK_1; need_shift = true; break;
-                    case '@': ks = XK_2; need_shift = true; break;
-                    case '#': ks = XK_3; need_shift = true; break;
-                    case '$': ks = XK_4; need_shift = true; break;
-                    case '%': ks = XK_5; need_shift = true; break;
-                    case '^': ks = XK_6; need_shift = true; break;
-                    case '&': ks = XK_7; need_shift = true; break;
-                    case '*': ks = XK_8; need_shift = true; break;
-                    case '(': ks = XK_9; need_shift = true; break;
-                    case ')': ks = XK_0; need_shift = true; break;
-                    
-
-                    case '_': ks = XK_minus; need_shift = true; break;
-                    case '+': ks = XK_equal; need_shift = true; break;
-                    case '{': ks = XK_bracketleft; need_shift = true; break;
-                    case '}': ks = XK_bracketright; need_shift = true; break;
-                    case '|': ks = XK_backslash; need_shift = true; break;
-                    case ':': ks = XK_semicolon; need_shift = true; break;
-                    case '"': ks = XK_apostrophe; need_shift = true; break;
-                    case '<': ks = XK_comma; need_shift = true; break;
-                    case '>': ks = XK_period; need_shift = true; break;
-                    case '?': ks = XK_slash; need_shift = true; break;
-                    case '~': ks = XK_grave; need_shift = true; break;
-                    
+bool InputHandler::sequencePending() const {
+    return parse_state == PARSE_ESCAPE || parse_state == PARSE_SS3 ||
+           (parse_state == PARSE_CSI && seq_len == 0);
+}
 
-                    case 'A'...'Z':
-                        ks = XK_a + (c - 'A');
-                        need_shift = true;
-                        break;
-                    
+// Restarted by every batch that ends mid-sequence, disarmed by one that
+// doesn't. Without a timer the sequence is resolved right away.
+void InputHandler::armEscapeTimeout() {
+    bool pending = sequencePending();
+    if (escape_fd < 0) {
+        if (pending) flushPending();
+        return;
+    }
+    if (!pending && !escape_armed) return;
+    
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (pending) spec.it_value.tv_nsec = ESCAPE_TIMEOUT_MS * 1000000L;
+    timerfd_settime(escape_fd, 0, &spec, nullptr);
+    escape_armed = pending;
+}
 
-                    case 'a'...'z':
-                        ks = XK_a + (c - 'a');
-                        break;
-                    
+void InputHandler::escapeTimeout() {
+    uint64_t expirations;
+    if (read(escape_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    escape_armed = false;
+    flushPending();
+}
 
-                    case '0'...'9':
-                        ks = XK_0 + (c - '0');
-                        break;
-                    
+void InputHandler::flushPending() {
+    if (parse_state == PARSE_ESCAPE) {
+        sendKeyWithMods(XK_Escape, 0);
+    } else if (parse_state == PARSE_SS3) {
+        typeByte('O', MOD_ALT);
+    } else if (parse_state == PARSE_CSI && seq_len == 0) {
+        typeByte('[', MOD_ALT);
+    } else {
+        return;
+    }
+    parse_state = PARSE_GROUND;
+    endBatch();
+}
 
-                    case ' ': ks = XK_space; break;
-                    case '-': ks = XK_minus; break;
-                    case '=': ks = XK_equal; break;
-                    case '[': ks = XK_bracketleft; break;
-                    case ']': ks = XK_bracketright; break;
-                    case '\\': ks = XK_backslash; break;
-                    case ';': ks = XK_semicolon; break;
-                    case '\'': ks = XK_apostrophe; break;
-                    case ',': ks = XK_comma; break;
-                    case '.': ks = XK_period; break;
-                    case '/': ks = XK_slash; break;
-                    case '`': ks = XK_grave; break;
-                    
-                    default:
+void InputHandler::beginSequence() {
+    seq_nparams = 0;
+    seq_len = 0;
+    seq_marker = 0;
+    seq_intermediate = false;
+    seq_subparam = false;
+    for (int i = 0; i < MAX_PARAMS; i++) seq_params[i] = 0;
+}
 
-                        break;
-                }
-                
-                if (ks != NoSymbol) {
-                    kc = XKeysymToKeycode(display, ks);
-                }
-            }
-            
-            if (kc != 0) {
-                KeyCode shift_l = XKeysymToKeycode(display, XK_Shift_L);
-                
-                if (need_shift) XTestFakeKeyEvent(display, shift_l, True, 0);
-                XTestFakeKeyEvent(display, kc, True, 0);
-                XTestFakeKeyEvent(display, kc, False, 0);
-                if (need_shift) XTestFakeKeyEvent(display, shift_l, False, 0);
-                
-                XFlush(display);
-            }
-        }
-        
-        pos++;
+// Parameters are accumulated as they arrive; ':' sub-parameters are skipped
+void InputHandler::csiByte(unsigned char c) {
+    if (++seq_len > 64) {
+        parse_state = PARSE_GROUND;
+        return;
+    }
+    
+    if (c >= '0' && c <= '9') {
+        if (seq_nparams == 0) seq_nparams = 1;
+        int& param = seq_params[seq_nparams - 1];
+        if (!seq_subparam && param < 100000) param = param * 10 + (c - '0');
+    } else if (c == ';') {
+        if (seq_nparams == 0) seq_nparams = 1;
+        if (seq_nparams < MAX_PARAMS) seq_params[seq_nparams++] = 0;
+        seq_subparam = false;
+    } else if (c == ':') {
+        seq_subparam = true;
+    } else if (c >= 0x3C && c <= 0x3F) {
+        if (seq_len == 1) seq_marker = c;
+        else seq_intermediate = true;
+    } else if (c >= 0x20 && c <= 0x2F) {
+        seq_intermediate = true;
+    } else if (c >= 0x40 && c <= 0x7E) {
+        parse_state = PARSE_GROUND;
+        dispatchCsi((char)c);
+    } else {
+        // A control byte cannot be part of a sequence; drop what we have
+        parse_state = PARSE_GROUND;
     }
 }
 
-bool InputHandler::parseEscapeSequence(const char* buf, int len, int& consumed) {
-
-    for (int i = std::min(len, 10); i >= 2; --i) {
-        std::string seq(buf, i);
-        auto it = key_mapping.find(seq);
-        if (it != key_mapping.end()) {
-            KeyCode kc = XKeysymToKeycode(display, it->second);
-            if (kc != 0) {
-                bool shift = (seq.find(";2") != std::string::npos) || 
-                             (seq.find(";4") != std::string::npos) ||
-                             (seq.find(";6") != std::string::npos) ||
-                             (seq.find(";8") != std::string::npos);
-                             
-                bool ctrl = (seq.find(";5") != std::string::npos) || 
-                            (seq.find(";6") != std::string::npos) ||
-                            (seq.find(";7") != std::string::npos) ||
-                            (seq.find(";8") != std::string::npos);
-                            
-                bool alt = (seq.find(";3") != std::string::npos) || 
-                           (seq.find(";4") != std::string::npos) ||
-                           (seq.find(";7") != std::string::npos) ||
-                           (seq.find(";8") != std::string::npos);
-
-                if (seq == "\033[a" || seq == "\033[b" || seq == "\033[c" || seq == "\033[d") {
-                    shift = true;
-                }
-                
-                KeyCode shift_l = XKeysymToKeycode(display, XK_Shift_L);
-                KeyCode ctrl_l = XKeysymToKeycode(display, XK_Control_L);
-                KeyCode alt_l = XKeysymToKeycode(display, XK_Alt_L);
-                
-                if (shift) XTestFakeKeyEvent(display, shift_l, True, 0);
-                if (ctrl) XTestFakeKeyEvent(display, ctrl_l, True, 0);
-                if (alt) XTestFakeKeyEvent(display, alt_l, True, 0);
-                
-                XTestFakeKeyEvent(display, kc, True, 0);
-                XTestFakeKeyEvent(display, kc, False, 0);
-                
-                if (alt) XTestFakeKeyEvent(display, alt_l, False, 0);
-                if (ctrl) XTestFakeKeyEvent(display, ctrl_l, False, 0);
-                if (shift) XTestFakeKeyEvent(display, shift_l, False, 0);
-                
-                XFlush(display);
-            }
-            consumed = i;
-            return true;
+void InputHandler::dispatchCsi(char final) {
+    if (seq_marker == '<') {
+        if ((final == 'M' || final == 'm') && seq_nparams >= 3) {
+            handleMouse(seq_params[0], seq_params[1], seq_params[2], final);
         }
+        return;
     }
-    return false;
-}
-
-bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
-    if (len < 9 || buf[0] != '\033' || buf[1] != '[' || buf[2] != '<') {
-        return false;
+    if (seq_marker || seq_intermediate) return;
+    
+    if (final == '~' && seq_params[0] == 200) {
+        parse_state = PARSE_PASTE;
+        paste_match = 0;
+        paste_buffer.clear();
+        return;
     }
     
-    int button, x, y;
-    char event_type;
-    int parsed = sscanf(buf + 3, "%d;%d;%d%c", &button, &x, &y, &event_type);
+    int mods = seq_nparams >= 2 && seq_params[1] > 1 ? (seq_params[1] - 1) & 7 : 0;
+    KeySym ks = NoSymbol;
     
-    if (parsed != 4 || (event_type != 'M' && event_type != 'm')) {
-        return false;
+    if (final == '~') {
+        ks = tildeKey(seq_params[0]);
+    } else if (final == 'u') {
+        // CSI codepoint ; modifiers u
+        if (seq_params[0] < 128) {
+            const ByteKey& key = byte_keys[seq_params[0]];
+            ks = key.ks;
+            mods |= key.mods;
+        }
+    } else if (final == 'Z') {
+        ks = XK_ISO_Left_Tab;
+    } else if (final >= 'a' && final <= 'd') {
+        // rxvt's shifted arrows
+        ks = finalKey(final - 'a' + 'A');
+        mods |= MOD_SHIFT;
+    } else {
+        ks = finalKey(final);
     }
     
+    if (ks != NoSymbol) sendKeyWithMods(ks, mods);
+}
+
+void InputHandler::dispatchSs3(char final) {
+    KeySym ks = finalKey(final);
+    if (ks != NoSymbol) sendKeyWithMods(ks, 0);
+}
+
+// Matches the end marker as bytes arrive; a partial match that breaks off
+// was text after all
+void InputHandler::pasteByte(unsigned char c) {
+    static const char paste_end[] = "\033[201~";
+    if (c == (unsigned char)paste_end[paste_match]) {
+        if (++paste_match == 6) {
+            paste_match = 0;
+            parse_state = PARSE_GROUND;
+            deliverPaste();
+        }
+        return;
+    }
+    if (paste_match) {
+        appendPaste(paste_end, paste_match);
+        paste_match = 0;
+        if (c == 0x1B) {
+            paste_match = 1;
+            return;
+        }
+    }
+    appendPaste((const char*)&c, 1);
+}
 
-    const char* end = strchr(buf + 3, event_type);
-    if (!end) return false;
-    consumed = (end - buf) + 1;
+void InputHandler::appendPaste(const char* data, size_t n) {
+    const size_t max_paste = 64 * 1024 * 1024;
+    if (paste_buffer.size() + n > max_paste) n = max_paste - paste_buffer.size();
+    paste_buffer.append(data, n);
+}
+
+void InputHandler::deliverPaste() {
+    std::string text;
+    text.swap(paste_buffer);
+    if (view_only) return;
+    
+    if (paste_key != PASTE_TYPE && selection) {
+        // Terminals turn newlines into CR for pastes; apps want them back
+        size_t out = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\r') {
+                text[out++] = '\n';
+                if (i + 1 < text.size() && text[i + 1] == '\n') i++;
+            } else {
+                text[out++] = text[i];
+            }
+        }
+        text.resize(out);
+        
+        if (selection->own(text)) {
+            if (paste_key == PASTE_SHIFT_INSERT) sendKeyWithMods(XK_Insert, MOD_SHIFT);
+            else if (paste_key == PASTE_CTRL_SHIFT_V) sendKeyWithMods(XK_v, MOD_CTRL | MOD_SHIFT);
+            else sendKeyWithMods(XK_v, MOD_CTRL);
+            return;
+        }
+    }
     
+    for (char ch : text) typeByte((unsigned char)ch, 0);
+}
 
+// SGR mouse report: CSI < button ; x ; y M (press, drag, motion) or m (release)
+void InputHandler::handleMouse(int button, int x, int y, char event_type) {
     int win_x, win_y;
+    int col = x - 1, row = y - 1;
+    ANSIRenderer* target = renderer;
+    
+    if (!panes.empty()) {
+        // Drags and pans stay with the pane they started in
+        bool held = button_state != 0 || potential_pan || panning_active;
+        if (!held || !pane_grab) pane_grab = paneAt(col, row);
+        target = pane_grab;
+        if (!target) return;
+        col -= target->getPlaceCol();
+        row -= target->getPlaceRow();
+    }
     
-    if (renderer) {
-        renderer->mapTermToImage(x - 1, y - 1, win_x, win_y);
+    if (target) {
+        target->mapTermToImage(col, row, win_x, win_y);
     } else {
         float scale_x = (float)window_width / term_cols;
         float scale_y = (float)window_height / term_lines;
@@ -351,19 +546,13 @@ bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
         int wheel_code = button & 3;
         bool ctrl_held = (button & 16) != 0;
         
-        if (ctrl_held && renderer) {
-
-            static float current_zoom = 1.0f;
+        if (ctrl_held && target) {
             if (wheel_code == 0) {
-                current_zoom += 0.5f;
-                if (current_zoom > 10.0f) current_zoom = 10.0f;
-                renderer->setZoom(current_zoom, x - 1, y - 1);
+                target->setZoom(target->getZoom() + 0.5f, col, row);
             } else if (wheel_code == 1) {
-                current_zoom -= 0.5f;
-                if (current_zoom < 1.0f) current_zoom = 1.0f;
-                renderer->setZoom(current_zoom, x - 1, y - 1);
+                target->setZoom(target->getZoom() - 0.5f, col, row);
             }
-            return true;
+            return;
         }
         
         if (wheel_code == 0) xbutton = 4;
@@ -376,7 +565,7 @@ bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
         is_motion = (button & 64) == 0 && btn_code == 3 && event_type == 'M';
         bool ctrl_held = (button & 16) != 0;
         
-        if (ctrl_held && btn_code == 0 && renderer) {
+        if (ctrl_held && btn_code == 0 && target) {
             if (event_type == 'M') {
                 if (!is_drag) {
                     potential_pan = true;
@@ -385,7 +574,7 @@ bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
                     pan_start_y = y;
                     last_mouse_x = x;
                     last_mouse_y = y;
-                    return true;
+                    return;
                 } else {
                     if (potential_pan) {
                         if (x != pan_start_x || y != pan_start_y) {
@@ -397,28 +586,27 @@ bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
                         int dx = x - last_mouse_x;
                         int dy = y - last_mouse_y;
                         if (dx != 0 || dy != 0) {
-                            renderer->moveViewport(-dx, -dy);
+                            target->moveViewport(-dx, -dy);
                         }
                         last_mouse_x = x;
                         last_mouse_y = y;
-                        return true;
+                        return;
                     }
                 }
             } else {
                 if (panning_active) {
                     panning_active = false;
                     potential_pan = false;
-                    return true;
+                    return;
                 } else if (potential_pan) {
                     potential_pan = false;
                     
-                    KeyCode ctrl_l = XKeysymToKeycode(display, XK_Control_L);
-                    XTestFakeKeyEvent(display, ctrl_l, True, 0);
-                    XTestFakeButtonEvent(display, 1, True, 0);
-                    XTestFakeButtonEvent(display, 1, False, 0);
-                    XTestFakeKeyEvent(display, ctrl_l, False, 0);
-                    XFlush(display);
-                    return true;
+                    sendKey(XK_Control_L, true);
+                    sendButton(1, true);
+                    sendButton(1, false);
+                    sendKey(XK_Control_L, false);
+                    flushEvents();
+                    return;
                 }
             }
         }
@@ -435,28 +623,36 @@ bool InputHandler::parseSGRMouse(const char* buf, int len, int& consumed) {
     last_mouse_x = x;
     last_mouse_y = y;
     
-    XTestFakeMotionEvent(display, -1, win_x, win_y, 0);
+    queueMotion(win_x, win_y);
+    flushEvents();
     
     if (xbutton > 0) {
         if (xbutton >= 4 && xbutton <= 7) {
             if (event_type == 'M') {
-                XTestFakeButtonEvent(display, xbutton, True, 0);
-                XTestFakeButtonEvent(display, xbutton, False, 0);
+                sendButton(xbutton, true);
+                sendButton(xbutton, false);
             }
         } else {
             if (event_type == 'M') {
                 if (is_drag) {
                 } else {
-                    XTestFakeButtonEvent(display, xbutton, True, 0);
+                    sendButton(xbutton, true);
                 }
             } else {
-                XTestFakeButtonEvent(display, xbutton, False, 0);
+                sendButton(xbutton, false);
             }
         }
     }
     
-    XFlush(display);
-    return true;
+    flushEvents();
+    if (wake_on_motion && target) wake_target = target;
+}
+
+ANSIRenderer* InputHandler::paneAt(int col, int row) const {
+    for (ANSIRenderer* pane : panes) {
+        if (pane->coversCell(col, row)) return pane;
+    }
+    return nullptr;
 }
 
 void InputHandler::cleanup() {
@@ -464,4 +660,9 @@ void InputHandler::cleanup() {
         XCloseDisplay(display);
         display = nullptr;
     }
+    if (escape_fd >= 0) {
+        close(escape_fd);
+        escape_fd = -1;
+        escape_armed = false;
+    }
 }
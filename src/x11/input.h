@@ -2,12 +2,29 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/XTest.h>
 #include <cstdint>
-#include <unordered_map>
 #include <string>
+#include <vector>
 
 class ANSIRenderer;
+class SelectionOwner;
+class LatencyTrace;
+
+// Receives synthesized input in place of XTest, for servers that are not X
+class InputSink {
+public:
+    virtual ~InputSink() {}
+    virtual void key(KeySym ks, bool press) = 0;
+    virtual void button(int xbutton, bool press) = 0;
+    virtual void motion(int x, int y) = 0;
+    virtual void flush() = 0;
+};
 
 class InputHandler {
+public:
+    // What makes the app paste once the selection holds the text; TYPE
+    // sends the text key by key instead
+    enum PasteKey : uint8_t { PASTE_CTRL_V, PASTE_SHIFT_INSERT, PASTE_CTRL_SHIFT_V, PASTE_TYPE };
+    
 private:
     Display* display;
     Window target_window;
@@ -27,14 +44,73 @@ private:
     
     pid_t shell_pid;
     bool track_mouse_move;
+    bool wake_on_motion;
+    bool view_only;
+    bool allow_quit;
+    
+    // Escape sequence parser state, kept across reads so a sequence split
+    // between two of them still parses
+    enum ParseState : uint8_t { PARSE_GROUND, PARSE_ESCAPE, PARSE_CSI, PARSE_SS3, PARSE_PASTE };
+    static const int MAX_PARAMS = 4;
+    ParseState parse_state;
+    int seq_params[MAX_PARAMS];
+    int seq_nparams;
+    int seq_len;
+    char seq_marker;
+    bool seq_intermediate;
+    bool seq_subparam;
+    // A timerfd armed while a batch ends mid-sequence; if nothing follows in
+    // time the bytes so far were keys (a lone ESC is the Escape key)
+    int escape_fd;
+    bool escape_armed;
+    
+    // Bracketed paste: everything up to ESC [ 201 ~ is text, not keys
+    SelectionOwner* selection;
+    PasteKey paste_key;
+    std::string paste_buffer;
+    int paste_match;
+    
+    // Motion is held until something else is sent or the batch ends, so a
+    // burst of reports costs one motion event; the flush waits for the end
+    bool motion_pending;
+    int motion_x, motion_y;
+    int sent_x, sent_y;
+    bool flush_pending;
+    ANSIRenderer* wake_target;
+    
+    LatencyTrace* trace;
+    int64_t read_stamp;
     
-    std::unordered_map<std::string, unsigned int> key_mapping;
+    KeyCode latin_keycodes[256];
+    KeyCode function_keycodes[256];
     
     ANSIRenderer* renderer;
+    std::vector<ANSIRenderer*> panes;
+    ANSIRenderer* pane_grab;
+    InputSink* sink;
     
-    void initKeyMappings();
-    bool parseEscapeSequence(const char* buf, int len, int& consumed);
-    bool parseSGRMouse(const char* buf, int len, int& consumed);
+    void initKeycodes();
+    KeyCode keycodeFor(KeySym ks);
+    void sendKey(KeySym ks, bool press);
+    void sendKeyWithMods(KeySym ks, int mods);
+    void typeByte(unsigned char c, int mods);
+    void sendButton(int xbutton, bool press);
+    void sendMotion(int x, int y);
+    void queueMotion(int x, int y);
+    void sendPendingMotion();
+    void flushEvents();
+    void endBatch();
+    void beginSequence();
+    void csiByte(unsigned char c);
+    void dispatchCsi(char final);
+    void dispatchSs3(char final);
+    bool sequencePending() const;
+    void armEscapeTimeout();
+    void handleMouse(int button, int x, int y, char event_type);
+    void pasteByte(unsigned char c);
+    void appendPaste(const char* data, size_t n);
+    void deliverPaste();
+    ANSIRenderer* paneAt(int col, int row) const;
     
 public:
     InputHandler();
@@ -44,10 +120,27 @@ public:
               int win_w, int win_h, int t_cols, int t_lines);
     
     void setRenderer(ANSIRenderer* r) { renderer = r; }
+    // Placed renderers sharing the terminal; mouse events go to the one
+    // under the pointer, in its own coordinates
+    void setPanes(const std::vector<ANSIRenderer*>& p) { panes = p; pane_grab = nullptr; }
+    void setSink(InputSink* s) { sink = s; }
     void setShellPid(pid_t pid) { shell_pid = pid; }
     void setTrackMouseMove(bool track) { track_mouse_move = track; }
+    void setWakeOnMotion(bool wake) { wake_on_motion = wake; }
+    // Zoom and pan still apply, but nothing reaches the X server
+    void setViewOnly(bool only) { view_only = only; }
+    void setAllowQuit(bool allow) { allow_quit = allow; }
+    void setSelection(SelectionOwner* owner) { selection = owner; }
+    void setPasteKey(PasteKey key) { paste_key = key; }
+    void setLatencyTrace(LatencyTrace* t) { trace = t; }
     
     void processInput();
+    void processBytes(const char* buf, int n);
+    // Readable once the escape timeout runs out; call escapeTimeout() then
+    int getEscapeFd() const { return escape_fd; }
+    void escapeTimeout();
+    // Input went quiet: a lone ESC was the Escape key, not the start of a sequence
+    void flushPending();
     
     void updateTerminalSize(int cols, int lines) { term_cols = cols; term_lines = lines; }
     
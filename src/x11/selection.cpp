@@ -0,0 +1,119 @@
+#include "selection.h"
+#include <X11/Xatom.h>
+#include <algorithm>
+
+SelectionOwner::SelectionOwner()
+    : display(nullptr), window(0), clipboard(None), targets(None), utf8_string(None),
+      text_atom(None), incr(None), chunk_size(0) {
+}
+
+SelectionOwner::~SelectionOwner() {
+    cleanup();
+}
+
+bool SelectionOwner::init(const char* display_name) {
+    display = XOpenDisplay(display_name);
+    if (!display) return false;
+
+    window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, 0, 0);
+    clipboard = XInternAtom(display, "CLIPBOARD", False);
+    targets = XInternAtom(display, "TARGETS", False);
+    utf8_string = XInternAtom(display, "UTF8_STRING", False);
+    text_atom = XInternAtom(display, "TEXT", False);
+    incr = XInternAtom(display, "INCR", False);
+
+    // Whatever fits in one ChangeProperty request goes in one piece
+    long max_request = XExtendedMaxRequestSize(display);
+    if (max_request == 0) max_request = XMaxRequestSize(display);
+    chunk_size = (size_t)max_request * 4 - 1024;
+    return true;
+}
+
+bool SelectionOwner::own(const std::string& content) {
+    if (!display) return false;
+    text = content;
+    transfers.clear();
+
+    XSetSelectionOwner(display, clipboard, window, CurrentTime);
+    XSetSelectionOwner(display, XA_PRIMARY, window, CurrentTime);
+    bool owned = XGetSelectionOwner(display, clipboard) == window;
+    XFlush(display);
+    return owned;
+}
+
+void SelectionOwner::processEvents() {
+    if (!display) return;
+    while (XPending(display)) {
+        XEvent ev;
+        XNextEvent(display, &ev);
+        if (ev.type == SelectionRequest) answerRequest(ev.xselectionrequest);
+        else if (ev.type == PropertyNotify) continueTransfer(ev.xproperty);
+    }
+}
+
+void SelectionOwner::answerRequest(const XSelectionRequestEvent& req) {
+    XSelectionEvent reply = {};
+    reply.type = SelectionNotify;
+    reply.display = display;
+    reply.requestor = req.requestor;
+    reply.selection = req.selection;
+    reply.target = req.target;
+    reply.time = req.time;
+    reply.property = None;
+
+    // Obsolete clients leave the property out and mean the target
+    Atom property = req.property != None ? req.property : req.target;
+
+    if (req.target == targets) {
+        Atom list[] = { targets, utf8_string, text_atom, XA_STRING };
+        XChangeProperty(display, req.requestor, property, XA_ATOM, 32, PropModeReplace,
+                        (const unsigned char*)list, 4);
+        reply.property = property;
+    } else if (req.target == utf8_string || req.target == text_atom || req.target == XA_STRING) {
+        Atom type = req.target == text_atom ? utf8_string : req.target;
+        if (text.size() > chunk_size) {
+            // INCR: announce the size, then send a chunk each time the
+            // requestor deletes the property to ask for the next one
+            long total = (long)text.size();
+            XSelectInput(display, req.requestor, PropertyChangeMask);
+            XChangeProperty(display, req.requestor, property, incr, 32, PropModeReplace,
+                            (const unsigned char*)&total, 1);
+            transfers.push_back(Transfer{req.requestor, property, type, 0});
+        } else {
+            XChangeProperty(display, req.requestor, property, type, 8, PropModeReplace,
+                            (const unsigned char*)text.data(), (int)text.size());
+        }
+        reply.property = property;
+    }
+
+    XSendEvent(display, req.requestor, False, NoEventMask, (XEvent*)&reply);
+    XFlush(display);
+}
+
+void SelectionOwner::continueTransfer(const XPropertyEvent& ev) {
+    if (ev.state != PropertyDelete) return;
+    auto it = std::find_if(transfers.begin(), transfers.end(), [&](const Transfer& t) {
+        return t.requestor == ev.window && t.property == ev.atom;
+    });
+    if (it == transfers.end()) return;
+
+    // The last chunk is empty and ends the transfer
+    size_t n = std::min(chunk_size, text.size() - it->offset);
+    XChangeProperty(display, it->requestor, it->property, it->type, 8, PropModeReplace,
+                    (const unsigned char*)text.data() + it->offset, (int)n);
+    it->offset += n;
+    if (n == 0) {
+        XSelectInput(display, it->requestor, NoEventMask);
+        transfers.erase(it);
+    }
+    XFlush(display);
+}
+
+void SelectionOwner::cleanup() {
+    if (display) {
+        if (window) XDestroyWindow(display, window);
+        XCloseDisplay(display);
+        display = nullptr;
+        window = 0;
+    }
+}
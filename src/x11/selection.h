@@ -0,0 +1,42 @@
+#pragma once
+#include <X11/Xlib.h>
+#include <string>
+#include <vector>
+
+// Owns CLIPBOARD and PRIMARY in the mirrored session on behalf of the
+// terminal, so a paste reaches the app as one selection transfer instead of
+// a keystroke per character. Requests are answered from processEvents(),
+// which runs whenever the connection fd is readable; text larger than one
+// request goes out with the INCR protocol.
+class SelectionOwner {
+private:
+    Display* display;
+    Window window;
+    Atom clipboard, targets, utf8_string, text_atom, incr;
+    std::string text;
+    size_t chunk_size;
+
+    struct Transfer {
+        Window requestor;
+        Atom property;
+        Atom type;
+        size_t offset;
+    };
+    std::vector<Transfer> transfers;
+
+    void answerRequest(const XSelectionRequestEvent& req);
+    void continueTransfer(const XPropertyEvent& ev);
+
+public:
+    SelectionOwner();
+    ~SelectionOwner();
+
+    bool init(const char* display_name);
+    int getConnectionFd() const { return display ? ConnectionNumber(display) : -1; }
+
+    // Takes both selections with this text (UTF-8)
+    bool own(const std::string& content);
+    void processEvents();
+
+    void cleanup();
+};
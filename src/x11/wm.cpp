@@ -5,8 +5,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <vector>
+#include <chrono>
+#include <poll.h>
 #include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include <iostream>
 
@@ -19,27 +22,60 @@ const unsigned long COLOR_BORDER = 0x000000;
 const unsigned long COLOR_BTN_CLOSE = 0xFF5555; 
 const unsigned long COLOR_BTN_FULL = 0x55FF55; 
 
+enum Action { NONE, MOVE, RESIZE_L, RESIZE_R, RESIZE_T, RESIZE_B, RESIZE_TL, RESIZE_TR, RESIZE_BL, RESIZE_BR,
+              CLOSE, FULLSCREEN, ACTION_COUNT };
+
+// Buttons and resize handles are regions of the title bar and of a
+// HANDLE_SIZE margin the frame keeps around the app, not windows of their
+// own, so a client costs two windows. x and y place the frame; w and h are
+// the app's size.
 struct Client {
     Window window;
     Window frame;
     Window title_bar;
-    Window close_btn;
-    Window full_btn;
-    
-    Window resize_l, resize_r, resize_t, resize_b;
-    Window resize_bl, resize_br, resize_tl, resize_tr; 
+    std::string title;
     
     int x, y, w, h;
     bool fullscreen;
     int saved_x, saved_y, saved_w, saved_h;
+    
+    // The region whose cursor each window shows
+    Action title_hover, frame_hover;
+    
+    // Geometry the windows were last given
+    bool dirty;
+    int applied_w, applied_h;
 };
 
 Display* dpy;
 Window root;
-std::vector<Client*> clients;
+// Keyed by the client window, its frame and its title bar
+std::unordered_map<Window, Client*> clients;
 
 Atom wm_protocols;
 Atom wm_delete_window;
+Atom wm_state;
+
+// Shared by every client and made once
+GC title_gc;
+GC button_gc;
+XFontStruct* title_font;
+Cursor cursors[ACTION_COUNT];
+
+// Geometry changes wait here until the event queue is drained
+std::vector<Client*> dirty_clients;
+
+Action action = NONE;
+Client* active_client = nullptr;
+int start_x_root, start_y_root;
+int start_win_x, start_win_y, start_win_w, start_win_h;
+
+// Drags follow the pointer live, but only step this often; the latest
+// position waits in between
+const int DRAG_RATE = 30;
+bool drag_pending = false;
+int drag_x_root, drag_y_root;
+std::chrono::steady_clock::time_point last_drag_step;
 
 int OnXError(Display* d, XErrorEvent* e) {
     (void)d; (void)e;
@@ -47,14 +83,84 @@ int OnXError(Display* d, XErrorEvent* e) {
 }
 
 Client* find_client(Window w) {
-    for (auto c : clients) {
-        if (c->window == w || c->frame == w || c->title_bar == w || 
-            c->close_btn == w || c->full_btn == w ||
-            c->resize_l == w || c->resize_r == w || c->resize_t == w || c->resize_b == w ||
-            c->resize_bl == w || c->resize_br == w || c->resize_tl == w || c->resize_tr == w)
-            return c;
+    auto it = clients.find(w);
+    return it != clients.end() ? it->second : nullptr;
+}
+
+// Pointer events the app leaves unselected propagate up to the frame; only
+// those on the title bar or the frame border itself are ours
+Client* find_decoration(Window w, Window subwindow) {
+    Client* c = find_client(w);
+    if (!c || w == c->window || (w == c->frame && subwindow != None)) return nullptr;
+    return c;
+}
+
+void create_resources() {
+    title_gc = XCreateGC(dpy, root, 0, NULL);
+    XSetForeground(dpy, title_gc, COLOR_TITLE_TEXT);
+    title_font = XQueryFont(dpy, XGContextFromGC(title_gc));
+    
+    button_gc = XCreateGC(dpy, root, 0, NULL);
+    XSetForeground(dpy, button_gc, 0xFFFFFF);
+    XSetLineAttributes(dpy, button_gc, 2, LineSolid, CapButt, JoinMiter);
+    
+    const unsigned int shapes[ACTION_COUNT] = {
+        0, 0, XC_left_side, XC_right_side, XC_top_side, XC_bottom_side,
+        XC_top_left_corner, XC_top_right_corner, XC_bottom_left_corner, XC_bottom_right_corner, 0, 0
+    };
+    for (int i = 0; i < ACTION_COUNT; i++) {
+        cursors[i] = shapes[i] ? XCreateFontCursor(dpy, shapes[i]) : None;
+    }
+}
+
+void button_rects(Client* c, int& close_x, int& full_x, int& btn_y, int& btn_size) {
+    btn_size = TITLE_BAR_HEIGHT - 4;
+    int margin_right = 15;
+    int btn_gap = 3;
+    
+    close_x = c->w - margin_right - btn_size;
+    full_x = close_x - btn_gap - btn_size;
+    btn_y = 2;
+}
+
+// x and y are relative to w, the frame or its title bar, and are tested in
+// the frame's inside; the frame border lies outside it
+Action hit_test(Client* c, Window win, int x, int y) {
+    if (win == c->title_bar) x += HANDLE_SIZE;
+    int w = c->w + 2 * HANDLE_SIZE;
+    int h = c->h + TITLE_BAR_HEIGHT + HANDLE_SIZE;
+    int hs = HANDLE_SIZE;
+    
+    bool left = x < hs, right = x >= w - hs;
+    bool top = y < hs, bottom = y >= h - hs;
+    if (top && left) return RESIZE_TL;
+    if (top && right) return RESIZE_TR;
+    if (bottom && left) return RESIZE_BL;
+    if (bottom && right) return RESIZE_BR;
+    if (left) return RESIZE_L;
+    if (right) return RESIZE_R;
+    if (top) return RESIZE_T;
+    if (bottom) return RESIZE_B;
+    
+    if (y < TITLE_BAR_HEIGHT) {
+        int close_x, full_x, btn_y, btn_size;
+        button_rects(c, close_x, full_x, btn_y, btn_size);
+        x -= HANDLE_SIZE;
+        if (y >= btn_y && y < btn_y + btn_size) {
+            if (x >= close_x && x < close_x + btn_size) return CLOSE;
+            if (x >= full_x && x < full_x + btn_size) return FULLSCREEN;
+        }
+        return MOVE;
     }
-    return nullptr;
+    return NONE;
+}
+
+void update_cursor(Client* c, Window w, int x, int y) {
+    Action zone = hit_test(c, w, x, y);
+    Action& hover = w == c->title_bar ? c->title_hover : c->frame_hover;
+    if (zone == hover) return;
+    hover = zone;
+    XDefineCursor(dpy, w, cursors[zone]);
 }
 
 void send_configure_notify(Client* c) {
@@ -63,7 +169,7 @@ void send_configure_notify(Client* c) {
     ce.display = dpy;
     ce.event = c->window;
     ce.window = c->window;
-    ce.x = c->x;
+    ce.x = c->x + HANDLE_SIZE;
     ce.y = c->y + TITLE_BAR_HEIGHT;
     ce.width = c->w;
     ce.height = c->h;
@@ -74,86 +180,65 @@ void send_configure_notify(Client* c) {
 }
 
 void update_frame_extents(Client* c) {
-    int w = c->w;
-    int h = c->h + TITLE_BAR_HEIGHT;
-    int hs = HANDLE_SIZE;
-
-    XMoveResizeWindow(dpy, c->resize_l, 0, hs, hs, h - 2*hs);
-    XMoveResizeWindow(dpy, c->resize_r, w - hs, hs, hs, h - 2*hs);
-    XMoveResizeWindow(dpy, c->resize_t, hs, 0, w - 2*hs, hs);
-    XMoveResizeWindow(dpy, c->resize_b, hs, h - hs, w - 2*hs, hs);
-    
-    XMoveResizeWindow(dpy, c->resize_tl, 0, 0, hs, hs);
-    XMoveResizeWindow(dpy, c->resize_tr, w - hs, 0, hs, hs);
-    XMoveResizeWindow(dpy, c->resize_bl, 0, h - hs, hs, hs);
-    XMoveResizeWindow(dpy, c->resize_br, w - hs, h - hs, hs, hs);
-    
     XResizeWindow(dpy, c->title_bar, c->w, TITLE_BAR_HEIGHT);
-    
-    int btn_size = TITLE_BAR_HEIGHT - 4; 
-    int margin_right = 15;
-    int btn_gap = 3;
-    
-    int close_x = c->w - margin_right - btn_size;
-    int full_x = close_x - btn_gap - btn_size;
+}
 
-    XMoveWindow(dpy, c->close_btn, close_x, 2);
-    XMoveWindow(dpy, c->full_btn, full_x, 2);
+void mark_dirty(Client* c) {
+    if (c->dirty) return;
+    c->dirty = true;
+    dirty_clients.push_back(c);
 }
 
-void draw_button(Window btn, const char* type) {
-    XWindowAttributes attrs;
-    XGetWindowAttributes(dpy, btn, &attrs);
-    int w = attrs.width;
-    int h = attrs.height;
-    
-    XClearWindow(dpy, btn);
-    
-    GC gc = XCreateGC(dpy, btn, 0, NULL);
-    XSetForeground(dpy, gc, 0xFFFFFF); 
-    XSetLineAttributes(dpy, gc, 2, LineSolid, CapButt, JoinMiter);
-
-    if (strcmp(type, "close") == 0) {
-        XDrawLine(dpy, btn, gc, 2, 2, w-3, h-3);
-        XDrawLine(dpy, btn, gc, w-3, 2, 2, h-3);
-    } else if (strcmp(type, "full") == 0) {
-        XDrawRectangle(dpy, btn, gc, 2, 2, w-5, h-5);
+// A move alone leaves the app and the title bar alone and only needs the
+// synthetic ConfigureNotify
+void apply_geometry(Client* c) {
+    XMoveResizeWindow(dpy, c->frame, c->x, c->y, c->w + 2 * HANDLE_SIZE, c->h + TITLE_BAR_HEIGHT + HANDLE_SIZE);
+    if (c->w != c->applied_w || c->h != c->applied_h) {
+        XResizeWindow(dpy, c->window, c->w, c->h);
+        update_frame_extents(c);
+        c->applied_w = c->w;
+        c->applied_h = c->h;
+    }
+    send_configure_notify(c);
+}
+
+void flush_geometry() {
+    if (dirty_clients.empty()) return;
+    for (Client* c : dirty_clients) {
+        apply_geometry(c);
+        c->dirty = false;
+    }
+    dirty_clients.clear();
+    XFlush(dpy);
+}
+
+void fetch_title(Client* c) {
+    char* name = NULL;
+    c->title.clear();
+    if (XFetchName(dpy, c->window, &name) && name) {
+        c->title = name;
+        XFree(name);
     }
-    XFreeGC(dpy, gc);
 }
 
 void draw_title(Client* c) {
     XClearWindow(dpy, c->title_bar);
     
-    char* name = NULL;
-    if (XFetchName(dpy, c->window, &name) && name) {
-        GC gc = XCreateGC(dpy, c->title_bar, 0, NULL);
-        XSetForeground(dpy, gc, COLOR_TITLE_TEXT);
-        
-        int len = strlen(name);
-        XFontStruct* font = XQueryFont(dpy, XGContextFromGC(gc));
-        int text_width = 0;
-        if (font) {
-            text_width = XTextWidth(font, name, len);
-            XFreeFontInfo(NULL, font, 1); 
-        }
+    if (!c->title.empty()) {
+        int len = c->title.size();
+        int text_width = title_font ? XTextWidth(title_font, c->title.c_str(), len) : 0;
         
         int x = (c->w - text_width) / 2;
         if (x < 5) x = 5;
         
-        XDrawString(dpy, c->title_bar, gc, x, 16, name, len);
-        
-        XFree(name);
-        XFreeGC(dpy, gc);
+        XDrawString(dpy, c->title_bar, title_gc, x, 16, c->title.c_str(), len);
     }
-}
-
-Window create_handle(Window parent, Cursor cursor) {
-    Window w = XCreateWindow(dpy, parent, 0, 0, 1, 1, 0, CopyFromParent, InputOnly, CopyFromParent, 0, NULL);
-    XDefineCursor(dpy, w, cursor);
-    XSelectInput(dpy, w, ButtonPressMask | ButtonReleaseMask);
-    XMapWindow(dpy, w);
-    return w;
+    
+    int close_x, full_x, btn_y, s;
+    button_rects(c, close_x, full_x, btn_y, s);
+    XDrawLine(dpy, c->title_bar, button_gc, close_x + 2, btn_y + 2, close_x + s - 3, btn_y + s - 3);
+    XDrawLine(dpy, c->title_bar, button_gc, close_x + s - 3, btn_y + 2, close_x + 2, btn_y + s - 3);
+    XDrawRectangle(dpy, c->title_bar, button_gc, full_x + 2, btn_y + 2, s - 5, s - 5);
 }
 
 void frame_window(Window w) {
@@ -171,39 +256,38 @@ void frame_window(Window w) {
     
     c->saved_x = c->x; c->saved_y = c->y; 
     c->saved_w = c->w; c->saved_h = c->h;
-
-    c->frame = XCreateSimpleWindow(dpy, root, c->x, c->y, c->w, c->h + TITLE_BAR_HEIGHT, BORDER_WIDTH, COLOR_BORDER, 0xFFFFFF);
-    c->title_bar = XCreateSimpleWindow(dpy, c->frame, 0, 0, c->w, TITLE_BAR_HEIGHT, 0, COLOR_BORDER, COLOR_TITLE_BG);
-    
-    int btn_size = TITLE_BAR_HEIGHT - 4;
-    c->close_btn = XCreateSimpleWindow(dpy, c->title_bar, 0, 0, btn_size, btn_size, 0, COLOR_BORDER, COLOR_TITLE_BG);
-    c->full_btn = XCreateSimpleWindow(dpy, c->title_bar, 0, 0, btn_size, btn_size, 0, COLOR_BORDER, COLOR_TITLE_BG);
-
-    c->resize_l = create_handle(c->frame, XCreateFontCursor(dpy, XC_left_side));
-    c->resize_r = create_handle(c->frame, XCreateFontCursor(dpy, XC_right_side));
-    c->resize_t = create_handle(c->frame, XCreateFontCursor(dpy, XC_top_side));
-    c->resize_b = create_handle(c->frame, XCreateFontCursor(dpy, XC_bottom_side));
-    c->resize_tl = create_handle(c->frame, XCreateFontCursor(dpy, XC_top_left_corner));
-    c->resize_tr = create_handle(c->frame, XCreateFontCursor(dpy, XC_top_right_corner));
-    c->resize_bl = create_handle(c->frame, XCreateFontCursor(dpy, XC_bottom_left_corner));
-    c->resize_br = create_handle(c->frame, XCreateFontCursor(dpy, XC_bottom_right_corner));
-
-    XSelectInput(dpy, c->frame, SubstructureRedirectMask | SubstructureNotifyMask);
-    XSelectInput(dpy, c->title_bar, ButtonPressMask | ButtonReleaseMask | ExposureMask);
-    XSelectInput(dpy, c->close_btn, ButtonPressMask | ButtonReleaseMask | ExposureMask);
-    XSelectInput(dpy, c->full_btn, ButtonPressMask | ButtonReleaseMask | ExposureMask);
+    c->title_hover = c->frame_hover = NONE;
+    c->dirty = false;
+    c->applied_w = c->w;
+    c->applied_h = c->h;
+
+    // The margin left around the app is the frame's own, in the title bar's colour
+    c->frame = XCreateSimpleWindow(dpy, root, c->x, c->y, c->w + 2 * HANDLE_SIZE, c->h + TITLE_BAR_HEIGHT + HANDLE_SIZE,
+                                   BORDER_WIDTH, COLOR_BORDER, COLOR_TITLE_BG);
+    c->title_bar = XCreateSimpleWindow(dpy, c->frame, HANDLE_SIZE, 0, c->w, TITLE_BAR_HEIGHT, 0, COLOR_BORDER, COLOR_TITLE_BG);
+
+    // Presses on the frame can only land on its margin, the rest is covered
+    const long pointer = ButtonPressMask | ButtonReleaseMask | PointerMotionMask;
+    XSelectInput(dpy, c->frame, SubstructureRedirectMask | SubstructureNotifyMask | pointer);
+    XSelectInput(dpy, c->title_bar, pointer | ExposureMask);
+    XSelectInput(dpy, w, PropertyChangeMask);
+    // Click to focus: a press on the app is held until we have focused it,
+    // then replayed to the app
+    XGrabButton(dpy, AnyButton, AnyModifier, w, False, ButtonPressMask, GrabModeSync, GrabModeAsync, None, None);
+    fetch_title(c);
     
     XAddToSaveSet(dpy, w);
-    XReparentWindow(dpy, w, c->frame, 0, TITLE_BAR_HEIGHT);
+    XReparentWindow(dpy, w, c->frame, HANDLE_SIZE, TITLE_BAR_HEIGHT);
     XMapWindow(dpy, c->frame);
     XMapWindow(dpy, c->title_bar);
-    XMapWindow(dpy, c->close_btn);
-    XMapWindow(dpy, c->full_btn);
     XMapWindow(dpy, w);
-    
-    update_frame_extents(c);
+    // Marks w as the app inside the frame, for mirrors --window and xprop alike
+    long state[2] = {NormalState, None};
+    XChangeProperty(dpy, w, wm_state, wm_state, 32, PropModeReplace, (unsigned char*)state, 2);
 
-    clients.push_back(c);
+    clients[w] = c;
+    clients[c->frame] = c;
+    clients[c->title_bar] = c;
 }
 
 void unframe_window(Window w) {
@@ -211,19 +295,21 @@ void unframe_window(Window w) {
     if (!c) return;
 
     XUnmapWindow(dpy, c->frame);
-    XReparentWindow(dpy, c->window, root, c->x, c->y);
+    XUngrabButton(dpy, AnyButton, AnyModifier, c->window);
+    XReparentWindow(dpy, c->window, root, c->x + HANDLE_SIZE, c->y + TITLE_BAR_HEIGHT);
     XRemoveFromSaveSet(dpy, c->window);
     
-    XDestroyWindow(dpy, c->close_btn);
-    XDestroyWindow(dpy, c->full_btn);
-    XDestroyWindow(dpy, c->title_bar);
-    XDestroyWindow(dpy, c->resize_l); XDestroyWindow(dpy, c->resize_r);
-    XDestroyWindow(dpy, c->resize_t); XDestroyWindow(dpy, c->resize_b);
-    XDestroyWindow(dpy, c->resize_tl); XDestroyWindow(dpy, c->resize_tr);
-    XDestroyWindow(dpy, c->resize_bl); XDestroyWindow(dpy, c->resize_br);
     XDestroyWindow(dpy, c->frame);
 
-    clients.erase(std::remove(clients.begin(), clients.end(), c), clients.end());
+    if (c->dirty) dirty_clients.erase(std::remove(dirty_clients.begin(), dirty_clients.end(), c), dirty_clients.end());
+    if (active_client == c) {
+        action = NONE;
+        active_client = nullptr;
+        drag_pending = false;
+    }
+    clients.erase(c->window);
+    clients.erase(c->frame);
+    clients.erase(c->title_bar);
     delete c;
 }
 
@@ -234,8 +320,8 @@ void toggle_fullscreen(Client* c) {
         XGetWindowAttributes(dpy, root, &rattrs);
         
         c->x = 0; c->y = 0; 
-        c->w = rattrs.width; 
-        c->h = rattrs.height - TITLE_BAR_HEIGHT; 
+        c->w = rattrs.width - 2 * HANDLE_SIZE;
+        c->h = rattrs.height - TITLE_BAR_HEIGHT - HANDLE_SIZE;
         
         XSetWindowBorderWidth(dpy, c->frame, 0);
         c->fullscreen = true;
@@ -247,10 +333,7 @@ void toggle_fullscreen(Client* c) {
         c->fullscreen = false;
     }
     
-    XMoveResizeWindow(dpy, c->frame, c->x, c->y, c->w, c->h + TITLE_BAR_HEIGHT);
-    XResizeWindow(dpy, c->window, c->w, c->h);
-    update_frame_extents(c);
-    send_configure_notify(c);
+    mark_dirty(c);
     
     XRaiseWindow(dpy, c->frame);
     XSetInputFocus(dpy, c->window, RevertToPointerRoot, CurrentTime);
@@ -267,11 +350,31 @@ void close_window(Client* c) {
     XSendEvent(dpy, c->window, False, NoEventMask, &ev);
 }
 
-enum Action { NONE, MOVE, RESIZE_L, RESIZE_R, RESIZE_T, RESIZE_B, RESIZE_TL, RESIZE_TR, RESIZE_BL, RESIZE_BR };
-Action action = NONE;
-Client* active_client = nullptr;
-int start_x_root, start_y_root;
-int start_win_x, start_win_y, start_win_w, start_win_h;
+void drag_to(int x_root, int y_root) {
+    int dx = x_root - start_x_root;
+    int dy = y_root - start_y_root;
+    Client* c = active_client;
+    
+    if (action == MOVE) {
+        c->x = start_win_x + dx;
+        c->y = start_win_y + dy;
+    } else {
+        if (action == RESIZE_R || action == RESIZE_TR || action == RESIZE_BR) c->w = start_win_w + dx;
+        if (action == RESIZE_L || action == RESIZE_TL || action == RESIZE_BL) { c->x = start_win_x + dx; c->w = start_win_w - dx; }
+        if (action == RESIZE_B || action == RESIZE_BL || action == RESIZE_BR) c->h = start_win_h + dy;
+        if (action == RESIZE_T || action == RESIZE_TL || action == RESIZE_TR) { c->y = start_win_y + dy; c->h = start_win_h - dy; }
+        
+        if (c->w < 50) c->w = 50;
+        if (c->h < 50) c->h = 50;
+    }
+    mark_dirty(c);
+}
+
+int drag_wait_ms() {
+    auto due = last_drag_step + std::chrono::milliseconds(1000 / DRAG_RATE);
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()).count();
+    return left > 0 ? (int)left : 0;
+}
 
 int main() {
     if (!getenv("MIRRORS_INTERNAL")) {
@@ -285,8 +388,10 @@ int main() {
     root = DefaultRootWindow(dpy);
     wm_protocols = XInternAtom(dpy, "WM_PROTOCOLS", False);
     wm_delete_window = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
+    wm_state = XInternAtom(dpy, "WM_STATE", False);
 
     XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask);
+    create_resources();
 
     unsigned int nwins;
     Window d1, d2, *wins;
@@ -298,121 +403,136 @@ int main() {
     bool apps_opened = false;
     XEvent ev;
     while (true) {
-        XNextEvent(dpy, &ev);
-
-        if (ev.type == MapRequest) {
-            frame_window(ev.xmaprequest.window);
-            apps_opened = true;
+        // Sleep until the server has something, or until a held-back drag
+        // step comes due
+        if (!XPending(dpy)) {
+            struct pollfd pfd = {ConnectionNumber(dpy), POLLIN, 0};
+            poll(&pfd, 1, drag_pending ? drag_wait_ms() : -1);
         }
-        else if (ev.type == UnmapNotify) {
-            Client* c = find_client(ev.xunmap.window);
-            if (c && c->window == ev.xunmap.window) {
-                unframe_window(c->window);
-                if (apps_opened && clients.empty()) {
-                    return 0;
+        
+        // Everything already queued is handled before any geometry goes out,
+        // so a burst of requests or motion costs one configure per client
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+
+            if (ev.type == MapRequest) {
+                frame_window(ev.xmaprequest.window);
+                apps_opened = true;
+            }
+            else if (ev.type == UnmapNotify) {
+                Client* c = find_client(ev.xunmap.window);
+                if (c && c->window == ev.xunmap.window) {
+                    unframe_window(c->window);
+                    if (apps_opened && clients.empty()) {
+                        return 0;
+                    }
                 }
             }
-        }
-        else if (ev.type == DestroyNotify) {
-            Client* c = find_client(ev.xdestroywindow.window);
-            if (c && c->window == ev.xdestroywindow.window) {
-                unframe_window(c->window);
-                if (apps_opened && clients.empty()) {
-                    return 0;
+            else if (ev.type == DestroyNotify) {
+                Client* c = find_client(ev.xdestroywindow.window);
+                if (c && c->window == ev.xdestroywindow.window) {
+                    unframe_window(c->window);
+                    if (apps_opened && clients.empty()) {
+                        return 0;
+                    }
                 }
             }
-        }
-        else if (ev.type == ConfigureRequest) {
-            XConfigureRequestEvent& cre = ev.xconfigurerequest;
-            Client* c = find_client(cre.window);
-            if (c) {
-                if (c->fullscreen) {
-                    send_configure_notify(c);
+            else if (ev.type == ConfigureRequest) {
+                XConfigureRequestEvent& cre = ev.xconfigurerequest;
+                Client* c = find_client(cre.window);
+                if (c) {
+                    if (c->fullscreen) {
+                        send_configure_notify(c);
+                    } else {
+                        // Whoever configures the frame (mirrors placing a
+                        // pane) means its outer size; the app means its own.
+                        // Either way x and y place the frame's corner.
+                        bool outer = cre.window == c->frame;
+                        if (cre.value_mask & CWX) c->x = cre.x;
+                        if (cre.value_mask & CWY) c->y = cre.y;
+                        if (cre.value_mask & CWWidth) {
+                            c->w = std::max(1, cre.width - (outer ? 2 * HANDLE_SIZE : 0));
+                        }
+                        if (cre.value_mask & CWHeight) {
+                            c->h = std::max(1, cre.height - (outer ? TITLE_BAR_HEIGHT + HANDLE_SIZE : 0));
+                        }
+                        mark_dirty(c);
+                    }
                 } else {
-                    c->w = cre.width;
-                    c->h = cre.height;
-                    XMoveResizeWindow(dpy, c->frame, c->x, c->y, c->w, c->h + TITLE_BAR_HEIGHT);
-                    XResizeWindow(dpy, c->window, c->w, c->h);
-                    update_frame_extents(c);
+                    XWindowChanges wc;
+                    wc.x = cre.x; wc.y = cre.y; wc.width = cre.width; wc.height = cre.height;
+                    wc.border_width = cre.border_width; wc.sibling = cre.above; wc.stack_mode = cre.detail;
+                    XConfigureWindow(dpy, cre.window, cre.value_mask, &wc);
                 }
-            } else {
-                XWindowChanges wc;
-                wc.x = cre.x; wc.y = cre.y; wc.width = cre.width; wc.height = cre.height;
-                wc.border_width = cre.border_width; wc.sibling = cre.above; wc.stack_mode = cre.detail;
-                XConfigureWindow(dpy, cre.window, cre.value_mask, &wc);
             }
-        }
-        else if (ev.type == ButtonPress) {
-            if (ev.xbutton.button == 1) {
-                Client* c = find_client(ev.xbutton.window);
-                if (c) {
-                    active_client = c;
-                    start_x_root = ev.xbutton.x_root;
-                    start_y_root = ev.xbutton.y_root;
-                    start_win_x = c->x; start_win_y = c->y;
-                    start_win_w = c->w; start_win_h = c->h;
+            else if (ev.type == ButtonPress) {
+                Client* app = find_client(ev.xbutton.window);
+                if (app && ev.xbutton.window == app->window) {
+                    XRaiseWindow(dpy, app->frame);
+                    XSetInputFocus(dpy, app->window, RevertToPointerRoot, CurrentTime);
+                    XAllowEvents(dpy, ReplayPointer, CurrentTime);
+                }
+                else if (ev.xbutton.button == 1) {
+                    Client* c = find_decoration(ev.xbutton.window, ev.xbutton.subwindow);
+                    if (c) {
+                        active_client = c;
+                        start_x_root = ev.xbutton.x_root;
+                        start_y_root = ev.xbutton.y_root;
+                        start_win_x = c->x; start_win_y = c->y;
+                        start_win_w = c->w; start_win_h = c->h;
                     
-                    if (ev.xbutton.window == c->close_btn) close_window(c);
-                    else if (ev.xbutton.window == c->full_btn) toggle_fullscreen(c);
-                    else if (ev.xbutton.window == c->title_bar) action = MOVE;
-                    else if (ev.xbutton.window == c->resize_l) action = RESIZE_L;
-                    else if (ev.xbutton.window == c->resize_r) action = RESIZE_R;
-                    else if (ev.xbutton.window == c->resize_t) action = RESIZE_T;
-                    else if (ev.xbutton.window == c->resize_b) action = RESIZE_B;
-                    else if (ev.xbutton.window == c->resize_tl) action = RESIZE_TL;
-                    else if (ev.xbutton.window == c->resize_tr) action = RESIZE_TR;
-                    else if (ev.xbutton.window == c->resize_bl) action = RESIZE_BL;
-                    else if (ev.xbutton.window == c->resize_br) action = RESIZE_BR;
+                        Action hit = hit_test(c, ev.xbutton.window, ev.xbutton.x, ev.xbutton.y);
+                        if (hit == CLOSE) close_window(c);
+                        else if (hit == FULLSCREEN) toggle_fullscreen(c);
+                        else action = hit;
                     
-                    XRaiseWindow(dpy, c->frame);
-                    XSetInputFocus(dpy, c->window, RevertToPointerRoot, CurrentTime);
+                        XRaiseWindow(dpy, c->frame);
+                        XSetInputFocus(dpy, c->window, RevertToPointerRoot, CurrentTime);
+                    }
                 }
             }
-        }
-        else if (ev.type == ButtonRelease) {
-            if (ev.xbutton.button == 1 && action != NONE && active_client) {
-                int dx = ev.xbutton.x_root - start_x_root;
-                int dy = ev.xbutton.y_root - start_y_root;
-                Client* c = active_client;
-                
-                if (action == MOVE) {
-                    c->x = start_win_x + dx;
-                    c->y = start_win_y + dy;
-                } else {
-                    if (action == RESIZE_R || action == RESIZE_TR || action == RESIZE_BR) c->w = start_win_w + dx;
-                    if (action == RESIZE_L || action == RESIZE_TL || action == RESIZE_BL) { c->x = start_win_x + dx; c->w = start_win_w - dx; }
-                    if (action == RESIZE_B || action == RESIZE_BL || action == RESIZE_BR) c->h = start_win_h + dy;
-                    if (action == RESIZE_T || action == RESIZE_TL || action == RESIZE_TR) { c->y = start_win_y + dy; c->h = start_win_h - dy; }
-                    
-                    if (c->w < 50) c->w = 50;
-                    if (c->h < 50) c->h = 50;
+            else if (ev.type == ButtonRelease) {
+                if (ev.xbutton.button == 1 && action != NONE && active_client) {
+                    // The final position goes out now, whatever the rate cap
+                    drag_to(ev.xbutton.x_root, ev.xbutton.y_root);
+                    drag_pending = false;
+                    action = NONE;
+                    active_client = nullptr;
                 }
-                
-                XMoveResizeWindow(dpy, c->frame, c->x, c->y, c->w, c->h + TITLE_BAR_HEIGHT);
-                XResizeWindow(dpy, c->window, c->w, c->h);
-                update_frame_extents(c);
-                send_configure_notify(c);
-                
-                action = NONE;
-                active_client = nullptr;
             }
-        }
-        else if (ev.type == Expose) {
-            if (ev.xexpose.count == 0) {
-                Client* c = find_client(ev.xexpose.window);
-                if (c) {
-                    if (ev.xexpose.window == c->title_bar) draw_title(c);
-                    else if (ev.xexpose.window == c->close_btn) draw_button(c->close_btn, "close");
-                    else if (ev.xexpose.window == c->full_btn) draw_button(c->full_btn, "full");
+            else if (ev.type == MotionNotify) {
+                if (action != NONE && active_client) {
+                    drag_x_root = ev.xmotion.x_root;
+                    drag_y_root = ev.xmotion.y_root;
+                    drag_pending = true;
+                } else if (action == NONE) {
+                    Client* c = find_decoration(ev.xmotion.window, ev.xmotion.subwindow);
+                    if (c) update_cursor(c, ev.xmotion.window, ev.xmotion.x, ev.xmotion.y);
                 }
             }
-        }
-        else if (ev.type == PropertyNotify) {
-            if (ev.xproperty.atom == XA_WM_NAME) {
-                Client* c = find_client(ev.xproperty.window);
-                if (c) draw_title(c);
+            else if (ev.type == Expose) {
+                if (ev.xexpose.count == 0) {
+                    Client* c = find_client(ev.xexpose.window);
+                    if (c) draw_title(c);
+                }
+            }
+            else if (ev.type == PropertyNotify) {
+                if (ev.xproperty.atom == XA_WM_NAME) {
+                    Client* c = find_client(ev.xproperty.window);
+                    if (c) {
+                        fetch_title(c);
+                        draw_title(c);
+                    }
+                }
             }
         }
+        
+        if (drag_pending && drag_wait_ms() == 0) {
+            drag_to(drag_x_root, drag_y_root);
+            drag_pending = false;
+            last_drag_step = std::chrono::steady_clock::now();
+        }
+        flush_geometry();
     }
     return 0;
 }
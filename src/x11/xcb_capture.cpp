@@ -0,0 +1,273 @@
+#include "xcb_capture.h"
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+
+XCBCapturer::XCBCapturer()
+    : X11Capturer(), conn(nullptr), pipelined(false), front(-1),
+      image_pending(false), pending_slot(0),
+      pending_x1(0), pending_y1(0), pending_x2(0), pending_y2(0),
+      cursor_pending(false), pointer_pending(false) {
+    memset(slots, 0, sizeof(slots));
+    slots[0].shmid = slots[1].shmid = -1;
+    memset(&image_cookie, 0, sizeof(image_cookie));
+    memset(&cursor_cookie, 0, sizeof(cursor_cookie));
+    memset(&pointer_cookie, 0, sizeof(pointer_cookie));
+}
+
+XCBCapturer::~XCBCapturer() {
+    cleanup();
+}
+
+bool XCBCapturer::init(const char* display_name, Window target_window, int w, int h) {
+    cleanup();
+    
+    if (!X11Capturer::init(display_name, target_window, w, h)) return false;
+    
+    conn = XGetXCBConnection(display);
+    // Pipelined grabs need SHM; the framebuffer and XGetImage paths stay as they are
+    pipelined = conn && !fb_pixels && using_shm && ximage && syncSlots();
+    if (conn && !pipelined && using_shm && !fb_pixels) {
+        std::cerr << "Second capture buffer unavailable - grabs will not overlap rendering\n";
+    }
+    return true;
+}
+
+bool XCBCapturer::allocSlot(ShmSlot& slot, size_t size) {
+    uint32_t seg;
+    char* addr;
+    size_t map_size;
+    if (attachMemfdSegment(size, seg, addr, map_size)) {
+        slot.seg = seg;
+        slot.data = (uint8_t*)addr;
+        slot.size = size;
+        slot.map_size = map_size;
+        slot.owned = true;
+        slot.memfd = true;
+        slot.shmid = -1;
+        return true;
+    }
+    
+    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (shmid == -1) return false;
+    
+    void* shmaddr = shmat(shmid, nullptr, 0);
+    if (shmaddr == (void*)-1) {
+        shmctl(shmid, IPC_RMID, nullptr);
+        return false;
+    }
+    
+    seg = xcb_generate_id(conn);
+    xcb_generic_error_t* err = xcb_request_check(conn, xcb_shm_attach_checked(conn, seg, shmid, 0));
+    shmctl(shmid, IPC_RMID, nullptr);
+    if (err) {
+        free(err);
+        shmdt(shmaddr);
+        return false;
+    }
+    
+    slot.seg = seg;
+    slot.data = (uint8_t*)shmaddr;
+    slot.size = size;
+    slot.map_size = size;
+    slot.owned = true;
+    slot.memfd = false;
+    slot.shmid = shmid;
+    return true;
+}
+
+void XCBCapturer::freeSlot(ShmSlot& slot) {
+    if (slot.data && slot.owned) {
+        xcb_shm_detach(conn, slot.seg);
+        if (slot.memfd) munmap(slot.data, slot.map_size);
+        else shmdt(slot.data);
+    }
+    memset(&slot, 0, sizeof(slot));
+    slot.shmid = -1;
+}
+
+// The first buffer is the base class's own segment; only the second is ours.
+bool XCBCapturer::syncSlots() {
+    slots[0].seg = shminfo.shmseg;
+    slots[0].data = (uint8_t*)ximage->data;
+    slots[0].size = (size_t)ximage->bytes_per_line * ximage->height;
+    slots[0].map_size = slots[0].size;
+    slots[0].owned = false;
+    
+    if (slots[1].data && slots[1].size != slots[0].size) freeSlot(slots[1]);
+    if (!slots[1].data && !allocSlot(slots[1], slots[0].size)) return false;
+    
+    front = -1;
+    return true;
+}
+
+void XCBCapturer::requestImage(bool force) {
+    pending_slot = (front == 0) ? 1 : 0;
+    takeDamageRegion(force, pending_x1, pending_y1, pending_x2, pending_y2);
+    
+    Drawable source = composite_active ? window_pixmap : window;
+    image_cookie = xcb_shm_get_image(conn, source, 0, 0, width, height, ~0u,
+                                     XCB_IMAGE_FORMAT_Z_PIXMAP, slots[pending_slot].seg, 0);
+    image_pending = true;
+}
+
+// Asks only for what went stale: the image after a cursor notify (its reply
+// carries the position too), otherwise the position after pointer motion.
+void XCBCapturer::requestCursor() {
+    if (cursor_dirty && !cursor_pending) {
+        cursor_cookie = xcb_xfixes_get_cursor_image(conn);
+        cursor_pending = true;
+    } else if (pointer_dirty && !pointer_pending) {
+        pointer_cookie = xcb_query_pointer(conn, window);
+        pointer_pending = true;
+    }
+}
+
+void XCBCapturer::discardPending() {
+    if (image_pending) {
+        xcb_discard_reply(conn, image_cookie.sequence);
+        image_pending = false;
+    }
+    if (cursor_pending) {
+        xcb_discard_reply(conn, cursor_cookie.sequence);
+        cursor_pending = false;
+    }
+    if (pointer_pending) {
+        xcb_discard_reply(conn, pointer_cookie.sequence);
+        pointer_pending = false;
+    }
+}
+
+// Sends everything the coming frame needs in one go, so getCursor and
+// captureFrame only wait for replies that are already on their way.
+void XCBCapturer::beginFrame(bool want_cursor) {
+    if (!conn || !window) return;
+    
+    if (want_cursor) requestCursor();
+    
+    if (pipelined && !image_pending && pending_width == 0) {
+        bool force = false;
+        if (needsGrab(force)) requestImage(force);
+    }
+    
+    xcb_flush(conn);
+}
+
+uint8_t* XCBCapturer::captureFrame(bool force) {
+    if (!pipelined) return X11Capturer::captureFrame(force);
+    if (!display || !window) return nullptr;
+    
+    if (pending_width > 0) {
+        if (image_pending) {
+            xcb_discard_reply(conn, image_cookie.sequence);
+            image_pending = false;
+        }
+        applyPendingResize();
+        if (!using_shm || !ximage || !syncSlots()) {
+            pipelined = false;
+            return X11Capturer::captureFrame(true);
+        }
+        force = true;
+    }
+    
+    if (!image_pending) {
+        if (!needsGrab(force)) {
+            frame_changed = false;
+            return front >= 0 ? slots[front].data : nullptr;
+        }
+        requestImage(force);
+    }
+    
+    xcb_generic_error_t* err = nullptr;
+    xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(conn, image_cookie, &err);
+    image_pending = false;
+    if (!reply) {
+        free(err);
+        return nullptr;
+    }
+    free(reply);
+    
+    front = pending_slot;
+    frame_changed = updateTileHashes(slots[front].data, ximage->bytes_per_line,
+                                     pending_x1, pending_y1, pending_x2, pending_y2);
+    
+    // Damage that came in while this grab was in flight means another frame is
+    // already due; start it now so it overlaps rendering of this one.
+    bool next_force = false;
+    if (damage_available && pending_width == 0 && needsGrab(next_force)) {
+        requestImage(next_force);
+        xcb_flush(conn);
+    }
+    
+    return slots[front].data;
+}
+
+X11Capturer::CursorData XCBCapturer::getCursor() {
+    if (!conn) return X11Capturer::getCursor();
+    
+    CursorData data;
+    if (!window) return data;
+    if (!cursor_pending && !pointer_pending) requestCursor();
+    
+    if (cursor_pending) {
+        xcb_xfixes_get_cursor_image_reply_t* img =
+            xcb_xfixes_get_cursor_image_reply(conn, cursor_cookie, nullptr);
+        cursor_pending = false;
+        if (img) {
+            // Notifies also fire when the same cursor is re-set; the serial
+            // tells whether the pixels actually differ.
+            if (!cursor_image || cursor_image->serial != img->cursor_serial) {
+                auto image = std::make_shared<CursorImage>();
+                const uint32_t* pixels = xcb_xfixes_get_cursor_image_cursor_image(img);
+                image->pixels.assign(pixels, pixels + img->width * img->height);
+                image->width = img->width;
+                image->height = img->height;
+                image->xhot = img->xhot;
+                image->yhot = img->yhot;
+                image->serial = img->cursor_serial;
+                cursor_image = image;
+                data.changed = true;
+            }
+            cursor_x = img->x - origin_x;
+            cursor_y = img->y - origin_y;
+            free(img);
+        }
+        cursor_dirty = false;
+        pointer_dirty = false;
+    }
+    
+    if (pointer_pending) {
+        xcb_query_pointer_reply_t* pointer = xcb_query_pointer_reply(conn, pointer_cookie, nullptr);
+        pointer_pending = false;
+        if (pointer) {
+            cursor_x = pointer->win_x;
+            cursor_y = pointer->win_y;
+            free(pointer);
+        }
+        pointer_dirty = false;
+    }
+    
+    data.image = cursor_image;
+    data.x = cursor_x;
+    data.y = cursor_y;
+    data.visible = (bool)cursor_image;
+    return data;
+}
+
+void XCBCapturer::cleanup() {
+    if (conn) {
+        discardPending();
+        freeSlot(slots[1]);
+    }
+    memset(&slots[0], 0, sizeof(slots[0]));
+    slots[0].shmid = -1;
+    
+    conn = nullptr;
+    pipelined = false;
+    front = -1;
+    
+    X11Capturer::cleanup();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "capture.h"
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+#include <xcb/xfixes.h>
+
+// X11Capturer with the per-frame round trips taken off the critical path:
+// the image, cursor and pointer requests go out together over the same
+// connection through XCB and their replies are collected afterwards. Grabs
+// alternate between two SHM buffers, so when damage is already pending the
+// next grab runs while the previous frame is being rendered.
+class XCBCapturer : public X11Capturer {
+private:
+    struct ShmSlot {
+        xcb_shm_seg_t seg;
+        uint8_t* data;
+        size_t size;
+        size_t map_size;
+        bool owned;
+        bool memfd;
+        int shmid;
+    };
+    
+    xcb_connection_t* conn;
+    bool pipelined;
+    ShmSlot slots[2];
+    int front;
+    
+    bool image_pending;
+    int pending_slot;
+    int pending_x1, pending_y1, pending_x2, pending_y2;
+    xcb_shm_get_image_cookie_t image_cookie;
+    
+    bool cursor_pending;
+    bool pointer_pending;
+    xcb_xfixes_get_cursor_image_cookie_t cursor_cookie;
+    xcb_query_pointer_cookie_t pointer_cookie;
+    
+    bool allocSlot(ShmSlot& slot, size_t size);
+    void freeSlot(ShmSlot& slot);
+    bool syncSlots();
+    void requestImage(bool force);
+    void requestCursor();
+    void discardPending();
+
+public:
+    XCBCapturer();
+    ~XCBCapturer();
+    
+    bool init(const char* display_name, Window target_window, int w, int h);
+    
+    void beginFrame(bool want_cursor);
+    bool hasPendingFrame() const { return image_pending; }
+    
+    uint8_t* captureFrame(bool force = false);
+    
+    CursorData getCursor();
+    
+    void cleanup();
+};